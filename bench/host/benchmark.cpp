@@ -0,0 +1,10 @@
+// The Benchmark example, built for the host. Its servers are reached over
+// loopback, and its results are printed on the standard output.
+
+#include "../../examples/Benchmark/Benchmark.ino"
+
+int main()
+{
+    setup();
+    return 0;
+}
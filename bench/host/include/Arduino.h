@@ -0,0 +1,44 @@
+// Arduino core as used by the library and the benchmark sketches, on POSIX
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "IPAddress.h"
+#include "esp_heap_caps.h"
+
+#define log_e(f, ...) fprintf(stderr, "[E][%s] " f "\n", __func__, ##__VA_ARGS__)
+#define log_w(f, ...) fprintf(stderr, "[W][%s] " f "\n", __func__, ##__VA_ARGS__)
+#define log_i(f, ...) fprintf(stderr, "[I][%s] " f "\n", __func__, ##__VA_ARGS__)
+#define log_d(f, ...) do { if (0) fprintf(stderr, f, ##__VA_ARGS__); } while (0)
+#define log_v(f, ...) do { if (0) fprintf(stderr, f, ##__VA_ARGS__); } while (0)
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+static inline uint32_t esp_random(void) { return (uint32_t)random(); }
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(const uint8_t * buffer, size_t size) = 0;
+
+    size_t print(const char * s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t println(const char * s) { return print(s) + print("\n"); }
+    size_t printf(const char * format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buffer[512];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (n < 0) return 0;
+        return write((const uint8_t *)buffer, ((size_t)n < sizeof(buffer)) ? (size_t)n : sizeof(buffer) - 1);
+    }
+};
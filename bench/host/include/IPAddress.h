@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// IPv4 address, held in network order as by the Arduino core
+class IPAddress
+{
+  public:
+    IPAddress() {}
+    IPAddress(uint32_t address) : _address(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+        uint8_t bytes[4] = { a, b, c, d };
+        memcpy(&_address, bytes, sizeof(_address));
+    }
+    operator uint32_t() const { return _address; }
+    bool operator==(const IPAddress & other) const { return _address == other._address; }
+
+  private:
+    uint32_t _address = 0;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class IPv6Address
+{
+  public:
+    IPv6Address() {}
+    IPv6Address(const uint8_t * address) { memcpy(_address, address, sizeof(_address)); }
+    IPv6Address(const uint32_t * address) { memcpy(_address, address, sizeof(_address)); }
+    operator const uint8_t *() const { return _address; }
+    operator const uint32_t *() const { return (const uint32_t *)_address; }
+
+  private:
+    uint8_t _address[16] = {};
+};
@@ -0,0 +1,39 @@
+// Serial, ESP and WiFi objects of the Arduino core, for the sketches. The
+// host is always connected, and the serial port is the standard output.
+#pragma once
+
+#include "Arduino.h"
+
+#define WIFI_STA 1
+#define WL_CONNECTED 3
+
+class HostSerial : public Print
+{
+  public:
+    void begin(unsigned long) {}
+    size_t write(const uint8_t * buffer, size_t size) override;
+};
+extern HostSerial Serial;
+
+// Heap in use is taken from malloc statistics, out of a nominal heap
+class HostESP
+{
+  public:
+    uint32_t getFreeHeap(void);
+    uint32_t getMinFreeHeap(void);
+};
+extern HostESP ESP;
+
+class HostWiFi
+{
+  public:
+    struct Address {
+        std::string toString(void) const { return "127.0.0.1"; }
+    };
+    void mode(int) {}
+    void begin(const char *, const char *) {}
+    int status(void) { return WL_CONNECTED; }
+    Address localIP(void) { return Address(); }
+    int RSSI(void) { return 0; }
+};
+extern HostWiFi WiFi;
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+
+static inline void * heap_caps_malloc(size_t size, unsigned) { return malloc(size); }
+static inline void * heap_caps_calloc(size_t n, size_t size, unsigned) { return calloc(n, size); }
+static inline void heap_caps_free(void * p) { free(p); }
+// Plenty, so that no connection is refused for lack of memory
+static inline size_t heap_caps_get_free_size(unsigned) { return 1000000; }
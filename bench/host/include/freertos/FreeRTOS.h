@@ -0,0 +1,75 @@
+// FreeRTOS API as used by the library, implemented over std::thread in
+// shim.cpp. Ticks are milliseconds, and every spinlock is one global mutex.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define pdFAIL  0
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7fffffff
+#define configMAX_PRIORITIES 25
+#define portNUM_PROCESSORS 2
+#define CONFIG_FREERTOS_HZ 1000
+
+struct tskTaskControlBlock;
+typedef struct tskTaskControlBlock * TaskHandle_t;
+struct QueueDefinition;
+typedef struct QueueDefinition * SemaphoreHandle_t;
+typedef struct QueueDefinition * QueueHandle_t;
+typedef struct { uint8_t reserved[80]; } StaticSemaphore_t;
+typedef struct { uint8_t reserved[8]; } StaticTask_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void (*PendedFunction_t)(void *, uint32_t);
+
+typedef struct { int owner; unsigned count; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0, 0 }
+void vPortEnterCritical(portMUX_TYPE * mux);
+void vPortExitCritical(portMUX_TYPE * mux);
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define taskENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define taskEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+    UBaseType_t priority, TaskHandle_t * task, BaseType_t core);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+    UBaseType_t priority, TaskHandle_t * task, BaseType_t core);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+    UBaseType_t priority, StackType_t * stack_buffer, StaticTask_t * task_buffer, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TickType_t xTaskGetTickCount(void);
+void taskYIELD(void);
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t * buffer);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem);
+TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t sem);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+void vQueueDelete(QueueHandle_t queue);
+
+BaseType_t xTimerPendFunctionCall(PendedFunction_t fn, void * arg1, uint32_t arg2, TickType_t ticks);
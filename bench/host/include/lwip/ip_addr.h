@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define IPADDR_TYPE_V4  0U
+#define IPADDR_TYPE_V6  6U
+#define IPADDR_TYPE_ANY 46U
+#define IPADDR_ANY ((uint32_t)0x00000000UL)
+
+typedef struct ip4_addr { uint32_t addr; } ip4_addr_t;
+typedef struct ip6_addr { uint32_t addr[4]; uint8_t zone; } ip6_addr_t;
+struct ip_addr {
+    union { ip6_addr_t ip6; ip4_addr_t ip4; } u_addr;
+    uint8_t type;
+};
+typedef struct ip_addr ip_addr_t;
+
+#define IP_IS_V6(ip) ((ip)->type == IPADDR_TYPE_V6)
+#define IP_IS_V4(ip) ((ip)->type == IPADDR_TYPE_V4)
+#define ip_addr_isany(ip) (IP_IS_V6(ip) \
+    ? !((ip)->u_addr.ip6.addr[0] | (ip)->u_addr.ip6.addr[1] | (ip)->u_addr.ip6.addr[2] | (ip)->u_addr.ip6.addr[3]) \
+    : (ip)->u_addr.ip4.addr == 0)
+
+static inline int ipaddr_aton(const char * cp, ip_addr_t * addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, cp, &addr->u_addr.ip4.addr) == 1) {
+        addr->type = IPADDR_TYPE_V4;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, cp, addr->u_addr.ip6.addr) == 1) {
+        addr->type = IPADDR_TYPE_V6;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+// As in the default configuration of ESP-IDF
+#define TCP_MSS 1436
+#define TCP_SND_BUF (4 * TCP_MSS)
+#define TCP_WND (4 * TCP_MSS)
+#define LWIP_IPV6 1
+#define LWIP_IGMP 1
+#define LWIP_SOCKET_OFFSET 0
+#define MEMP_NUM_NETCONN CONFIG_LWIP_MAX_SOCKETS
@@ -0,0 +1,42 @@
+// Single pbufs allocated with their payload, as filled by the library
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum { PBUF_TRANSPORT, PBUF_IP, PBUF_LINK, PBUF_RAW_TX, PBUF_RAW } pbuf_layer;
+typedef enum { PBUF_RAM, PBUF_ROM, PBUF_REF, PBUF_POOL } pbuf_type;
+
+struct pbuf {
+    struct pbuf * next;
+    void * payload;
+    uint16_t tot_len;
+    uint16_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t ref;
+};
+
+static inline struct pbuf * pbuf_alloc(pbuf_layer, uint16_t length, pbuf_type)
+{
+    struct pbuf * p = (struct pbuf *)malloc(sizeof(struct pbuf) + length);
+    if (p == NULL) return NULL;
+    p->next = NULL;
+    p->payload = p + 1;
+    p->tot_len = p->len = length;
+    p->type = PBUF_RAM;
+    p->flags = 0;
+    p->ref = 1;
+    return p;
+}
+
+static inline void pbuf_realloc(struct pbuf * p, uint16_t length)
+{
+    if (length < p->len) p->tot_len = p->len = length;
+}
+
+static inline uint8_t pbuf_free(struct pbuf * p)
+{
+    free(p);
+    return 1;
+}
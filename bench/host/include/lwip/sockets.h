@@ -0,0 +1,65 @@
+// lwIP socket API over the host sockets. The errno of a connection in
+// progress is made that of lwIP, which the library checks for.
+#pragma once
+
+#include "sdkconfig.h"
+#include "lwip/opt.h"
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "freertos/FreeRTOS.h"
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const int HOST_EINPROGRESS = EINPROGRESS;
+#undef EINPROGRESS
+#define EINPROGRESS 119
+
+#ifndef ESP_IDF_VERSION_MAJOR
+#define ESP_IDF_VERSION_MAJOR 4
+#endif
+
+static inline int lwip_close(int s) { return close(s); }
+static inline ssize_t lwip_read(int s, void * mem, size_t len) { return read(s, mem, len); }
+static inline ssize_t lwip_write(int s, const void * data, size_t size) { return send(s, data, size, MSG_NOSIGNAL); }
+static inline ssize_t lwip_writev(int s, const struct iovec * iov, int iovcnt)
+{
+    struct msghdr msg = {};
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(s, &msg, MSG_NOSIGNAL);
+}
+static inline ssize_t lwip_recv(int s, void * mem, size_t len, int flags) { return recv(s, mem, len, flags); }
+static inline ssize_t lwip_recvfrom(int s, void * mem, size_t len, int flags, struct sockaddr * from, socklen_t * fromlen)
+{
+    return recvfrom(s, mem, len, flags, from, fromlen);
+}
+static inline ssize_t lwip_sendto(int s, const void * data, size_t size, int flags, const struct sockaddr * to, socklen_t tolen)
+{
+    return sendto(s, data, size, flags | MSG_NOSIGNAL, to, tolen);
+}
+static inline int lwip_connect(int s, const struct sockaddr * name, socklen_t namelen)
+{
+    int r = connect(s, name, namelen);
+    if (r < 0 && errno == HOST_EINPROGRESS) errno = EINPROGRESS;
+    return r;
+}
+static inline int lwip_accept(int s, struct sockaddr * addr, socklen_t * addrlen) { return accept(s, addr, addrlen); }
+static inline int lwip_ioctl(int s, long cmd, void * argp) { return ioctl(s, cmd, argp); }
+static inline int lwip_shutdown(int s, int how) { return shutdown(s, how); }
+
+// lwIP takes any pointer to the length
+static inline int lwip_getsockopt(int s, int level, int optname, void * optval, void * optlen)
+{
+    return getsockopt(s, level, optname, optval, (socklen_t *)optlen);
+}
+#define getsockopt(s, level, optname, optval, optlen) lwip_getsockopt(s, level, optname, optval, optlen)
@@ -0,0 +1,5 @@
+#pragma once
+
+// As in the default configuration of ESP-IDF. Loopback runs take two sockets
+// per connection, so the scaling and heap runs stop at half of them.
+#define CONFIG_LWIP_MAX_SOCKETS 16
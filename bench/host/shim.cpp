@@ -0,0 +1,363 @@
+// FreeRTOS, Arduino and lwIP functions used by the library, implemented on
+// POSIX, so that the library and the benchmark sketches run on a host over
+// loopback. Tasks are detached threads, and semaphores and queues are built
+// on std::mutex and std::condition_variable.
+
+#include "Arduino.h"
+#include "WiFi.h"
+#include "lwip/dns.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+#include <netdb.h>
+#include <unistd.h>
+
+static const auto _host_start = std::chrono::steady_clock::now();
+
+uint32_t millis(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _host_start).count();
+}
+
+uint32_t micros(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _host_start).count();
+}
+
+void delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+/*
+ * Tasks
+ * */
+
+struct tskTaskControlBlock {
+    int id;
+};
+
+static std::atomic<int> _host_task_ids(1);
+static thread_local TaskHandle_t _host_current = NULL;
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    // Threads not created as tasks, such as the main one, get a handle too
+    if (_host_current == NULL) _host_current = new tskTaskControlBlock{ _host_task_ids++ };
+    return _host_current;
+}
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t fn, const char *, uint32_t, void * arg,
+    UBaseType_t, TaskHandle_t * task, BaseType_t)
+{
+    TaskHandle_t t = new tskTaskControlBlock{ _host_task_ids++ };
+    if (task != NULL) *task = t;
+    std::thread([fn, arg, t] {
+        _host_current = t;
+        fn(arg);
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+    UBaseType_t priority, TaskHandle_t * task, BaseType_t core)
+{
+    return xTaskCreateUniversal(fn, name, stack, arg, priority, task, core);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+    UBaseType_t priority, StackType_t *, StaticTask_t *, BaseType_t core)
+{
+    TaskHandle_t task = NULL;
+    xTaskCreateUniversal(fn, name, stack, arg, priority, &task, core);
+    return task;
+}
+
+// Only a task deleting itself stops, which is all the library does
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == _host_current) {
+        while (true) pause();
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    delay(ticks);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t)
+{
+    return 0;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return millis();
+}
+
+void taskYIELD(void)
+{
+    std::this_thread::yield();
+}
+
+static std::recursive_mutex _host_critical;
+
+void vPortEnterCritical(portMUX_TYPE *)
+{
+    _host_critical.lock();
+}
+
+void vPortExitCritical(portMUX_TYPE *)
+{
+    _host_critical.unlock();
+}
+
+/*
+ * Semaphores and queues
+ * */
+
+struct QueueDefinition {
+    // Counting semaphores and mutexes, below the maximum count
+    std::mutex lock;
+    std::condition_variable changed;
+    unsigned count = 0;
+    unsigned max = 0;
+
+    // Recursive mutexes, with their holder
+    std::recursive_timed_mutex recursive;
+    std::atomic<TaskHandle_t> holder{ NULL };
+    int depth = 0;
+
+    // Queues
+    size_t item_size = 0;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+static SemaphoreHandle_t _host_semaphore(unsigned max, unsigned initial)
+{
+    SemaphoreHandle_t sem = new QueueDefinition();
+    sem->max = max;
+    sem->count = initial;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return _host_semaphore(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *)
+{
+    return xSemaphoreCreateMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    return new QueueDefinition();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return _host_semaphore(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    return _host_semaphore(max, initial);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> l(sem->lock);
+    auto available = [sem] { return sem->count > 0; };
+    if (ticks == portMAX_DELAY) {
+        sem->changed.wait(l, available);
+    } else if (!sem->changed.wait_for(l, std::chrono::milliseconds(ticks), available)) {
+        return pdFALSE;
+    }
+    sem->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    std::lock_guard<std::mutex> l(sem->lock);
+    if (sem->count >= sem->max) return pdFALSE;
+    sem->count++;
+    sem->changed.notify_one();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        sem->recursive.lock();
+    } else if (!sem->recursive.try_lock_for(std::chrono::milliseconds(ticks))) {
+        return pdFALSE;
+    }
+    sem->depth++;
+    sem->holder = xTaskGetCurrentTaskHandle();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+    if (--sem->depth == 0) sem->holder = NULL;
+    sem->recursive.unlock();
+    return pdTRUE;
+}
+
+TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t sem)
+{
+    return sem->holder.load();
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    delete sem;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t queue = new QueueDefinition();
+    queue->max = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> l(queue->lock);
+    auto room = [queue] { return queue->items.size() < queue->max; };
+    if (ticks == portMAX_DELAY) {
+        queue->changed.wait(l, room);
+    } else if (!queue->changed.wait_for(l, std::chrono::milliseconds(ticks), room)) {
+        return pdFALSE;
+    }
+    queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->item_size);
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> l(queue->lock);
+    auto waiting = [queue] { return !queue->items.empty(); };
+    if (ticks == portMAX_DELAY) {
+        queue->changed.wait(l, waiting);
+    } else if (!queue->changed.wait_for(l, std::chrono::milliseconds(ticks), waiting)) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> l(queue->lock);
+    return queue->items.size();
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+// Run on a thread of its own, as the timer service task would
+BaseType_t xTimerPendFunctionCall(PendedFunction_t fn, void * arg1, uint32_t arg2, TickType_t)
+{
+    std::thread([fn, arg1, arg2] { fn(arg1, arg2); }).detach();
+    return pdPASS;
+}
+
+/*
+ * DNS
+ * */
+
+static bool _host_resolve(const char * name, bool v6, ip_addr_t * addr)
+{
+    struct addrinfo hints = {};
+    struct addrinfo * res = NULL;
+    hints.ai_family = v6 ? AF_INET6 : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res) != 0) return false;
+
+    memset(addr, 0, sizeof(*addr));
+    if (res->ai_family == AF_INET) {
+        addr->type = IPADDR_TYPE_V4;
+        addr->u_addr.ip4.addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    } else {
+        addr->type = IPADDR_TYPE_V6;
+        memcpy(addr->u_addr.ip6.addr, &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr, 16);
+    }
+    freeaddrinfo(res);
+    return true;
+}
+
+// Names are resolved on a thread of their own, and reported to the callback
+// one at a time, as from the LWIP thread
+static std::mutex _host_tcpip;
+
+err_t dns_gethostbyname_addrtype(const char * hostname, ip_addr_t * addr, dns_found_callback found,
+    void * callback_arg, uint8_t dns_addrtype)
+{
+    if (ipaddr_aton(hostname, addr)) return ERR_OK;
+
+    std::string name(hostname);
+    std::thread([name, found, callback_arg, dns_addrtype] {
+        bool v6 = (dns_addrtype == LWIP_DNS_ADDRTYPE_IPV6 || dns_addrtype == LWIP_DNS_ADDRTYPE_IPV6_IPV4);
+        bool fallback = (dns_addrtype == LWIP_DNS_ADDRTYPE_IPV4_IPV6 || dns_addrtype == LWIP_DNS_ADDRTYPE_IPV6_IPV4);
+        ip_addr_t result;
+        bool ok = _host_resolve(name.c_str(), v6, &result) || (fallback && _host_resolve(name.c_str(), !v6, &result));
+        std::lock_guard<std::mutex> l(_host_tcpip);
+        found(name.c_str(), ok ? &result : NULL, callback_arg);
+    }).detach();
+    return ERR_INPROGRESS;
+}
+
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * addr, dns_found_callback found, void * callback_arg)
+{
+    return dns_gethostbyname_addrtype(hostname, addr, found, callback_arg, LWIP_DNS_ADDRTYPE_IPV4);
+}
+
+/*
+ * Arduino core objects used by the sketches
+ * */
+
+HostSerial Serial;
+HostESP ESP;
+HostWiFi WiFi;
+
+size_t HostSerial::write(const uint8_t * buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+// Nominal heap, as large as the internal RAM of an ESP32
+#define HOST_HEAP_SIZE 327680
+static uint32_t _host_min_free = HOST_HEAP_SIZE;
+
+uint32_t HostESP::getFreeHeap(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    uint32_t used = (uint32_t)info.uordblks;
+    uint32_t free = (used < HOST_HEAP_SIZE) ? HOST_HEAP_SIZE - used : 0;
+    if (free < _host_min_free) _host_min_free = free;
+    return free;
+}
+
+uint32_t HostESP::getMinFreeHeap(void)
+{
+    getFreeHeap();
+    return _host_min_free;
+}
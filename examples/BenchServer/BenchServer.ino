@@ -0,0 +1,108 @@
+// Servers for load tests driven from another machine: echo on BENCH_PORT,
+// discard on the next port, and a source on the one after, which sends data
+// as fast as the connection takes it until the peer closes. For example,
+// with the device at 192.168.1.50:
+//
+//   head -c 10000000 /dev/zero | nc -N 192.168.1.50 7001    (receive throughput)
+//   nc 192.168.1.50 7002 | pv > /dev/null                   (send throughput)
+//
+// or any load generator opening many connections to the echo port, to
+// measure accept rate and scaling. The Benchmark example run on a second
+// device, with BENCH_HOST set to this one, drives the echo and discard
+// servers too.
+//
+// Every BENCH_REPORT_INTERVAL milliseconds, one line holding a JSON object
+// is printed with the number of clients, the free heap, and the counters of
+// AsyncSocketBase::printStats() over the interval.
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <AsyncTCP.h>
+
+#ifndef BENCH_WIFI_SSID
+#define BENCH_WIFI_SSID "your-ssid"
+#endif
+#ifndef BENCH_WIFI_PASSWORD
+#define BENCH_WIFI_PASSWORD "your-password"
+#endif
+#ifndef BENCH_PORT
+#define BENCH_PORT 7000
+#endif
+#define BENCH_REPORT_INTERVAL 5000
+
+static AsyncServer echoServer(BENCH_PORT);
+static AsyncServer discardServer(BENCH_PORT + 1);
+static AsyncServer sourceServer(BENCH_PORT + 2);
+
+static char block[1436];
+static uint32_t lastReport;
+
+// The block is never changed, so it is queued without a copy
+static void fill(AsyncClient * c)
+{
+    bool added = false;
+    size_t room;
+    while ((room = c->space()) > 0) {
+        if (c->add(block, (room < sizeof(block)) ? room : sizeof(block), 0) == 0) break;
+        added = true;
+    }
+    if (added) c->send();
+}
+
+static void startServers(void)
+{
+    echoServer.setNoDelay(true);
+    echoServer.onClient([](void *, AsyncClient * c) {
+        c->setNoDelay(true);
+        c->onData([](void *, AsyncClient * c, void * data, size_t len) {
+            c->write((const char *)data, len);
+        }, NULL);
+        c->onDisconnect([](void *, AsyncClient * c) { delete c; }, NULL);
+    }, NULL);
+    echoServer.begin();
+
+    // Received data is acknowledged once the (missing) data handler returns
+    discardServer.onClient([](void *, AsyncClient * c) {
+        c->onDisconnect([](void *, AsyncClient * c) { delete c; }, NULL);
+    }, NULL);
+    discardServer.begin();
+
+    sourceServer.onClient([](void *, AsyncClient * c) {
+        c->onAck([](void *, AsyncClient * c, size_t, uint32_t) { fill(c); }, NULL);
+        c->onDisconnect([](void *, AsyncClient * c) { delete c; }, NULL);
+        fill(c);
+    }, NULL);
+    sourceServer.begin();
+}
+
+void setup()
+{
+    Serial.begin(115200);
+
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(BENCH_WIFI_SSID, BENCH_WIFI_PASSWORD);
+    while (WiFi.status() != WL_CONNECTED) delay(100);
+    Serial.printf("{\"wifi\":\"%s\",\"rssi\":%d,\"port\":%u}\n",
+        WiFi.localIP().toString().c_str(), WiFi.RSSI(), (unsigned)BENCH_PORT);
+
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)i;
+    startServers();
+    AsyncSocketBase::resetStats();
+    lastReport = millis();
+}
+
+void loop()
+{
+    if (millis() - lastReport < BENCH_REPORT_INTERVAL) {
+        delay(10);
+        return;
+    }
+    lastReport = millis();
+
+    Serial.printf("{\"run\":\"server\",\"uptime_ms\":%u,\"clients\":%u,\"heap_free\":%u,\"heap_min_free\":%u,\"stats\":",
+        (unsigned)lastReport, (unsigned)(echoServer.getClientCount() + discardServer.getClientCount() + sourceServer.getClientCount()),
+        (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap());
+    AsyncSocketBase::printStats(Serial);
+    Serial.println("}");
+    AsyncSocketBase::resetStats();
+}
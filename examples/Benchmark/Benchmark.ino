@@ -0,0 +1,350 @@
+// Load tests for the socket tasks: throughput of one connection, echo round
+// trip latency, connection rate, scaling with the number of clients, and
+// heap used per client. Each run prints one line holding a JSON object with
+// its results, along with the counters of AsyncSocketBase::printStats(), so
+// that runs before and after a change can be compared by a script reading
+// the serial port.
+//
+// The echo and discard servers these runs connect to are started on this
+// device and reached over loopback, which measures the library and lwIP
+// without the radio. Set BENCH_HOST to another device running the
+// BenchServer example to measure over the network instead.
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <AsyncTCP.h>
+#include <algorithm>
+
+// Network to join. Loopback runs need none.
+#ifndef BENCH_WIFI_SSID
+#define BENCH_WIFI_SSID ""
+#endif
+#ifndef BENCH_WIFI_PASSWORD
+#define BENCH_WIFI_PASSWORD ""
+#endif
+
+// Host with an echo server on BENCH_PORT and a discard server on the next port
+#ifndef BENCH_HOST
+#define BENCH_HOST "127.0.0.1"
+#endif
+#ifndef BENCH_PORT
+#define BENCH_PORT 7000
+#endif
+
+// Length of the throughput and connection rate runs, in seconds
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 10
+#endif
+
+// Round trips of the latency run, and size of each message
+#define BENCH_PINGS 1000
+#define BENCH_PING_SIZE 64
+
+// Most clients the scaling and heap runs open. Over loopback, each client
+// also takes a socket on the server side, and lwIP allows
+// CONFIG_LWIP_MAX_SOCKETS in all, so the runs stop at the first that fails.
+#define BENCH_MAX_CLIENTS 32
+
+static AsyncServer echoServer(BENCH_PORT);
+static AsyncServer discardServer(BENCH_PORT + 1);
+
+static AsyncClient * clients[BENCH_MAX_CLIENTS];
+static char block[1436];
+static char ping[BENCH_PING_SIZE];
+static uint32_t rtt[BENCH_PINGS];
+
+// Written by callbacks on the asyncTcpSock task, read by the runs below
+static volatile int connState;
+static volatile bool done;
+static volatile uint32_t bytesAcked;
+static volatile uint32_t bytesReceived;
+static volatile bool received;
+static volatile uint32_t runStart;
+static volatile uint32_t runEnd;
+static volatile uint32_t pings;
+static volatile uint32_t pingSent;
+static volatile uint32_t pingGot;
+static volatile uint32_t echoes;
+static volatile uint32_t lastEcho;
+
+static bool waitUntil(volatile bool & flag, uint32_t timeout)
+{
+    uint32_t start = millis();
+    while (!flag && millis() - start < timeout) delay(1);
+    return flag;
+}
+
+// Results of a run, and the counters of the socket tasks since it started
+static void report(const char * run, const char * fmt, ...)
+{
+    char results[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(results, sizeof(results), fmt, args);
+    va_end(args);
+
+    Serial.printf("{\"run\":\"%s\",%s,\"loopback\":%s,\"heap_free\":%u,\"stats\":",
+        run, results, strcmp(BENCH_HOST, "127.0.0.1") ? "false" : "true", (unsigned)ESP.getFreeHeap());
+    AsyncSocketBase::printStats(Serial);
+    Serial.println("}");
+}
+
+static void startServers(void)
+{
+    echoServer.setNoDelay(true);
+    echoServer.onClient([](void *, AsyncClient * c) {
+        c->setNoDelay(true);
+        c->onData([](void *, AsyncClient * c, void * data, size_t len) {
+            c->write((const char *)data, len);
+        }, NULL);
+        c->onDisconnect([](void *, AsyncClient * c) { delete c; }, NULL);
+    }, NULL);
+    echoServer.begin();
+
+    // Counts what reaches it, which is what the throughput run reports
+    discardServer.onClient([](void *, AsyncClient * c) {
+        c->onData([](void *, AsyncClient *, void *, size_t len) { bytesReceived += len; }, NULL);
+        c->onDisconnect([](void *, AsyncClient * c) {
+            received = true;
+            delete c;
+        }, NULL);
+    }, NULL);
+    discardServer.begin();
+}
+
+// Connect and wait for the outcome. Handlers for the connection are set
+// afterwards, replacing the ones set here.
+static bool openClient(AsyncClient * c, uint16_t port)
+{
+    connState = 0;
+    c->onConnect([](void *, AsyncClient *) { connState = 1; }, NULL);
+    c->onError([](void *, AsyncClient *, int8_t) { connState = -1; }, NULL);
+    if (!c->connect(BENCH_HOST, port)) return false;
+
+    uint32_t start = millis();
+    while (connState == 0 && millis() - start < 5000) delay(1);
+    return connState == 1;
+}
+
+static void closeClients(int n)
+{
+    for (int i = 0; i < n; i++) {
+        delete clients[i];
+        clients[i] = NULL;
+    }
+    // Let the server side see the connections go
+    delay(200);
+}
+
+// Keep the send buffer full until the end of the run. The block is never
+// changed, so it is queued without a copy.
+static void fill(AsyncClient * c)
+{
+    if ((int32_t)(millis() - runEnd) >= 0) {
+        c->close();
+        return;
+    }
+    bool added = false;
+    size_t room;
+    while ((room = c->space()) > 0) {
+        if (c->add(block, std::min(room, sizeof(block)), 0) == 0) break;
+        added = true;
+    }
+    if (added) c->send();
+}
+
+// Without CONFIG_ASYNC_TCP_ACK_TRACKING, onAck reports bytes as soon as
+// lwIP buffers them, so the bytes taken from the run are the ones the
+// discard server received, and bytes_acked is only shown alongside. Over
+// the network, where that server is on the other device, bytes_acked is all
+// there is.
+static void runThroughput(void)
+{
+    AsyncClient * c = new AsyncClient;
+    AsyncSocketBase::resetStats();
+    done = false;
+    received = false;
+    bytesAcked = 0;
+    bytesReceived = 0;
+    c->onConnect([](void *, AsyncClient * c) {
+        runStart = millis();
+        runEnd = runStart + BENCH_SECONDS * 1000;
+        fill(c);
+    }, NULL);
+    c->onAck([](void *, AsyncClient * c, size_t len, uint32_t) {
+        bytesAcked += len;
+        fill(c);
+    }, NULL);
+    c->onError([](void *, AsyncClient *, int8_t) { done = true; }, NULL);
+    c->onDisconnect([](void *, AsyncClient *) { done = true; }, NULL);
+
+    bool loopback = !strcmp(BENCH_HOST, "127.0.0.1");
+    if (c->connect(BENCH_HOST, BENCH_PORT + 1)) {
+        waitUntil(done, (BENCH_SECONDS + 5) * 1000);
+        if (loopback) waitUntil(received, 5000);
+    }
+    uint32_t ms = millis() - runStart;
+    uint32_t bytes = loopback ? bytesReceived : bytesAcked;
+    report("throughput", "\"bytes\":%u,\"bytes_acked\":%u,\"ack_tracking\":%s,\"ms\":%u,\"kbit_per_s\":%u",
+        (unsigned)bytes, (unsigned)bytesAcked, CONFIG_ASYNC_TCP_ACK_TRACKING ? "true" : "false",
+        (unsigned)ms, ms ? (unsigned)((uint64_t)bytes * 8 / ms) : 0u);
+    delete c;
+}
+
+static void sendPing(AsyncClient * c)
+{
+    pingSent = micros();
+    c->write(ping, sizeof(ping));
+}
+
+static void runLatency(void)
+{
+    AsyncClient * c = new AsyncClient;
+    AsyncSocketBase::resetStats();
+    done = false;
+    pings = 0;
+    pingGot = 0;
+    c->setNoDelay(true);
+    c->onConnect([](void *, AsyncClient * c) { sendPing(c); }, NULL);
+    c->onData([](void *, AsyncClient * c, void *, size_t len) {
+        pingGot += len;
+        if (pingGot < sizeof(ping)) return;
+        pingGot -= sizeof(ping);
+        rtt[pings++] = micros() - pingSent;
+        if (pings < BENCH_PINGS) sendPing(c);
+        else c->close();
+    }, NULL);
+    c->onError([](void *, AsyncClient *, int8_t) { done = true; }, NULL);
+    c->onDisconnect([](void *, AsyncClient *) { done = true; }, NULL);
+
+    if (c->connect(BENCH_HOST, BENCH_PORT)) waitUntil(done, 30000);
+    uint32_t n = pings;
+    std::sort(rtt, rtt + n);
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < n; i++) sum += rtt[i];
+    report("latency", "\"pings\":%u,\"size\":%u,\"mean_us\":%u,\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"max_us\":%u",
+        (unsigned)n, (unsigned)sizeof(ping), n ? (unsigned)(sum / n) : 0u, n ? (unsigned)rtt[n / 2] : 0u,
+        n ? (unsigned)rtt[n * 9 / 10] : 0u, n ? (unsigned)rtt[n * 99 / 100] : 0u, n ? (unsigned)rtt[n - 1] : 0u);
+    delete c;
+}
+
+// One connection after another, each closed as soon as it is established
+static void runConnectRate(void)
+{
+    uint32_t connections = 0;
+    uint32_t failures = 0;
+    AsyncSocketBase::resetStats();
+    uint32_t start = millis();
+    while (millis() - start < BENCH_SECONDS * 1000) {
+        AsyncClient * c = new AsyncClient;
+        done = false;
+        if (openClient(c, BENCH_PORT)) {
+            c->onDisconnect([](void *, AsyncClient *) { done = true; }, NULL);
+            c->close();
+            waitUntil(done, 5000);
+            connections++;
+        } else {
+            failures++;
+        }
+        delete c;
+    }
+    uint32_t ms = millis() - start;
+    report("connect_rate", "\"connections\":%u,\"failures\":%u,\"ms\":%u,\"per_s\":%u",
+        (unsigned)connections, (unsigned)failures, (unsigned)ms, ms ? (unsigned)(connections * 1000 / ms) : 0u);
+}
+
+// Every client sends one message, and waits for it to come back
+static uint32_t echoRound(int n)
+{
+    echoes = 0;
+    uint32_t start = micros();
+    lastEcho = start;
+    for (int i = 0; i < n; i++) clients[i]->write(ping, sizeof(ping));
+    uint32_t wait = millis();
+    while (echoes < (uint32_t)n && millis() - wait < 5000) delay(1);
+    return lastEcho - start;
+}
+
+// Round trip time across all clients, as more of them are connected
+static void runScaling(void)
+{
+    int n = 0;
+    AsyncSocketBase::resetStats();
+    while (n < BENCH_MAX_CLIENTS) {
+        AsyncClient * c = new AsyncClient;
+        if (!openClient(c, BENCH_PORT)) {
+            delete c;
+            break;
+        }
+        c->setNoDelay(true);
+        c->onData([](void *, AsyncClient *, void *, size_t len) {
+            // Messages are small enough to arrive whole
+            if (len < sizeof(ping)) return;
+            lastEcho = micros();
+            echoes++;
+        }, NULL);
+        clients[n++] = c;
+
+        if ((n & (n - 1)) == 0 || n == BENCH_MAX_CLIENTS) {
+            uint32_t us = echoRound(n);
+            report("scaling", "\"clients\":%d,\"echoes\":%u,\"round_us\":%u", n, (unsigned)echoes, (unsigned)us);
+        }
+    }
+    uint32_t us = (n > 0) ? echoRound(n) : 0;
+    report("scaling_limit", "\"clients\":%d,\"echoes\":%u,\"round_us\":%u", n, (unsigned)echoes, (unsigned)us);
+    closeClients(n);
+}
+
+// Heap taken by idle connected clients. Over loopback this includes the
+// client on the server side of each connection.
+static void runHeap(void)
+{
+    int n = 0;
+    AsyncSocketBase::resetStats();
+    uint32_t before = ESP.getFreeHeap();
+    while (n < BENCH_MAX_CLIENTS) {
+        AsyncClient * c = new AsyncClient;
+        if (!openClient(c, BENCH_PORT)) {
+            delete c;
+            break;
+        }
+        clients[n++] = c;
+    }
+    delay(200);
+    uint32_t after = ESP.getFreeHeap();
+    AsyncClientMemoryInfo info = {};
+    if (n > 0) clients[0]->getMemoryUsage(&info);
+    report("heap", "\"clients\":%d,\"heap_per_client\":%u,\"client_object\":%u,\"client_total\":%u",
+        n, n ? (unsigned)((before - after) / n) : 0u, (unsigned)info.object, (unsigned)info.total);
+    closeClients(n);
+}
+
+void setup()
+{
+    Serial.begin(115200);
+
+    // Brings up the TCP/IP stack, which loopback needs too
+    WiFi.mode(WIFI_STA);
+    if (strlen(BENCH_WIFI_SSID) > 0) {
+        WiFi.begin(BENCH_WIFI_SSID, BENCH_WIFI_PASSWORD);
+        while (WiFi.status() != WL_CONNECTED) delay(100);
+        Serial.printf("{\"wifi\":\"%s\",\"rssi\":%d}\n", WiFi.localIP().toString().c_str(), WiFi.RSSI());
+    }
+
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)i;
+    memset(ping, 'p', sizeof(ping));
+    startServers();
+    delay(100);
+
+    runThroughput();
+    runLatency();
+    runConnectRate();
+    runScaling();
+    runHeap();
+    Serial.println("{\"run\":\"end\"}");
+}
+
+void loop()
+{
+    delay(1000);
+}
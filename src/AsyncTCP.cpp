@@ -25,6 +25,7 @@
 
 #include "AsyncTCP.h"
 #include "esp_task_wdt.h"
+#include "freertos/timers.h"
 
 #include <lwip/sockets.h>
 #include <lwip/netdb.h>
@@ -32,789 +33,4239 @@
 
 #include <lwip/dns.h>
 
-#include <list>
+// Without SIOCOUTQ, ACK tracking finds the TCP PCB of a socket through the
+// private socket table of lwIP 2.1 and later, as built into ESP-IDF
+#if CONFIG_ASYNC_TCP_ACK_TRACKING && !defined(SIOCOUTQ)
+#if !defined(ESP_IDF_VERSION_MAJOR)
+#error "CONFIG_ASYNC_TCP_ACK_TRACKING needs SIOCOUTQ, or the lwIP of ESP-IDF"
+#endif
+#include <lwip/init.h>
+#if !defined(LWIP_VERSION_MAJOR) || LWIP_VERSION_MAJOR != 2 || LWIP_VERSION_MINOR < 1 || !LWIP_TCP \
+    || !__has_include(<lwip/priv/sockets_priv.h>)
+#error "CONFIG_ASYNC_TCP_ACK_TRACKING reads lwIP 2.1 internals, which this lwIP does not have"
+#endif
+#include <lwip/priv/sockets_priv.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
+#endif
+
+#include <atomic>
+#include <new>
+
+#if ASYNC_TCP_SSL_ENABLED
+#include "AsyncTCP_TLS_Context.h"
+#include "freertos/queue.h"
+#endif
 
 #undef close
 #undef connect
 #undef write
 #undef read
 
-static TaskHandle_t _asyncsock_service_task_handle = NULL;
-static SemaphoreHandle_t _asyncsock_mutex = NULL;
-
-typedef std::list<AsyncSocketBase *>::iterator sockIterator;
-
 void _asynctcpsock_task(void *);
 
-#define MAX_PAYLOAD_SIZE    1360
+// Number of slots in the timer wheel of each worker. Must be a power of 2.
+#define ASYNCSOCK_TIMER_SLOTS 64
 
-// Since the only task reading from these sockets is the asyncTcpPSock task
-// and all socket clients are serviced sequentially, only one read buffer
-// is needed, and it can therefore be statically allocated
-static uint8_t _readBuffer[MAX_PAYLOAD_SIZE];
+// Maximum number of onAck notifications per writable event
+#if CONFIG_ASYNC_TCP_ACK_PER_BUFFER
+#define ASYNCSOCK_ACK_BATCH CONFIG_ASYNC_TCP_WRITEV_MAX
+#else
+#define ASYNCSOCK_ACK_BATCH 1
+#endif
 
-// Start async socket task
-static bool _start_asyncsock_task(void)
-{
-    if (!_asyncsock_service_task_handle) {
-        xTaskCreateUniversal(
-            _asynctcpsock_task,
-            "asyncTcpSock",
-            8192 * 2,
-            NULL,
-            3,                              // <-- TODO: make priority a compile-time parameter
-            &_asyncsock_service_task_handle,
-            CONFIG_ASYNC_TCP_RUNNING_CORE);
-        if (!_asyncsock_service_task_handle) return false;
-    }
-    return true;
-}
+// Maximum number of sockets that can be waiting to migrate into a worker
+#define ASYNCSOCK_INBOX_SIZE 8
 
-// Actual asynchronous socket task
-void _asynctcpsock_task(void *)
+// State of one asyncTcpSock service task. Each worker services its own shard
+// of the monitored sockets, with its own select() set, read buffer and lock.
+// All sockets in a shard are serviced sequentially by the same task.
+struct AsyncSocketWorker
 {
-    auto & _socketBaseList = AsyncSocketBase::_getSocketBaseList();
-
-    while (true) {
-        sockIterator it;
-        fd_set sockSet_r;
-        fd_set sockSet_w;
-        int max_sock = 0;
-
-        std::list<AsyncSocketBase *> sockList;
-
-        xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-
-        // Collect all of the active sockets into socket set
-        FD_ZERO(&sockSet_r); FD_ZERO(&sockSet_w);
-        for (it = _socketBaseList.begin(); it != _socketBaseList.end(); it++) {
-            if ((*it)->_socket != -1) {
-                FD_SET((*it)->_socket, &sockSet_r);
-                FD_SET((*it)->_socket, &sockSet_w);
-                (*it)->_selected = true;
-                if (max_sock <= (*it)->_socket) max_sock = (*it)->_socket + 1;
-            }
-        }
-
-        // Wait for activity on all monitored sockets
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        uint32_t t1 = millis();
-        int r = select(max_sock, &sockSet_r, &sockSet_w, NULL, &tv);
-
-        // Check all sockets to see which ones are active
-        uint32_t nActive = 0;
-        if (r > 0) {
-            // Collect and notify all writable sockets
-            for (it = _socketBaseList.begin(); it != _socketBaseList.end(); it++) {
-                if ((*it)->_selected && FD_ISSET((*it)->_socket, &sockSet_w)) {
-                    sockList.push_back(*it);
-                }
-            }
-            for (it = sockList.begin(); it != sockList.end(); it++) {
-#if CONFIG_ASYNC_TCP_USE_WDT
-                if (esp_task_wdt_add(NULL) != ESP_OK) {
-                    log_e("Failed to add async task to WDT");
-                }
-#endif
-                if ((*it)->_sockIsWriteable()) {
-                    (*it)->_sock_lastactivity = millis();
-                    nActive++;
-                }
-#if CONFIG_ASYNC_TCP_USE_WDT
-                if (esp_task_wdt_delete(NULL) != ESP_OK) {
-                    log_e("Failed to remove loop task from WDT");
-                }
+    uint8_t index = 0;
+    TaskHandle_t task = NULL;
+    SemaphoreHandle_t mutex = NULL;
+
+    // Registry of monitored socket objects in this shard. Each socket knows
+    // its own slot, so removal is done by moving the last entry into the
+    // freed slot.
+    AsyncSocketBase * sockets[CONFIG_ASYNC_TCP_MAX_SOCKETS];
+    uint16_t nSockets = 0;
+
+    // Sockets collected for notification on the current pass. Entries are
+    // set to NULL if the socket is destroyed before being notified.
+    AsyncSocketBase * ready[CONFIG_ASYNC_TCP_MAX_SOCKETS];
+    uint16_t nReady = 0;
+
+    // Number of sockets assigned to this worker, including those in inbox
+    std::atomic<uint32_t> load;
+
+    // Sockets handed over from another worker, not yet monitored here. This
+    // is protected by a spinlock instead of the worker mutex, so that a
+    // worker never has to take the lock of another worker.
+    portMUX_TYPE inboxMux = portMUX_INITIALIZER_UNLOCKED;
+    AsyncSocketBase * inbox[ASYNCSOCK_INBOX_SIZE];
+    uint8_t inboxCount = 0;
+
+    // Control socket used to wake up the task out of select() when the set of
+    // monitored sockets changes. This is a UDP socket bound to the loopback
+    // interface, that sends datagrams to itself. Note that this takes up one
+    // of the CONFIG_LWIP_MAX_SOCKETS sockets available per worker.
+    int ctrlSock = -1;
+    struct sockaddr_in ctrlAddr;
+    std::atomic<bool> wakeupPending;
+
+    // Since the only task reading from the sockets in this shard is the
+    // worker task itself and all socket clients are serviced sequentially,
+    // only one read buffer per worker is needed.
+#if CONFIG_ASYNC_TCP_RX_BUFFER_PSRAM
+    uint8_t * readBuffer = NULL;
+#else
+    uint8_t readBuffer[CONFIG_ASYNC_TCP_RX_BUFFER_SIZE];
 #endif
-            }
-            sockList.clear();
 
-            // Collect and notify all readable sockets
-            for (it = _socketBaseList.begin(); it != _socketBaseList.end(); it++) {
-                if ((*it)->_selected && FD_ISSET((*it)->_socket, &sockSet_r)) {
-                    sockList.push_back(*it);
-                }
-            }
-            for (it = sockList.begin(); it != sockList.end(); it++) {
-#if CONFIG_ASYNC_TCP_USE_WDT
-                if (esp_task_wdt_add(NULL) != ESP_OK) {
-                    log_e("Failed to add async task to WDT");
-                }
+    // Datagrams are received whole, into a buffer allocated on first use by
+    // a UDP socket of this shard
+    uint8_t * udpBuffer = NULL;
+
+    // Socket currently being notified. Cleared if the socket is destroyed
+    // from within its own callback.
+    AsyncSocketBase * current = NULL;
+
+    // Timer wheel holding the next deadline of each socket. Time is divided
+    // into ticks of CONFIG_ASYNC_TCP_TIMER_RESOLUTION ms, and each slot holds
+    // a list of the sockets due during the ticks that map into it. Deadlines
+    // further away than one turn of the wheel share a slot with nearer ones,
+    // and are just skipped until their turn comes.
+    AsyncSocketBase * timerSlots[ASYNCSOCK_TIMER_SLOTS];
+    uint32_t timerTick = 0;         // Next tick to be expired
+    uint32_t timerTickStart = 0;    // Start of that tick, in milliseconds
+
+#if CONFIG_ASYNC_TCP_STATS
+    // Counters of this shard. Clients are also written to from application
+    // tasks, so these are only ever updated under the spinlock.
+    portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+    AsyncTCPStats stats;
+
+    // Longest socket dispatch of the current pass of the event loop
+    uint32_t passDispatchMax = 0;
 #endif
-                (*it)->_sock_lastactivity = millis();
-                (*it)->_sockIsReadable();
-                nActive++;
-#if CONFIG_ASYNC_TCP_USE_WDT
-                if (esp_task_wdt_delete(NULL) != ESP_OK) {
-                    log_e("Failed to remove loop task from WDT");
-                }
-#endif
-            }
-            sockList.clear();
-        }
 
-        // Collect and notify all sockets waiting for DNS completion
-        for (it = _socketBaseList.begin(); it != _socketBaseList.end(); it++) {
-            // Collect socket that has finished resolving DNS (with or without error)
-            if ((*it)->_isdnsfinished) {
-                sockList.push_back(*it);
-            }
-        }
-        for (it = sockList.begin(); it != sockList.end(); it++) {
-#if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_add(NULL) != ESP_OK){
-                log_e("Failed to add async task to WDT");
-            }
-#endif
-            (*it)->_isdnsfinished = false;
-            (*it)->_sockDelayedConnect();
-#if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_delete(NULL) != ESP_OK){
-                log_e("Failed to remove loop task from WDT");
-            }
+    AsyncSocketWorker(void) : load(0), wakeupPending(false)
+    {
+        mutex = xSemaphoreCreateRecursiveMutex();
+        memset(timerSlots, 0, sizeof(timerSlots));
+        timerTickStart = millis();
+#if CONFIG_ASYNC_TCP_STATS
+        memset(&stats, 0, sizeof(stats));
 #endif
-        }
-        sockList.clear();
+    }
 
-        xSemaphoreGiveRecursive(_asyncsock_mutex);
+#if CONFIG_ASYNC_TCP_STATS
+    // Account for the time taken to handle the events of a socket, unless it
+    // was destroyed meanwhile
+    void statDispatch(AsyncSocketBase * sock, uint32_t elapsed)
+    {
+        if (elapsed > passDispatchMax) passDispatchMax = elapsed;
+        if (sock == NULL) return;
+        sock->_dispatches++;
+        sock->_dispatch_time_total += elapsed;
+        if (elapsed > sock->_dispatch_time_max) sock->_dispatch_time_max = elapsed;
+    }
 
-        uint32_t t2 = millis();
+    // Account for one pass through the event loop
+    void statPass(uint32_t elapsed)
+    {
+        portENTER_CRITICAL(&statsMux);
+        stats.wakeups++;
+        stats.loop_time_total += elapsed;
+        if (elapsed > stats.loop_time_max) stats.loop_time_max = elapsed;
+        if (passDispatchMax > stats.dispatch_time_max) stats.dispatch_time_max = passDispatchMax;
+        portEXIT_CRITICAL(&statsMux);
+        passDispatchMax = 0;
+    }
+#endif
 
-        // Ugly hack to work around the apparent situation of select() call NOT
-        // yielding to other tasks if using a nonzero wait period.
-        uint32_t d = (nActive == 0 && t2 - t1 < 125) ? 125 - (t2 - t1) : 1;
-        delay(d);
+    // Set deadline of socket, replacing any previous one. Caller must hold
+    // the worker mutex.
+    void timerArm(AsyncSocketBase * sock, uint32_t expires)
+    {
+        timerCancel(sock);
+
+        // Socket goes into the earliest tick at the end of which the deadline
+        // has passed. Deadlines already passed go into the next tick to be
+        // expired.
+        int32_t ahead = (int32_t)(expires - timerTickStart);
+        uint32_t tick = timerTick + ((ahead > 0) ? (ahead - 1) / CONFIG_ASYNC_TCP_TIMER_RESOLUTION : 0);
+        int16_t slot = tick & (ASYNCSOCK_TIMER_SLOTS - 1);
+
+        sock->_timer_expires = expires;
+        sock->_timer_slot = slot;
+        sock->_timer_prev = NULL;
+        sock->_timer_next = timerSlots[slot];
+        if (sock->_timer_next != NULL) sock->_timer_next->_timer_prev = sock;
+        timerSlots[slot] = sock;
+    }
 
-        // Collect and run activity poll on all pollable sockets
-        xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-        for (it = _socketBaseList.begin(); it != _socketBaseList.end(); it++) {
-            (*it)->_selected = false;
-            if (millis() - (*it)->_sock_lastactivity >= 125) {
-                (*it)->_sock_lastactivity = millis();
-                sockList.push_back(*it);
-            }
+    void timerCancel(AsyncSocketBase * sock)
+    {
+        if (sock->_timer_slot < 0) return;
+        if (sock->_timer_prev != NULL) {
+            sock->_timer_prev->_timer_next = sock->_timer_next;
+        } else {
+            timerSlots[sock->_timer_slot] = sock->_timer_next;
         }
+        if (sock->_timer_next != NULL) sock->_timer_next->_timer_prev = sock->_timer_prev;
+        sock->_timer_next = sock->_timer_prev = NULL;
+        sock->_timer_slot = -1;
+    }
 
-        // Run activity poll on all pollable sockets
-        for (it = sockList.begin(); it != sockList.end(); it++) {
-#if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_add(NULL) != ESP_OK){
-                log_e("Failed to add async task to WDT");
-            }
-#endif
-            (*it)->_sockPoll();
-#if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_delete(NULL) != ESP_OK){
-                log_e("Failed to remove loop task from WDT");
+    // Collect all sockets whose deadline has passed in the ticks elapsed so
+    // far into ready[], removing them from the wheel.
+    void timerExpire(uint32_t now)
+    {
+        uint32_t ticks = (now - timerTickStart) / CONFIG_ASYNC_TCP_TIMER_RESOLUTION;
+
+        // After a long wait, every slot only needs to be visited once
+        if (ticks > ASYNCSOCK_TIMER_SLOTS) {
+            timerTick += ticks - ASYNCSOCK_TIMER_SLOTS;
+            timerTickStart += (ticks - ASYNCSOCK_TIMER_SLOTS) * CONFIG_ASYNC_TCP_TIMER_RESOLUTION;
+            ticks = ASYNCSOCK_TIMER_SLOTS;
+        }
+        while (ticks-- > 0) {
+            AsyncSocketBase * sock = timerSlots[timerTick & (ASYNCSOCK_TIMER_SLOTS - 1)];
+            while (sock != NULL) {
+                AsyncSocketBase * next = sock->_timer_next;
+                if ((int32_t)(now - sock->_timer_expires) >= 0) {
+                    timerCancel(sock);
+                    ready[nReady++] = sock;
+                }
+                sock = next;
             }
-#endif
+            timerTick++;
+            timerTickStart += CONFIG_ASYNC_TCP_TIMER_RESOLUTION;
         }
-        sockList.clear();
+    }
 
-        xSemaphoreGiveRecursive(_asyncsock_mutex);
+    // Milliseconds until the end of the next tick that has any sockets due,
+    // or -1 if there are none.
+    int32_t timerWait(uint32_t now)
+    {
+        for (uint32_t k = 0; k < ASYNCSOCK_TIMER_SLOTS; k++) {
+            if (timerSlots[(timerTick + k) & (ASYNCSOCK_TIMER_SLOTS - 1)] == NULL) continue;
+            int32_t wait = (int32_t)(timerTickStart + (k + 1) * CONFIG_ASYNC_TCP_TIMER_RESOLUTION - now);
+            return (wait > 0) ? wait : 0;
+        }
+        return -1;
     }
+};
 
-    vTaskDelete(NULL);
-    _asyncsock_service_task_handle = NULL;
-}
+// Protects DNS resolution results written from the LWIP thread
+static portMUX_TYPE _asyncsock_dns_mux = portMUX_INITIALIZER_UNLOCKED;
 
-AsyncSocketBase::AsyncSocketBase()
+#if ASYNC_TCP_SSL_ENABLED && CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+// TLS handshake handed over to the handshake task. The client pointer is
+// cleared, under _asyncsock_dns_mux, if the client gives up on it, leaving
+// the job, the TLS context and the socket to be freed by the task.
+struct AsyncTLSHandshakeJob
 {
-    if (_asyncsock_mutex == NULL) _asyncsock_mutex = xSemaphoreCreateRecursiveMutex();
-
-    _sock_lastactivity = millis();
-    _selected = false;
-
-    // Add this base socket to the monitored list
-    auto & _socketBaseList = AsyncSocketBase::_getSocketBaseList();
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    _socketBaseList.push_back(this);
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
-}
+    AsyncTCP_TLS_Context * tls = NULL;
+    AsyncClient * client = NULL;
+    int result = 0;
+    bool ready = false;     // Socket is ready for more of the handshake
+    bool done = false;
+};
+
+// Handshakes in progress at once in the handshake task
+#define ASYNCSOCK_TLS_JOBS 8
+static QueueHandle_t _asyncsock_tls_queue = NULL;
+static TaskHandle_t _asyncsock_tls_task_handle = NULL;
+void _asyncsock_tls_task(void *);
+#endif
 
-std::list<AsyncSocketBase *> & AsyncSocketBase::_getSocketBaseList(void)
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+static_assert(CONFIG_ASYNC_TCP_DEFERRED_EVENTS >= 8 && CONFIG_ASYNC_TCP_DEFERRED_EVENTS <= 255,
+    "deferred event queue must hold between 8 and 255 events");
+static_assert(CONFIG_ASYNC_TCP_HANDLER_TASKS > 0, "at least one handler task is needed");
+
+// Most events a client may have waiting that hold received data, leaving
+// room for the other events
+#define ASYNCSOCK_DEFERRED_DATA_MAX (CONFIG_ASYNC_TCP_DEFERRED_EVENTS / 2)
+
+// Longest queue of clients waiting for one handler task, all of them at most
+// once
+#define ASYNCSOCK_HANDLER_QUEUE_SIZE (CONFIG_ASYNC_TCP_MAX_SOCKETS * CONFIG_ASYNC_TCP_WORKER_COUNT)
+
+enum {
+    ASYNCSOCK_EVENT_CONNECT,
+    ASYNCSOCK_EVENT_DATA,
+    ASYNCSOCK_EVENT_ACK,
+    ASYNCSOCK_EVENT_TIMEOUT,
+    ASYNCSOCK_EVENT_POLL,
+    ASYNCSOCK_EVENT_ERROR,
+    ASYNCSOCK_EVENT_DISCONNECT
+};
+
+// State of one asyncTcpHandler task. Clients with events waiting are queued
+// once each, and have all their waiting events delivered in turn. The queue
+// and the events of the clients are protected by the spinlock, so that the
+// asyncTcpSock tasks never wait for a handler. The mutex is held while
+// delivering events, so that a client destroyed from another task can wait
+// for its handler to return. A task holding a worker mutex cannot wait, since
+// the handler might be waiting for it: the client is left dying instead.
+struct AsyncEventHandler
 {
-    // List of monitored socket objects
-    static std::list<AsyncSocketBase *> _socketBaseList;
-    return _socketBaseList;
-}
+    TaskHandle_t task = NULL;
+    SemaphoreHandle_t mutex = NULL;
+    SemaphoreHandle_t ready = NULL;     // Counts clients queued
+
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    AsyncClient * queue[ASYNCSOCK_HANDLER_QUEUE_SIZE];
+    uint16_t head = 0;
+    uint16_t count = 0;
+
+    // Client whose events are being delivered. Cleared if the client is
+    // destroyed from within its own handler.
+    AsyncClient * current = NULL;
+
+    // Client left dying while this task was delivering to it. Its destructor,
+    // then operator delete, hand over what they cannot release yet, and the
+    // last of them and this task to be done with the client releases it.
+    AsyncClient * dying = NULL;
+    bool dying_busy = false;        // Still delivering to it
+    bool dying_destroyed = false;   // Callbacks and write mutex handed over
+    bool dying_deleted = false;     // Memory handed over
+    AsyncClientCallbacks * dying_cbs = NULL;
+#if ASYNCSOCK_WRITE_MUTEX
+    SemaphoreHandle_t dying_mutex = NULL;
+#endif
+};
 
-AsyncSocketBase::~AsyncSocketBase()
+static AsyncEventHandler * _asyncsock_handlers(void)
 {
-    // Remove this base socket from the monitored list
-    auto & _socketBaseList = AsyncSocketBase::_getSocketBaseList();
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    _socketBaseList.remove(this);
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
+    // Lazily constructed, like the workers
+    static AsyncEventHandler _handlers[CONFIG_ASYNC_TCP_HANDLER_TASKS];
+    return _handlers;
 }
+static std::atomic<uint8_t> _asyncsock_next_handler(0);
+void _asyncsock_handler_task(void *);
+#endif
+
+#if LWIP_IPV6
+#define ASYNCSOCK_DNS_PREFER_V6 (CONFIG_ASYNC_TCP_DNS_ADDRTYPE == LWIP_DNS_ADDRTYPE_IPV6 || CONFIG_ASYNC_TCP_DNS_ADDRTYPE == LWIP_DNS_ADDRTYPE_IPV6_IPV4)
+#define ASYNCSOCK_DNS_BOTH (CONFIG_ASYNC_TCP_DNS_ADDRTYPE == LWIP_DNS_ADDRTYPE_IPV4_IPV6 || CONFIG_ASYNC_TCP_DNS_ADDRTYPE == LWIP_DNS_ADDRTYPE_IPV6_IPV4)
+#else
+#define ASYNCSOCK_DNS_PREFER_V6 0
+#define ASYNCSOCK_DNS_BOTH 0
+#endif
 
+static_assert(CONFIG_ASYNC_TCP_DNS_CACHE_SIZE > 0, "at least one DNS cache entry is needed to track lookups");
 
-AsyncClient::AsyncClient(int sockfd)
-: _connect_cb(0)
-, _connect_cb_arg(0)
-, _discard_cb(0)
-, _discard_cb_arg(0)
-, _sent_cb(0)
-, _sent_cb_arg(0)
-, _error_cb(0)
-, _error_cb_arg(0)
-, _recv_cb(0)
-, _recv_cb_arg(0)
-, _timeout_cb(0)
-, _timeout_cb_arg(0)
-, _rx_last_packet(0)
-, _rx_since_timeout(0)
-, _ack_timeout(ASYNC_MAX_ACK_TIME)
-, _connect_port(0)
-, _writeSpaceRemaining(TCP_SND_BUF)
-, _conn_state(0)
+// Results of host name lookups, shared by all clients. Entries are updated
+// from the LWIP thread, so they are protected by _asyncsock_dns_mux.
+struct AsyncDnsCache
 {
-    _write_mutex = xSemaphoreCreateMutex();
-    if (sockfd != -1) {
-        int r = fcntl( sockfd, F_SETFL, fcntl( sockfd, F_GETFL, 0 ) | O_NONBLOCK );
+    struct Entry {
+        char name[CONFIG_ASYNC_TCP_DNS_NAME_MAX];
+        ip_addr_t addr[2];      // Preferred address family first
+        uint8_t pending;        // Lookups not completed yet
+        uint32_t resolved_at;   // Time at which lookups completed
+        AsyncClient * waiters;  // Clients waiting for the result
+        AsyncClient * late;     // Clients connecting already, waiting for the other address
+    };
+    static Entry entries[CONFIG_ASYNC_TCP_DNS_CACHE_SIZE];
+
+    // Returns 1 if resolved right away, 0 if the client has to wait for
+    // _sockDelayedConnect(), or -1 on error
+    static int lookup(AsyncClient * c, const char * host);
+    static void found(Entry * e, const ip_addr_t * ipaddr);
+    static void cancel(AsyncClient * c);
+    // True if the client was told again once all lookups were done, since
+    // it started connecting before. Sets the other address, or an all-zero
+    // one if there is none.
+    static bool alternate(AsyncClient * c, ip_addr_t * addr);
+
+    // With _asyncsock_dns_mux held
+    static Entry * _unlink(AsyncClient * c)
+    {
+        for (int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE; i++) {
+            for (AsyncClient ** p = &entries[i].waiters; *p != NULL; p = &(*p)->_dns_next) {
+                if (*p == c) {
+                    *p = c->_dns_next;
+                    c->_dns_next = NULL;
+                    return &entries[i];
+                }
+            }
+            for (AsyncClient ** p = &entries[i].late; *p != NULL; p = &(*p)->_dns_next) {
+                if (*p == c) {
+                    *p = c->_dns_next;
+                    c->_dns_next = NULL;
+                    return &entries[i];
+                }
+            }
+        }
+        return NULL;
+    }
 
-        // Updating state visible to asyncTcpSock task
-        xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-        _conn_state = 4;
-        _socket = sockfd;
-        xSemaphoreGiveRecursive(_asyncsock_mutex);
+    static void _assign(AsyncClient * c, const Entry * e)
+    {
+        int first = ip_addr_isany(&e->addr[0]) ? 1 : 0;
+        c->_connect_addr = e->addr[first];
+        if (first == 0 && CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY > 0) {
+            c->_connect_alt = e->addr[1];
+        } else {
+            memset(&c->_connect_alt, 0, sizeof(c->_connect_alt));
+        }
     }
-}
+};
 
-AsyncClient::~AsyncClient()
+static AsyncSocketWorker * _asyncsock_workers(void)
 {
-    if (_socket != -1) _close();
-    vSemaphoreDelete(_write_mutex);
-    _write_mutex = NULL;
-}
-
-void AsyncClient::setRxTimeout(uint32_t timeout){
-    _rx_since_timeout = timeout;
-}
+    // Lazily constructed, since sockets may be constructed as global objects
+    static AsyncSocketWorker _workers[CONFIG_ASYNC_TCP_WORKER_COUNT];
+    static bool _initialized = false;
 
-uint32_t AsyncClient::getRxTimeout(){
-    return _rx_since_timeout;
+    if (!_initialized) {
+        for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) _workers[i].index = i;
+        _initialized = true;
+    }
+    return _workers;
 }
 
-uint32_t AsyncClient::getAckTimeout(){
-    return _ack_timeout;
-}
+// Worker whose task is the one currently running, or NULL if none
+static AsyncSocketWorker * _asyncsock_current_worker(void)
+{
+    AsyncSocketWorker * workers = _asyncsock_workers();
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
 
-void AsyncClient::setAckTimeout(uint32_t timeout){
-    _ack_timeout = timeout;
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        if (workers[i].task == self) return &(workers[i]);
+    }
+    return NULL;
 }
 
-void AsyncClient::setNoDelay(bool nodelay){
-    if (_socket == -1) return;
+// Worker with the fewest sockets assigned
+static AsyncSocketWorker * _asyncsock_least_loaded_worker(void)
+{
+    AsyncSocketWorker * workers = _asyncsock_workers();
+    AsyncSocketWorker * w = &(workers[0]);
 
-    int flag = nodelay;
-    int res = setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
-    if(res < 0) {
-        log_e("fail on fd %d, errno: %d, \"%s\"", _socket, errno, strerror(errno));
+    for (int i = 1; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        if (workers[i].load < w->load) w = &(workers[i]);
     }
+    return w;
 }
 
-bool AsyncClient::getNoDelay(){
-    if (_socket == -1) return false;
+static bool _asyncsock_ctrl_init(AsyncSocketWorker * w)
+{
+    if (w->ctrlSock != -1) return true;
 
-    int flag = 0;
-    size_t size = sizeof(int);
-    int res = getsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, &size);
-    if(res < 0) {
-        log_e("fail on fd %d, errno: %d, \"%s\"", _socket, errno, strerror(errno));
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        log_e("ctrl socket: %d", errno);
+        return false;
     }
-    return flag;
-}
 
-/*
- * Callback Setters
- * */
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0) {
+        log_e("ctrl socket bind error: %d - %s", errno, strerror(errno));
+#ifdef ESP_IDF_VERSION_MAJOR
+        lwip_close(sockfd);
+#else
+        lwip_close_r(sockfd);
+#endif
+        return false;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 
-void AsyncClient::onConnect(AcConnectHandler cb, void* arg){
-    _connect_cb = cb;
-    _connect_cb_arg = arg;
+    memcpy(&(w->ctrlAddr), &addr, sizeof(addr));
+    w->ctrlSock = sockfd;
+    return true;
 }
 
-void AsyncClient::onDisconnect(AcConnectHandler cb, void* arg){
-    _discard_cb = cb;
-    _discard_cb_arg = arg;
-}
+// Wake up a worker task so that it rebuilds its set of monitored sockets.
+// Must NOT be called from the LWIP thread, since it uses the socket API.
+// Several wakeups before the task gets to run are coalesced into one.
+static void _asyncsock_wakeup(AsyncSocketWorker * w)
+{
+    if (w == NULL || w->ctrlSock == -1) return;
 
-void AsyncClient::onAck(AcAckHandler cb, void* arg){
-    _sent_cb = cb;
-    _sent_cb_arg = arg;
-}
+    // No need to wake up the task from itself - it will rescan all sockets
+    // before calling select() again.
+    if (xTaskGetCurrentTaskHandle() == w->task) return;
 
-void AsyncClient::onError(AcErrorHandler cb, void* arg){
-    _error_cb = cb;
-    _error_cb_arg = arg;
-}
+    if (w->wakeupPending.exchange(true)) return;
 
-void AsyncClient::onData(AcDataHandler cb, void* arg){
-    _recv_cb = cb;
-    _recv_cb_arg = arg;
+    uint8_t b = 0;
+    lwip_sendto(w->ctrlSock, &b, sizeof(b), 0,
+        (struct sockaddr *)&(w->ctrlAddr), sizeof(w->ctrlAddr));
 }
 
-void AsyncClient::onTimeout(AcTimeoutHandler cb, void* arg){
-    _timeout_cb = cb;
-    _timeout_cb_arg = arg;
+// Wakeup requested by the LWIP thread, executed in the timer service task
+static void _asyncsock_wakeup_deferred(void * w, uint32_t)
+{
+    _asyncsock_wakeup((AsyncSocketWorker *)w);
 }
 
-void AsyncClient::onPoll(AcConnectHandler cb, void* arg){
-    _poll_cb = cb;
-    _poll_cb_arg = arg;
-}
+// Drain all pending wakeup datagrams from the control socket
+static void _asyncsock_ctrl_drain(AsyncSocketWorker * w)
+{
+    uint8_t b[16];
 
-bool AsyncClient::connected(){
-    if (_socket == -1) {
-        return false;
-    }
-    return _conn_state == 4;
+    w->wakeupPending = false;
+    while (lwip_recvfrom(w->ctrlSock, b, sizeof(b), 0, NULL, NULL) > 0);
 }
 
-bool AsyncClient::freeable(){
-    if (_socket == -1) {
-        return true;
-    }
-    return _conn_state == 0 || _conn_state > 4;
-}
+// Pool of fixed-size blocks holding data copied by AsyncClient::add(). Shared
+// by all clients, and allocated in a single chunk on first use, so that
+// small writes do not fragment the heap with many short-lived allocations.
+static struct {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t * storage = NULL;
+    uint16_t freeStack[CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS > 0 ? CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS : 1];
+    uint16_t nFree = 0;
+    AsyncWritePoolStats stats = {};
+} _asyncsock_wpool;
+
+static bool _asyncsock_wpool_init(void)
+{
+    if (CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS <= 0) return false;
+    if (_asyncsock_wpool.storage != NULL) return true;
 
-uint32_t AsyncClient::getRemoteAddress() {
-    if(_socket == -1) {
-        return 0;
+    size_t size = (size_t)CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS * CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE;
+    uint8_t * storage = NULL;
+#if CONFIG_ASYNC_TCP_WRITE_POOL_PSRAM
+    storage = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+    if (storage == NULL) storage = (uint8_t *)malloc(size);
+    if (storage == NULL) return false;
+
+    // Another task might have initialized the pool in the meantime
+    portENTER_CRITICAL(&_asyncsock_wpool.mux);
+    if (_asyncsock_wpool.storage == NULL) {
+        _asyncsock_wpool.storage = storage;
+        storage = NULL;
+        for (int i = 0; i < CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS; i++) {
+            _asyncsock_wpool.freeStack[i] = CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS - 1 - i;
+        }
+        _asyncsock_wpool.nFree = CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS;
+        _asyncsock_wpool.stats.blocks = CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS;
+        _asyncsock_wpool.stats.blocks_free = CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS;
+        _asyncsock_wpool.stats.blocks_min_free = CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS;
     }
-
-    struct sockaddr_storage addr;
-    socklen_t len = sizeof addr;
-    getpeername(_socket, (struct sockaddr*)&addr, &len);
-    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-
-    return s->sin_addr.s_addr;
+    portEXIT_CRITICAL(&_asyncsock_wpool.mux);
+    if (storage != NULL) heap_caps_free(storage);
+    return true;
 }
 
-uint16_t AsyncClient::getRemotePort() {
-    if(_socket == -1) {
-        return 0;
+// Get a block from the pool, or NULL if pool is exhausted
+static uint8_t * _asyncsock_wpool_alloc(void)
+{
+    uint8_t * p = NULL;
+
+    if (!_asyncsock_wpool_init()) return NULL;
+
+    portENTER_CRITICAL(&_asyncsock_wpool.mux);
+    if (_asyncsock_wpool.nFree > 0) {
+        uint16_t idx = _asyncsock_wpool.freeStack[--_asyncsock_wpool.nFree];
+        p = _asyncsock_wpool.storage + (size_t)idx * CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE;
+        _asyncsock_wpool.stats.pool_allocs++;
+        _asyncsock_wpool.stats.blocks_free = _asyncsock_wpool.nFree;
+        if (_asyncsock_wpool.nFree < _asyncsock_wpool.stats.blocks_min_free) {
+            _asyncsock_wpool.stats.blocks_min_free = _asyncsock_wpool.nFree;
+        }
     }
+    portEXIT_CRITICAL(&_asyncsock_wpool.mux);
+    return p;
+}
 
-    struct sockaddr_storage addr;
-    socklen_t len = sizeof addr;
-    getpeername(_socket, (struct sockaddr*)&addr, &len);
-    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
+static void _asyncsock_wpool_free(uint8_t * p)
+{
+    uint16_t idx = (p - _asyncsock_wpool.storage) / CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE;
 
-    return ntohs(s->sin_port);
+    portENTER_CRITICAL(&_asyncsock_wpool.mux);
+    _asyncsock_wpool.freeStack[_asyncsock_wpool.nFree++] = idx;
+    _asyncsock_wpool.stats.blocks_free = _asyncsock_wpool.nFree;
+    portEXIT_CRITICAL(&_asyncsock_wpool.mux);
 }
 
-uint32_t AsyncClient::getLocalAddress() {
-    if(_socket == -1) {
-        return 0;
-    }
+static inline void _asyncsock_wpool_count(uint32_t AsyncWritePoolStats::* counter)
+{
+    portENTER_CRITICAL(&_asyncsock_wpool.mux);
+    _asyncsock_wpool.stats.*counter += 1;
+    portEXIT_CRITICAL(&_asyncsock_wpool.mux);
+}
 
-    struct sockaddr_storage addr;
-    socklen_t len = sizeof addr;
-    getsockname(_socket, (struct sockaddr*)&addr, &len);
-    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
+#if CONFIG_ASYNC_TCP_STATS
+template <typename T>
+static inline void _asyncsock_stat_add(AsyncSocketWorker * w, T AsyncTCPStats::* counter, uint32_t n)
+{
+    portENTER_CRITICAL(&(w->statsMux));
+    w->stats.*counter += n;
+    portEXIT_CRITICAL(&(w->statsMux));
+}
 
-    return s->sin_addr.s_addr;
+static inline void _asyncsock_stat_max(AsyncSocketWorker * w, uint32_t AsyncTCPStats::* counter, uint32_t n)
+{
+    portENTER_CRITICAL(&(w->statsMux));
+    if (n > w->stats.*counter) w->stats.*counter = n;
+    portEXIT_CRITICAL(&(w->statsMux));
 }
 
-uint16_t AsyncClient::getLocalPort() {
-    if(_socket == -1) {
-        return 0;
+// Bucket 0 for under 1 ms, then one per power of two
+static void _asyncsock_stat_latency(AsyncSocketWorker * w, uint32_t ms)
+{
+    uint8_t b = 0;
+    while (ms > 0 && b < ASYNC_TCP_LATENCY_BUCKETS - 1) {
+        ms >>= 1;
+        b++;
     }
+    portENTER_CRITICAL(&(w->statsMux));
+    w->stats.write_latency[b]++;
+    portEXIT_CRITICAL(&(w->statsMux));
+}
 
-    struct sockaddr_storage addr;
-    socklen_t len = sizeof addr;
-    getsockname(_socket, (struct sockaddr*)&addr, &len);
-    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
+#define ASYNCSOCK_STAT_ADD(w, counter, n)   _asyncsock_stat_add(w, &AsyncTCPStats::counter, n)
+#define ASYNCSOCK_CLIENT_STAT(field, n)     (_stats.field += (n))
+#define ASYNCSOCK_DISPATCH_BEGIN()          uint32_t _dispatch_start = micros()
+#define ASYNCSOCK_DISPATCH_END(w, sock)     (w)->statDispatch(sock, micros() - _dispatch_start)
+#else
+#define ASYNCSOCK_STAT_ADD(w, counter, n)
+#define ASYNCSOCK_CLIENT_STAT(field, n)
+#define ASYNCSOCK_DISPATCH_BEGIN()
+#define ASYNCSOCK_DISPATCH_END(w, sock)
+#endif
 
-    return ntohs(s->sin_port);
-}
+#if CONFIG_ASYNC_TCP_TRACE
+static_assert((CONFIG_ASYNC_TCP_TRACE_SIZE & (CONFIG_ASYNC_TCP_TRACE_SIZE - 1)) == 0,
+    "CONFIG_ASYNC_TCP_TRACE_SIZE must be a power of two");
 
-IPAddress AsyncClient::remoteIP() {
-    return IPAddress(getRemoteAddress());
-}
+// Events are recorded from any task without locking: each writer claims the
+// next entry by advancing the head, and entries are overwritten once the
+// head has gone around the ring.
+static AsyncTraceEvent _asyncsock_trace_ring[CONFIG_ASYNC_TCP_TRACE_SIZE];
+static std::atomic<uint32_t> _asyncsock_trace_head(0);
+static std::atomic<bool> _asyncsock_trace_on(true);
 
-uint16_t AsyncClient::remotePort() {
-    return getRemotePort();
+static void _asyncsock_trace(uint8_t type, uint8_t task, int fd, uint32_t start, uint32_t duration)
+{
+    if (!_asyncsock_trace_on.load(std::memory_order_relaxed)) return;
+    uint32_t i = _asyncsock_trace_head.fetch_add(1, std::memory_order_relaxed);
+    AsyncTraceEvent & e = _asyncsock_trace_ring[i & (CONFIG_ASYNC_TCP_TRACE_SIZE - 1)];
+    e.start = start;
+    e.duration = duration;
+    e.fd = fd;
+    e.type = type;
+    e.task = task;
 }
 
-IPAddress AsyncClient::localIP() {
-    return IPAddress(getLocalAddress());
+static inline uint8_t _asyncsock_trace_task(void)
+{
+    AsyncSocketWorker * w = _asyncsock_current_worker();
+    return (w != NULL) ? w->index : ASYNC_TRACE_OTHER_TASK;
 }
 
-uint16_t AsyncClient::localPort() {
-    return getLocalPort();
+static inline void _asyncsock_trace_wait(uint8_t type, int fd, uint32_t start)
+{
+    uint32_t waited = micros() - start;
+    if (waited >= CONFIG_ASYNC_TCP_TRACE_MIN_WAIT) _asyncsock_trace(type, _asyncsock_trace_task(), fd, start, waited);
 }
 
+#define ASYNCSOCK_TRACE_BEGIN(fd)           uint32_t _trace_start = micros(); int _trace_fd = (fd)
+#define ASYNCSOCK_TRACE_END(w, type)        _asyncsock_trace(type, (w)->index, _trace_fd, _trace_start, micros() - _trace_start)
+#define ASYNCSOCK_TRACE_WAIT(type, fd, take) do { uint32_t _wait_start = micros(); take; _asyncsock_trace_wait(type, fd, _wait_start); } while (0)
+#define ASYNCSOCK_TRACE_EVENT(type, fd)     _asyncsock_trace(type, _asyncsock_trace_task(), fd, micros(), 0)
+#else
+#define ASYNCSOCK_TRACE_BEGIN(fd)
+#define ASYNCSOCK_TRACE_END(w, type)
+#define ASYNCSOCK_TRACE_WAIT(type, fd, take) take
+#define ASYNCSOCK_TRACE_EVENT(type, fd)
+#endif
 
-bool AsyncClient::connect(IPAddress ip, uint16_t port)
+// Settings applied when the tasks are started
+static AsyncTaskConfig _asyncsock_task_config = {
+    CONFIG_ASYNC_TCP_PRIORITY,
+    CONFIG_ASYNC_TCP_RUNNING_CORE,
+    CONFIG_ASYNC_TCP_STACK_SIZE,
+    CONFIG_ASYNC_TCP_STACK_PSRAM != 0
+};
+
+// Create a service task with its stack in PSRAM. The task control block must
+// remain in internal RAM. Neither is ever freed, since the task never ends.
+static bool _asyncsock_create_psram_task(TaskFunction_t fn, const char * name, void * arg, TaskHandle_t * task, int core)
 {
-    if (_socket != -1) {
-        log_w("already connected, state %d", _conn_state);
+    const AsyncTaskConfig & cfg = _asyncsock_task_config;
+    StackType_t * stack = (StackType_t *)heap_caps_malloc(cfg.stack_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (stack == NULL) {
+        log_w("no PSRAM available for %s stack, using internal RAM", name);
         return false;
     }
-
-    if(!_start_asyncsock_task()){
-        log_e("failed to start task");
+    StaticTask_t * tcb = (StaticTask_t *)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (tcb == NULL) {
+        heap_caps_free(stack);
         return false;
     }
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        log_e("socket: %d", errno);
+    *task = xTaskCreateStaticPinnedToCore(fn, name, cfg.stack_size, arg, cfg.priority,
+        stack, tcb, (core < 0) ? tskNO_AFFINITY : core);
+    if (*task == NULL) {
+        heap_caps_free(tcb);
+        heap_caps_free(stack);
         return false;
     }
-    int r = fcntl( sockfd, F_SETFL, fcntl( sockfd, F_GETFL, 0 ) | O_NONBLOCK );
+    return true;
+}
+
+// Start async socket tasks
+static bool _start_asyncsock_task(void)
+{
+    AsyncSocketWorker * workers = _asyncsock_workers();
+    const AsyncTaskConfig & cfg = _asyncsock_task_config;
+
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        AsyncSocketWorker * w = &(workers[i]);
+        if (w->task) continue;
+
+        if (!_asyncsock_ctrl_init(w)) return false;
+
+#if CONFIG_ASYNC_TCP_RX_BUFFER_PSRAM
+        if (w->readBuffer == NULL) {
+            w->readBuffer = (uint8_t *)heap_caps_malloc(CONFIG_ASYNC_TCP_RX_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (w->readBuffer == NULL) {
+                log_w("no PSRAM available for read buffer, using internal RAM");
+                w->readBuffer = (uint8_t *)malloc(CONFIG_ASYNC_TCP_RX_BUFFER_SIZE);
+            }
+            if (w->readBuffer == NULL) return false;
+        }
+#endif
+
+        // With more than one worker and no core preference, spread the
+        // workers across all available cores.
+        int core = cfg.core;
+        if (core < 0 && CONFIG_ASYNC_TCP_WORKER_COUNT > 1) core = i % portNUM_PROCESSORS;
+
+        char name[16];
+        if (i == 0) {
+            strcpy(name, "asyncTcpSock");
+        } else {
+            snprintf(name, sizeof(name), "asyncTcpSock%d", i);
+        }
+
+        if (!cfg.stack_psram || !_asyncsock_create_psram_task(_asynctcpsock_task, name, w, &(w->task), core)) {
+            xTaskCreateUniversal(
+                _asynctcpsock_task,
+                name,
+                cfg.stack_size,
+                w,
+                cfg.priority,
+                &(w->task),
+                core);
+        }
+        if (!w->task) return false;
+    }
+
+#if ASYNC_TCP_SSL_ENABLED && CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    if (_asyncsock_tls_queue == NULL) {
+        _asyncsock_tls_queue = xQueueCreate(CONFIG_ASYNC_TCP_MAX_SOCKETS, sizeof(AsyncTLSHandshakeJob *));
+        if (_asyncsock_tls_queue == NULL) return false;
+    }
+    if (_asyncsock_tls_task_handle == NULL) {
+        // Below the workers, so that handshakes give way to established sockets
+        xTaskCreateUniversal(
+            _asyncsock_tls_task,
+            "asyncTcpSockTLS",
+            CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK,
+            NULL,
+            (cfg.priority > 1) ? cfg.priority - 1 : cfg.priority,
+            &_asyncsock_tls_task_handle,
+            cfg.core);
+        if (!_asyncsock_tls_task_handle) return false;
+    }
+#endif
+
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    AsyncEventHandler * handlers = _asyncsock_handlers();
+    for (int i = 0; i < CONFIG_ASYNC_TCP_HANDLER_TASKS; i++) {
+        AsyncEventHandler * h = &(handlers[i]);
+        if (h->task) continue;
+
+        if (h->mutex == NULL) h->mutex = xSemaphoreCreateRecursiveMutex();
+        if (h->ready == NULL) h->ready = xSemaphoreCreateCounting(ASYNCSOCK_HANDLER_QUEUE_SIZE, 0);
+        if (h->mutex == NULL || h->ready == NULL) return false;
+
+        char name[20];
+        if (i == 0) {
+            strcpy(name, "asyncTcpHandler");
+        } else {
+            snprintf(name, sizeof(name), "asyncTcpHandler%d", i);
+        }
+        xTaskCreateUniversal(
+            _asyncsock_handler_task,
+            name,
+            CONFIG_ASYNC_TCP_HANDLER_STACK_SIZE,
+            h,
+            CONFIG_ASYNC_TCP_HANDLER_PRIORITY,
+            &(h->task),
+            CONFIG_ASYNC_TCP_HANDLER_CORE);
+        if (!h->task) return false;
+    }
+#endif
+    return true;
+}
+
+// Add socket to the registry of a worker. Caller must hold the worker mutex.
+static bool _asyncsock_attach(AsyncSocketWorker * w, AsyncSocketBase * sock, int16_t & slot)
+{
+    if (w->nSockets >= CONFIG_ASYNC_TCP_MAX_SOCKETS) {
+        slot = -1;
+        return false;
+    }
+    slot = w->nSockets;
+    w->sockets[w->nSockets++] = sock;
+    return true;
+}
+
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+#if !defined(SIOCOUTQ)
+typedef struct {
+    struct tcpip_api_call_data call;
+    int fd;
+    int queued;
+} _asyncsock_sndqueue_msg;
+
+// Must run in the LWIP thread, or with the TCPIP core lock held. The socket
+// is not referenced, so the caller holds the worker mutex, under which alone
+// sockets of the library are closed.
+static err_t _asyncsock_sndqueue_tcpip(struct tcpip_api_call_data * call)
+{
+    _asyncsock_sndqueue_msg * msg = (_asyncsock_sndqueue_msg *)call;
+    struct lwip_sock * sock = lwip_socket_dbg_get_socket(msg->fd);
+
+    msg->queued = -1;
+    if (sock != NULL && sock->conn != NULL && NETCONNTYPE_GROUP(sock->conn->type) == NETCONN_TCP
+            && sock->conn->pcb.tcp != NULL) {
+        // Bytes buffered in the stack, either unsent or sent and not
+        // acknowledged, are taken out of the send buffer until acknowledged
+        u16_t room = tcp_sndbuf(sock->conn->pcb.tcp);
+        msg->queued = (room < TCP_SND_BUF) ? (int)(TCP_SND_BUF - room) : 0;
+    }
+    return ERR_OK;
+}
+#endif
+
+// Number of bytes written into the socket that have not been acknowledged by
+// the remote side yet, or -1 if this cannot be determined. Called with the
+// worker mutex held, so that the socket is not closed meanwhile.
+static int _asyncsock_sndqueue(int fd)
+{
+#if defined(SIOCOUTQ)
+    int queued;
+    if (lwip_ioctl(fd, SIOCOUTQ, &queued) < 0) return -1;
+    return queued;
+#else
+    _asyncsock_sndqueue_msg msg;
+    msg.fd = fd;
+#if LWIP_TCPIP_CORE_LOCKING
+    LOCK_TCPIP_CORE();
+    _asyncsock_sndqueue_tcpip(&msg.call);
+    UNLOCK_TCPIP_CORE();
+#else
+    if (tcpip_api_call(_asyncsock_sndqueue_tcpip, &msg.call) != ERR_OK) return -1;
+#endif
+    return msg.queued;
+#endif
+}
+#endif
+
+// Collect socket for notification on the current pass
+static inline void _asyncsock_set_ready(AsyncSocketWorker * w, AsyncSocketBase * sock)
+{
+    w->ready[w->nReady++] = sock;
+}
+
+#if CONFIG_ASYNC_TCP_USE_WDT && CONFIG_ASYNC_TCP_WDT_PER_EVENT
+#define ASYNCSOCK_WDT_ADD()     do { if (esp_task_wdt_add(NULL) != ESP_OK) log_e("Failed to add async task to WDT"); } while (0)
+#define ASYNCSOCK_WDT_DELETE()  do { if (esp_task_wdt_delete(NULL) != ESP_OK) log_e("Failed to remove loop task from WDT"); } while (0)
+#define ASYNCSOCK_CB_BEGIN(sock)    ASYNCSOCK_WDT_ADD()
+#define ASYNCSOCK_CB_END(what)      ASYNCSOCK_WDT_DELETE()
+#elif CONFIG_ASYNC_TCP_USE_WDT
+// Task is subscribed to the WDT once, and resets it on every pass. Since the
+// task must not block for longer than the WDT timeout, select() wakes up at
+// least this often, in milliseconds.
+#define ASYNCSOCK_WDT_FEED_INTERVAL 1000
+
+// Handlers running for longer than the deadline are reported, since they are
+// what would eventually trigger the WDT.
+static void _asyncsock_cb_check(uint32_t start, int fd, void * sock, const char * what)
+{
+    uint32_t elapsed = (micros() - start) / 1000;
+    if (elapsed >= CONFIG_ASYNC_TCP_CALLBACK_DEADLINE) {
+        log_w("%s handler for socket %d (%p) took %u ms", what, fd, sock, (unsigned)elapsed);
+    }
+}
+#define ASYNCSOCK_CB_BEGIN(sock)    uint32_t _cb_start = micros(); int _cb_fd = (sock)->_socket; void * _cb_sock = (sock)
+#define ASYNCSOCK_CB_END(what)      _asyncsock_cb_check(_cb_start, _cb_fd, _cb_sock, what)
+#else
+#define ASYNCSOCK_CB_BEGIN(sock)
+#define ASYNCSOCK_CB_END(what)
+#endif
+
+// Actual asynchronous socket task
+void _asynctcpsock_task(void * arg)
+{
+    AsyncSocketWorker * worker = (AsyncSocketWorker *)arg;
+    AsyncSocketBase ** sockets = worker->sockets;
+    AsyncSocketBase ** ready = worker->ready;
+
+#if CONFIG_ASYNC_TCP_USE_WDT && !CONFIG_ASYNC_TCP_WDT_PER_EVENT
+    if (esp_task_wdt_add(NULL) != ESP_OK) log_e("Failed to add async task to WDT");
+#endif
+
+    while (true) {
+        uint16_t i;
+        fd_set sockSet_r;
+        fd_set sockSet_w;
+        int max_sock = 0;
+        uint32_t now;
+        int32_t pollWait;
+
+#if CONFIG_ASYNC_TCP_USE_WDT && !CONFIG_ASYNC_TCP_WDT_PER_EVENT
+        esp_task_wdt_reset();
+#endif
+
+        ASYNCSOCK_TRACE_WAIT(ASYNC_TRACE_WORKER_LOCK, -1, xSemaphoreTakeRecursive(worker->mutex, (TickType_t)portMAX_DELAY));
+
+        // Start monitoring sockets handed over from other workers
+        if (worker->inboxCount > 0) {
+            portENTER_CRITICAL(&(worker->inboxMux));
+            for (i = 0; i < worker->inboxCount; i++) {
+                AsyncSocketBase * sock = worker->inbox[i];
+                _asyncsock_attach(worker, sock, sock->_slot);
+            }
+            worker->inboxCount = 0;
+            portEXIT_CRITICAL(&(worker->inboxMux));
+        }
+
+        // Collect all of the active sockets into socket set
+        FD_ZERO(&sockSet_r); FD_ZERO(&sockSet_w);
+        now = millis();
+        for (i = 0; i < worker->nSockets; i++) {
+            AsyncSocketBase * sock = sockets[i];
+            if (sock->_socket != -1) {
+                // Only monitor the events each socket has declared interest
+                // in. In particular, an established socket with nothing to
+                // write is always writable, and would wake up select() on
+                // every pass if monitored for writing.
+                bool wantRead = sock->_sockWantsRead();
+                bool wantWrite = sock->_sockWantsWrite();
+                if (wantRead) FD_SET(sock->_socket, &sockSet_r);
+                if (wantWrite) FD_SET(sock->_socket, &sockSet_w);
+                if (wantRead || wantWrite) {
+                    sock->_selected = true;
+                    if (max_sock <= sock->_socket) max_sock = sock->_socket + 1;
+                }
+
+                // Newly connected sockets, and those handed over from other
+                // workers, do not have their timer running yet
+                uint32_t deadline;
+                if (sock->_timer_slot < 0 && sock->_sockNextDeadline(deadline)) {
+                    worker->timerArm(sock, deadline);
+                }
+            }
+        }
+
+        // Find out how long until the next socket timer is due
+        pollWait = worker->timerWait(now);
+        FD_SET(worker->ctrlSock, &sockSet_r);
+        if (max_sock <= worker->ctrlSock) max_sock = worker->ctrlSock + 1;
+#ifdef ASYNCSOCK_WDT_FEED_INTERVAL
+        if (pollWait < 0 || pollWait > ASYNCSOCK_WDT_FEED_INTERVAL) pollWait = ASYNCSOCK_WDT_FEED_INTERVAL;
+#endif
+
+        // Sockets may be added, closed or destroyed by other tasks while this
+        // task is blocked in select(). Any such change either wakes up this
+        // task through the control socket, or clears the _selected flag.
+        xSemaphoreGiveRecursive(worker->mutex);
+
+        // Wait for activity on all monitored sockets, or until the next
+        // socket timer is due. If no sockets are being monitored at all,
+        // wait indefinitely until woken up through the control socket.
+        struct timeval tv;
+        tv.tv_sec = pollWait / 1000;
+        tv.tv_usec = (pollWait % 1000) * 1000;
+        ASYNCSOCK_TRACE_BEGIN(-1);
+        int r = select(max_sock, &sockSet_r, &sockSet_w, NULL, (pollWait >= 0) ? &tv : NULL);
+        ASYNCSOCK_TRACE_END(worker, ASYNC_TRACE_SELECT);
+#if CONFIG_ASYNC_TCP_STATS
+        uint32_t passStart = micros();
+#endif
+
+        ASYNCSOCK_TRACE_WAIT(ASYNC_TRACE_WORKER_LOCK, -1, xSemaphoreTakeRecursive(worker->mutex, (TickType_t)portMAX_DELAY));
+
+        // Check all sockets to see which ones are active
+        uint32_t nActive = 0;
+        if (r >= 0) {
+            if (r > 0 && FD_ISSET(worker->ctrlSock, &sockSet_r)) {
+                _asyncsock_ctrl_drain(worker);
+                nActive++;
+            }
+
+            // Collect and notify all writable sockets
+            worker->nReady = 0;
+            for (i = 0; i < worker->nSockets; i++) {
+                if (sockets[i]->_selected && FD_ISSET(sockets[i]->_socket, &sockSet_w)) {
+                    _asyncsock_set_ready(worker, sockets[i]);
+                }
+            }
+            for (i = 0; i < worker->nReady; i++) {
+                if (ready[i] == NULL) continue;
+                ASYNCSOCK_CB_BEGIN(ready[i]);
+                ASYNCSOCK_DISPATCH_BEGIN();
+                ASYNCSOCK_TRACE_BEGIN(ready[i]->_socket);
+                worker->current = ready[i];
+                if (ready[i]->_sockIsWriteable()) {
+                    if (ready[i]) ready[i]->_sock_lastactivity = millis();
+                    nActive++;
+                }
+                worker->current = NULL;
+                ASYNCSOCK_TRACE_END(worker, ASYNC_TRACE_WRITABLE);
+                ASYNCSOCK_DISPATCH_END(worker, ready[i]);
+                ASYNCSOCK_CB_END("write");
+            }
+
+            // Collect and notify all readable sockets
+            worker->nReady = 0;
+            for (i = 0; i < worker->nSockets; i++) {
+                if (sockets[i]->_selected && FD_ISSET(sockets[i]->_socket, &sockSet_r)) {
+                    _asyncsock_set_ready(worker, sockets[i]);
+                }
+            }
+            for (i = 0; i < worker->nReady; i++) {
+                if (ready[i] == NULL) continue;
+                ASYNCSOCK_CB_BEGIN(ready[i]);
+                ASYNCSOCK_DISPATCH_BEGIN();
+                ASYNCSOCK_TRACE_BEGIN(ready[i]->_socket);
+                ready[i]->_sock_lastactivity = millis();
+                worker->current = ready[i];
+                ready[i]->_sockIsReadable();
+                worker->current = NULL;
+                nActive++;
+                ASYNCSOCK_TRACE_END(worker, ASYNC_TRACE_READABLE);
+                ASYNCSOCK_DISPATCH_END(worker, ready[i]);
+                ASYNCSOCK_CB_END("read");
+            }
+        } else if (r < 0) {
+            // One of the monitored sockets might have been closed from another
+            // task while waiting. The set will be rebuilt on the next pass.
+            nActive++;
+        }
+
+        // Collect and notify all sockets waiting for DNS completion
+        worker->nReady = 0;
+        for (i = 0; i < worker->nSockets; i++) {
+            // Collect socket that has finished resolving DNS (with or without error)
+            if (sockets[i]->_isdnsfinished) {
+                portENTER_CRITICAL(&_asyncsock_dns_mux);
+                sockets[i]->_isdnsfinished = false;
+                portEXIT_CRITICAL(&_asyncsock_dns_mux);
+                _asyncsock_set_ready(worker, sockets[i]);
+            }
+        }
+        for (i = 0; i < worker->nReady; i++) {
+            if (ready[i] == NULL) continue;
+            ASYNCSOCK_CB_BEGIN(ready[i]);
+            ASYNCSOCK_DISPATCH_BEGIN();
+            ASYNCSOCK_TRACE_BEGIN(ready[i]->_socket);
+            ready[i]->_sockDelayedConnect();
+            ASYNCSOCK_TRACE_END(worker, ASYNC_TRACE_CONNECT);
+            ASYNCSOCK_DISPATCH_END(worker, ready[i]);
+            ASYNCSOCK_CB_END("connect");
+        }
+
+        for (i = 0; i < worker->nSockets; i++) {
+            sockets[i]->_selected = false;
+        }
+
+        // Collect all sockets whose timer has expired
+        worker->nReady = 0;
+        worker->timerExpire(millis());
+
+        // Run activity poll and timeouts on these sockets. A timer might have
+        // expired for a deadline that has moved later since it was set, so
+        // check again, and set the timer for the next deadline.
+        for (i = 0; i < worker->nReady; i++) {
+            uint32_t deadline;
+            if (ready[i] == NULL || !ready[i]->_sockNextDeadline(deadline)) continue;
+            if ((int32_t)(millis() - deadline) >= 0) {
+                ASYNCSOCK_CB_BEGIN(ready[i]);
+                ASYNCSOCK_DISPATCH_BEGIN();
+                ASYNCSOCK_TRACE_BEGIN(ready[i]->_socket);
+                ready[i]->_sockPoll();
+                ASYNCSOCK_TRACE_END(worker, ASYNC_TRACE_POLL);
+                ASYNCSOCK_DISPATCH_END(worker, ready[i]);
+                ASYNCSOCK_CB_END("poll");
+                if (ready[i] == NULL || !ready[i]->_sockNextDeadline(deadline)) continue;
+            }
+            worker->timerArm(ready[i], deadline);
+        }
+        worker->nReady = 0;
+
+        xSemaphoreGiveRecursive(worker->mutex);
+#if CONFIG_ASYNC_TCP_STATS
+        worker->statPass(micros() - passStart);
+#endif
+
+        // Should not normally happen, but if select() returned early and
+        // nothing was actually done, yield for a tick so that lower priority
+        // tasks can run.
+        if (r > 0 && nActive == 0) delay(1);
+    }
+
+    vTaskDelete(NULL);
+    worker->task = NULL;
+}
+
+AsyncSocketBase::AsyncSocketBase()
+{
+    _sock_lastactivity = millis();
+    _selected = false;
+
+    // Sockets created from within a worker task (such as accepted clients, or
+    // connections opened from a callback) stay in the same shard. Otherwise,
+    // pick the worker with the fewest sockets.
+    _worker = _asyncsock_current_worker();
+    if (_worker == NULL) _worker = _asyncsock_least_loaded_worker();
+
+    // Add this base socket to the monitored list
+    xSemaphoreTakeRecursive(_worker->mutex, (TickType_t)portMAX_DELAY);
+    if (_asyncsock_attach(_worker, this, _slot)) {
+        _worker->load++;
+    } else {
+        log_e("too many sockets, increase CONFIG_ASYNC_TCP_MAX_SOCKETS");
+    }
+    xSemaphoreGiveRecursive(_worker->mutex);
+}
+
+AsyncSocketBase::~AsyncSocketBase()
+{
+    // Remove this base socket from the monitored list
+    AsyncSocketWorker * w = _lockWorker();
+    if (_slot >= 0 && _slot < w->nSockets && w->sockets[_slot] == this) {
+        w->nSockets--;
+        if (_slot != w->nSockets) {
+            w->sockets[_slot] = w->sockets[w->nSockets];
+            w->sockets[_slot]->_slot = _slot;
+        }
+        w->load--;
+    } else {
+        portENTER_CRITICAL(&(w->inboxMux));
+        for (int i = 0; i < w->inboxCount; i++) {
+            if (w->inbox[i] == this) {
+                w->inbox[i] = w->inbox[w->inboxCount - 1];
+                w->inboxCount--;
+                w->load--;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&(w->inboxMux));
+    }
+    _slot = -1;
+
+    // Might be destroyed from a callback while pending notification
+    for (int i = 0; i < w->nReady; i++) {
+        if (w->ready[i] == this) w->ready[i] = NULL;
+    }
+    if (w->current == this) w->current = NULL;
+    w->timerCancel(this);
+    _unlockWorker(w);
+}
+
+bool AsyncSocketBase::setTaskConfig(const AsyncTaskConfig & config)
+{
+    // Workers are started in order, so the first one is running if any is
+    if (_asyncsock_workers()[0].task != NULL) {
+        log_w("asyncTcpSock tasks already running, settings not applied");
+        return false;
+    }
+    if (config.priority < 1 || config.priority >= configMAX_PRIORITIES || config.stack_size == 0) {
+        log_e("invalid task settings");
+        return false;
+    }
+    if (config.core >= portNUM_PROCESSORS) {
+        log_e("invalid core %d", config.core);
+        return false;
+    }
+    _asyncsock_task_config = config;
+    return true;
+}
+
+void AsyncSocketBase::getTaskConfig(AsyncTaskConfig * config)
+{
+    if (config != NULL) *config = _asyncsock_task_config;
+}
+
+uint32_t AsyncSocketBase::getStackHighWaterMark(uint8_t worker)
+{
+    if (worker >= CONFIG_ASYNC_TCP_WORKER_COUNT) return 0;
+    TaskHandle_t task = _asyncsock_workers()[worker].task;
+    if (task == NULL) return 0;
+    return uxTaskGetStackHighWaterMark(task);
+}
+
+void AsyncSocketBase::getStats(AsyncTCPStats * stats)
+{
+    if (stats == NULL) return;
+    memset(stats, 0, sizeof(AsyncTCPStats));
+#if CONFIG_ASYNC_TCP_STATS
+    AsyncSocketWorker * workers = _asyncsock_workers();
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        AsyncTCPStats s;
+        portENTER_CRITICAL(&(workers[i].statsMux));
+        memcpy(&s, &(workers[i].stats), sizeof(s));
+        portEXIT_CRITICAL(&(workers[i].statsMux));
+
+        stats->wakeups += s.wakeups;
+        stats->loop_time_total += s.loop_time_total;
+        stats->bytes_in += s.bytes_in;
+        stats->bytes_out += s.bytes_out;
+        stats->rx_eagain += s.rx_eagain;
+        stats->tx_eagain += s.tx_eagain;
+        stats->accepts += s.accepts;
+        stats->refusals += s.refusals;
+        if (s.loop_time_max > stats->loop_time_max) stats->loop_time_max = s.loop_time_max;
+        if (s.dispatch_time_max > stats->dispatch_time_max) stats->dispatch_time_max = s.dispatch_time_max;
+        if (s.queue_max > stats->queue_max) stats->queue_max = s.queue_max;
+        for (int b = 0; b < ASYNC_TCP_LATENCY_BUCKETS; b++) stats->write_latency[b] += s.write_latency[b];
+    }
+#endif
+}
+
+void AsyncSocketBase::setTraceEnabled(bool enabled)
+{
+#if CONFIG_ASYNC_TCP_TRACE
+    _asyncsock_trace_on.store(enabled);
+#endif
+}
+
+void AsyncSocketBase::clearTrace(void)
+{
+#if CONFIG_ASYNC_TCP_TRACE
+    _asyncsock_trace_head.store(0);
+#endif
+}
+
+size_t AsyncSocketBase::readTrace(AsyncTraceEvent * events, size_t max)
+{
+#if CONFIG_ASYNC_TCP_TRACE
+    uint32_t head = _asyncsock_trace_head.load();
+    uint32_t count = (head < CONFIG_ASYNC_TCP_TRACE_SIZE) ? head : CONFIG_ASYNC_TCP_TRACE_SIZE;
+    if (count > max) count = max;
+    for (uint32_t i = 0; i < count; i++) {
+        events[i] = _asyncsock_trace_ring[(head - count + i) & (CONFIG_ASYNC_TCP_TRACE_SIZE - 1)];
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
+void AsyncSocketBase::printTrace(Print & out)
+{
+    out.print("{\"traceEvents\":[");
+#if CONFIG_ASYNC_TCP_TRACE
+    static const char * names[ASYNC_TRACE_EVENT_TYPES] = {
+        "select", "writable", "readable", "poll", "connect", "worker lock", "write lock", "dns"
+    };
+
+    uint32_t head = _asyncsock_trace_head.load();
+    uint32_t count = (head < CONFIG_ASYNC_TCP_TRACE_SIZE) ? head : CONFIG_ASYNC_TCP_TRACE_SIZE;
+    uint32_t base = 0;
+    bool first = true;
+    for (uint32_t i = 0; i < count; i++) {
+        AsyncTraceEvent e = _asyncsock_trace_ring[(head - count + i) & (CONFIG_ASYNC_TCP_TRACE_SIZE - 1)];
+        if (e.type >= ASYNC_TRACE_EVENT_TYPES) continue;
+
+        // Timestamps are relative to the oldest event, since micros() wraps
+        if (first) base = e.start;
+        int32_t ts = (int32_t)(e.start - base);
+        int tid = (e.task == ASYNC_TRACE_OTHER_TASK) ? -1 : e.task;
+        if (e.type == ASYNC_TRACE_DNS) {
+            out.printf("%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%d,\"pid\":0,\"tid\":%d}",
+                first ? "" : ",", names[e.type], (int)ts, tid);
+        } else {
+            out.printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%d,\"dur\":%u,\"pid\":0,\"tid\":%d,\"args\":{\"fd\":%d}}",
+                first ? "" : ",", names[e.type], (int)ts, (unsigned)e.duration, tid, (int)e.fd);
+        }
+        first = false;
+    }
+#endif
+    out.print("]}");
+}
+
+void AsyncSocketBase::printStats(Print & out)
+{
+    AsyncTCPStats s;
+    AsyncWritePoolStats p;
+    getStats(&s);
+    AsyncClient::getWritePoolStats(&p);
+
+    out.printf("{\"wakeups\":%u,\"loop_time_max\":%u,\"loop_time_total\":%llu,\"dispatch_time_max\":%u,",
+        (unsigned)s.wakeups, (unsigned)s.loop_time_max, (unsigned long long)s.loop_time_total,
+        (unsigned)s.dispatch_time_max);
+    out.printf("\"bytes_in\":%llu,\"bytes_out\":%llu,\"rx_eagain\":%u,\"tx_eagain\":%u,",
+        (unsigned long long)s.bytes_in, (unsigned long long)s.bytes_out, (unsigned)s.rx_eagain,
+        (unsigned)s.tx_eagain);
+    out.printf("\"accepts\":%u,\"refusals\":%u,\"queue_max\":%u,\"write_latency\":[",
+        (unsigned)s.accepts, (unsigned)s.refusals, (unsigned)s.queue_max);
+    for (int b = 0; b < ASYNC_TCP_LATENCY_BUCKETS; b++) {
+        out.printf("%s%u", (b > 0) ? "," : "", (unsigned)s.write_latency[b]);
+    }
+    out.printf("],\"write_pool\":{\"blocks\":%u,\"blocks_free\":%u,\"blocks_min_free\":%u,"
+        "\"pool_allocs\":%u,\"heap_allocs\":%u,\"coalesced\":%u}}",
+        (unsigned)p.blocks, (unsigned)p.blocks_free, (unsigned)p.blocks_min_free,
+        (unsigned)p.pool_allocs, (unsigned)p.heap_allocs, (unsigned)p.coalesced);
+}
+
+void AsyncSocketBase::resetStats(void)
+{
+#if CONFIG_ASYNC_TCP_STATS
+    AsyncSocketWorker * workers = _asyncsock_workers();
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        portENTER_CRITICAL(&(workers[i].statsMux));
+        memset(&(workers[i].stats), 0, sizeof(AsyncTCPStats));
+        portEXIT_CRITICAL(&(workers[i].statsMux));
+    }
+#endif
+}
+
+// Take the lock of the worker servicing this socket. Since the socket might
+// be migrated to another worker while waiting for the lock, check again
+// after taking it.
+AsyncSocketWorker * AsyncSocketBase::_lockWorker(void)
+{
+    while (true) {
+        AsyncSocketWorker * w = _worker;
+        ASYNCSOCK_TRACE_WAIT(ASYNC_TRACE_WORKER_LOCK, _socket, xSemaphoreTakeRecursive(w->mutex, (TickType_t)portMAX_DELAY));
+        if (w == _worker) return w;
+        xSemaphoreGiveRecursive(w->mutex);
+    }
+}
+
+void AsyncSocketBase::_unlockWorker(AsyncSocketWorker * w)
+{
+    xSemaphoreGiveRecursive(w->mutex);
+}
+
+// Set the timer again, in case the next deadline of this socket moved earlier
+// than the one the timer was set for.
+void AsyncSocketBase::_rearmTimer(void)
+{
+    uint32_t deadline;
+    AsyncSocketWorker * w = _lockWorker();
+    if (_sockNextDeadline(deadline) && (_timer_slot < 0 || (int32_t)(deadline - _timer_expires) < 0)) {
+        w->timerArm(this, deadline);
+    }
+    _unlockWorker(w);
+
+    // Task might need to wake up earlier than planned
+    _asyncsock_wakeup(w);
+}
+
+// Hand over a socket to the least loaded worker. Must be called from the task
+// of the worker currently servicing the socket. The socket might have been
+// destroyed already by an application callback, so it is only looked up by
+// address in the shard of the current worker.
+void AsyncSocketBase::_rebalance(AsyncSocketBase * sock)
+{
+    AsyncSocketWorker * src = _asyncsock_current_worker();
+    AsyncSocketWorker * dst = _asyncsock_least_loaded_worker();
+
+    // Only worth it if the destination has noticeably fewer sockets
+    if (src == NULL || dst == src || dst->load + 1 >= src->load) return;
+    if (dst->load >= CONFIG_ASYNC_TCP_MAX_SOCKETS) return;
+
+    xSemaphoreTakeRecursive(src->mutex, (TickType_t)portMAX_DELAY);
+    int16_t slot;
+    for (slot = 0; slot < src->nSockets; slot++) {
+        if (src->sockets[slot] == sock) break;
+    }
+    bool moved = false;
+    if (slot < src->nSockets) {
+        portENTER_CRITICAL(&(dst->inboxMux));
+        if (dst->inboxCount < ASYNCSOCK_INBOX_SIZE) {
+            dst->inbox[dst->inboxCount++] = sock;
+            dst->load++;
+            moved = true;
+        }
+        portEXIT_CRITICAL(&(dst->inboxMux));
+    }
+    if (moved) {
+        src->nSockets--;
+        if (slot != src->nSockets) {
+            src->sockets[slot] = src->sockets[src->nSockets];
+            src->sockets[slot]->_slot = slot;
+        }
+        src->load--;
+        for (int i = 0; i < src->nReady; i++) {
+            if (src->ready[i] == sock) src->ready[i] = NULL;
+        }
+        src->timerCancel(sock);
+        sock->_slot = -1;
+        sock->_selected = false;
+        sock->_worker = dst;
+    }
+    xSemaphoreGiveRecursive(src->mutex);
+
+    if (moved) _asyncsock_wakeup(dst);
+}
+
+#if CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE > 0
+// Preallocated storage for clients accepted by servers. The objects are still
+// constructed and destroyed as usual (so the application can delete them),
+// but their memory is recycled instead of going back to the heap on every
+// connection.
+static struct {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    alignas(AsyncClient) uint8_t storage[CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE][sizeof(AsyncClient)];
+    uint16_t freeStack[CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE];
+    uint16_t nFree = 0;
+    bool initialized = false;
+} _asyncsock_cpool;
+
+// Index of pool slot holding this client, or -1 if allocated from the heap
+static int _asyncsock_cpool_slot(const void * p)
+{
+    const uint8_t * base = &_asyncsock_cpool.storage[0][0];
+    if ((const uint8_t *)p < base || (const uint8_t *)p >= base + sizeof(_asyncsock_cpool.storage)) return -1;
+    return ((const uint8_t *)p - base) / sizeof(AsyncClient);
+}
+
+static void * _asyncsock_cpool_alloc(void)
+{
+    void * p = NULL;
+    portENTER_CRITICAL(&_asyncsock_cpool.mux);
+    if (!_asyncsock_cpool.initialized) {
+        for (int i = 0; i < CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE; i++) _asyncsock_cpool.freeStack[i] = i;
+        _asyncsock_cpool.nFree = CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE;
+        _asyncsock_cpool.initialized = true;
+    }
+    if (_asyncsock_cpool.nFree > 0) {
+        p = _asyncsock_cpool.storage[_asyncsock_cpool.freeStack[--_asyncsock_cpool.nFree]];
+    }
+    portEXIT_CRITICAL(&_asyncsock_cpool.mux);
+    return p;
+}
+
+#endif
+
+#if CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE > 0 || CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+// Memory of a destroyed client, given back to the pool or the heap
+static void _asyncsock_client_free(void * p)
+{
+#if CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE > 0
+    int slot = _asyncsock_cpool_slot(p);
+    if (slot >= 0) {
+        portENTER_CRITICAL(&_asyncsock_cpool.mux);
+        _asyncsock_cpool.freeStack[_asyncsock_cpool.nFree++] = slot;
+        portEXIT_CRITICAL(&_asyncsock_cpool.mux);
+        return;
+    }
+#endif
+    ::operator delete(p);
+}
+
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+// Returns true if a handler task is still delivering to the client, and
+// frees it once done
+static bool _asyncsock_dying_delete(void * p)
+{
+    AsyncEventHandler * handlers = _asyncsock_handlers();
+    for (int i = 0; i < CONFIG_ASYNC_TCP_HANDLER_TASKS; i++) {
+        AsyncEventHandler * h = &handlers[i];
+        portENTER_CRITICAL(&h->mux);
+        bool busy = false;
+        if (h->dying == p) {
+            busy = h->dying_busy;
+            if (busy) h->dying_deleted = true;
+            else h->dying = NULL;
+        }
+        portEXIT_CRITICAL(&h->mux);
+        if (busy) return true;
+    }
+    return false;
+}
+#endif
+
+void AsyncClient::operator delete(void * p)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_asyncsock_dying_delete(p)) return;
+#endif
+    _asyncsock_client_free(p);
+}
+#endif
+// Handlers set through the on*() methods. These are only allocated once the
+// first of them is set, so that clients using a listener do not pay for them.
+struct AsyncClientCallbacks
+{
+    AcConnectHandler _connect_cb;
+    void* _connect_cb_arg = NULL;
+    AcConnectHandler _discard_cb;
+    void* _discard_cb_arg = NULL;
+    AcAckHandler _sent_cb;
+    void* _sent_cb_arg = NULL;
+    AcErrorHandler _error_cb;
+    void* _error_cb_arg = NULL;
+    AcDataHandler _recv_cb;
+    void* _recv_cb_arg = NULL;
+    AcTimeoutHandler _timeout_cb;
+    void* _timeout_cb_arg = NULL;
+    AcConnectHandler _poll_cb;
+    void* _poll_cb_arg = NULL;
+    AcPacketHandler _pb_cb;
+    void* _pb_cb_arg = NULL;
+};
+
+AsyncClient::AsyncClient(int sockfd)
+: _rx_last_packet(0)
+, _rx_since_timeout(0)
+, _ack_timeout(ASYNC_MAX_ACK_TIME)
+, _connect_port(0)
+, _conn_state(0)
+, _writeSpaceRemaining(TCP_SND_BUF)
+{
+    memset(&_connect_addr, 0, sizeof(_connect_addr));
+    memset(&_connect_alt, 0, sizeof(_connect_alt));
+#if CONFIG_ASYNC_TCP_STATS
+    memset(&_stats, 0, sizeof(_stats));
+#endif
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // Clients are spread across the handler tasks in turn
+    _deferred_handler = _asyncsock_next_handler++ % CONFIG_ASYNC_TCP_HANDLER_TASKS;
+#endif
+#if ASYNCSOCK_WRITE_MUTEX
+    // Held within the object, so it takes nothing from the heap
+    _write_mutex = xSemaphoreCreateMutexStatic(&_write_mutex_buf);
+#endif
+    if (sockfd != -1) {
+        int r = fcntl( sockfd, F_SETFL, fcntl( sockfd, F_GETFL, 0 ) | O_NONBLOCK );
+
+        // Updating state visible to asyncTcpSock task
+        AsyncSocketWorker * w = _lockWorker();
+        _conn_state = 4;
+        _socket = sockfd;
+        _unlockWorker(w);
+        _asyncsock_wakeup(w);
+    }
+}
+
+AsyncClient::~AsyncClient()
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // Handlers invoked from here on run right away, as when not deferred
+    bool dying = _cancelDeferred();
+#endif
+    if (_socket != -1) _close();
+    // Also listed while connecting, until the other address is known
+    AsyncDnsCache::cancel(this);
+    ::free(_reconnect_host);
+#if ASYNC_TCP_SSL_ENABLED
+    ::free(_tls_host);
+#endif
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // The handler task might still be running one of the callbacks
+    if (dying && _handOverDying()) return;
+#endif
+    delete _cbs;
+    _cbs = NULL;
+#if ASYNCSOCK_WRITE_MUTEX
+    vSemaphoreDelete(_write_mutex);
+    _write_mutex = NULL;
+#endif
+}
+
+// Without a write mutex of its own, the write queue of a client is protected
+// by the mutex of its worker. Since a socket is never moved to another worker
+// while that mutex is held, it can be released through _worker.
+inline void AsyncClient::_writeLock(void)
+{
+#if ASYNCSOCK_WRITE_MUTEX
+    ASYNCSOCK_TRACE_WAIT(ASYNC_TRACE_WRITE_LOCK, _socket, xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY));
+#else
+    _lockWorker();
+#endif
+}
+
+inline void AsyncClient::_writeUnlock(void)
+{
+#if ASYNCSOCK_WRITE_MUTEX
+    xSemaphoreGive(_write_mutex);
+#else
+    _unlockWorker(_worker);
+#endif
+}
+
+size_t AsyncClient::getMemoryUsage(AsyncClientMemoryInfo * info)
+{
+    AsyncClientMemoryInfo m;
+
+    memset(&m, 0, sizeof(m));
+    m.object = sizeof(AsyncClient);
+    if (_cbs != NULL) m.callbacks = sizeof(AsyncClientCallbacks);
+
+    _writeLock();
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE <= 0
+    // Nodes as allocated by libstdc++, one more than the queued buffers fill,
+    // and a map of at least 8 node pointers
+    {
+#ifdef __GLIBCXX__
+        size_t per_node = std::__deque_buf_size(sizeof(queued_writebuf));
+#else
+        size_t per_node = (sizeof(queued_writebuf) < 512) ? 512 / sizeof(queued_writebuf) : 1;
+#endif
+        size_t nodes = _writeQueue.size() / per_node + 1;
+        m.write_queue = nodes * per_node * sizeof(queued_writebuf) + ((nodes + 2 > 8) ? nodes + 2 : 8) * sizeof(void *);
+    }
+#endif
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end(); it++) {
+        if (it->owned) m.write_data += it->capacity;
+    }
+    _writeUnlock();
+
+    if (_stream_buf != NULL) m.stream_buffer = CONFIG_ASYNC_TCP_STREAM_BUFFER_SIZE;
+
+    m.total = m.object + m.callbacks + m.write_queue + m.write_data + m.stream_buffer;
+    if (info != NULL) *info = m;
+    return m.total;
+}
+
+void AsyncClient::setRxTimeout(uint32_t timeout){
+    _rx_since_timeout = timeout;
+    _rearmTimer();
+}
+
+uint32_t AsyncClient::getRxTimeout(){
+    return _rx_since_timeout;
+}
+
+uint32_t AsyncClient::getAckTimeout(){
+    return _ack_timeout;
+}
+
+void AsyncClient::setAckTimeout(uint32_t timeout){
+    _ack_timeout = timeout;
+    _rearmTimer();
+}
+
+uint32_t AsyncClient::getPollInterval(){
+    return _poll_interval;
+}
+
+void AsyncClient::setPollInterval(uint32_t interval){
+    if (interval < CONFIG_ASYNC_TCP_TIMER_RESOLUTION) interval = CONFIG_ASYNC_TCP_TIMER_RESOLUTION;
+    _poll_interval = interval;
+    _rearmTimer();
+}
+
+uint32_t AsyncClient::getConnectTimeout(){
+    return _connect_timeout;
+}
+
+void AsyncClient::setConnectTimeout(uint32_t timeout){
+    _connect_timeout = timeout;
+    _rearmTimer();
+}
+
+void AsyncClient::setReconnect(uint32_t min_delay, uint32_t max_delay, uint8_t max_attempts){
+    _reconnect_min = min_delay;
+    _reconnect_max = (max_delay > min_delay) ? max_delay : min_delay;
+    _reconnect_max_attempts = max_attempts;
+}
+
+void AsyncClient::setNoDelay(bool nodelay){
+    if (_socket == -1) return;
+
+    int flag = nodelay;
+    int res = setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    if(res < 0) {
+        log_e("fail on fd %d, errno: %d, \"%s\"", _socket, errno, strerror(errno));
+    }
+}
+
+bool AsyncClient::getNoDelay(){
+    if (_socket == -1) return false;
+
+    int flag = 0;
+    size_t size = sizeof(int);
+    int res = getsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, &size);
+    if(res < 0) {
+        log_e("fail on fd %d, errno: %d, \"%s\"", _socket, errno, strerror(errno));
+    }
+    return flag;
+}
+
+/*
+ * Callback Setters
+ * */
+
+AsyncClientCallbacks * AsyncClient::_callbacks(void){
+    if (_cbs == NULL) _cbs = new AsyncClientCallbacks;
+    return _cbs;
+}
+
+void AsyncClient::setListener(AsyncClientListener * listener){
+    _listener = listener;
+}
+
+void AsyncClient::onConnect(AcConnectHandler cb, void* arg){
+    _callbacks()->_connect_cb = cb;
+    _cbs->_connect_cb_arg = arg;
+}
+
+void AsyncClient::onDisconnect(AcConnectHandler cb, void* arg){
+    _callbacks()->_discard_cb = cb;
+    _cbs->_discard_cb_arg = arg;
+}
+
+void AsyncClient::onAck(AcAckHandler cb, void* arg){
+    _callbacks()->_sent_cb = cb;
+    _cbs->_sent_cb_arg = arg;
+}
+
+void AsyncClient::onError(AcErrorHandler cb, void* arg){
+    _callbacks()->_error_cb = cb;
+    _cbs->_error_cb_arg = arg;
+}
+
+void AsyncClient::onData(AcDataHandler cb, void* arg){
+    _callbacks()->_recv_cb = cb;
+    _cbs->_recv_cb_arg = arg;
+}
+
+void AsyncClient::onTimeout(AcTimeoutHandler cb, void* arg){
+    _callbacks()->_timeout_cb = cb;
+    _cbs->_timeout_cb_arg = arg;
+}
+
+void AsyncClient::onPoll(AcConnectHandler cb, void* arg){
+    _callbacks()->_poll_cb = cb;
+    _cbs->_poll_cb_arg = arg;
+}
+
+void AsyncClient::onPacket(AcPacketHandler cb, void* arg){
+    _callbacks()->_pb_cb = cb;
+    _cbs->_pb_cb_arg = arg;
+}
+
+bool AsyncClient::connected(){
+    if (_socket == -1) {
+        return false;
+    }
+    return _conn_state == 4;
+}
+
+bool AsyncClient::freeable(){
+    if (_socket == -1) {
+        return true;
+    }
+    return _conn_state == 0 || _conn_state > 4;
+}
+
+// Conversions between socket addresses and lwIP addresses. IPv4-mapped IPv6
+// addresses, as reported by dual-stack sockets, are converted to IPv4.
+static uint16_t _asyncsock_from_sockaddr(const struct sockaddr * sa, ip_addr_t * ip)
+{
+    memset(ip, 0, sizeof(ip_addr_t));
+#if LWIP_IPV6
+    if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 * s6 = (const struct sockaddr_in6 *)sa;
+        uint32_t a[4];
+        memcpy(a, &s6->sin6_addr, sizeof(a));
+        if (a[0] == 0 && a[1] == 0 && a[2] == htonl(0x0000FFFFUL)) {
+            ip->type = IPADDR_TYPE_V4;
+            ip->u_addr.ip4.addr = a[3];
+        } else {
+            ip->type = IPADDR_TYPE_V6;
+            memcpy(ip->u_addr.ip6.addr, a, sizeof(a));
+#if LWIP_IPV6_SCOPES
+            ip->u_addr.ip6.zone = s6->sin6_scope_id;
+#endif
+        }
+        return ntohs(s6->sin6_port);
+    }
+#endif
+    const struct sockaddr_in * s4 = (const struct sockaddr_in *)sa;
+    ip->type = IPADDR_TYPE_V4;
+    ip->u_addr.ip4.addr = s4->sin_addr.s_addr;
+    return ntohs(s4->sin_port);
+}
+
+static socklen_t _asyncsock_to_sockaddr(const ip_addr_t & ip, uint16_t port, struct sockaddr_storage * ss)
+{
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+#if LWIP_IPV6
+    if (IP_IS_V6(&ip)) {
+        struct sockaddr_in6 * s6 = (struct sockaddr_in6 *)ss;
+        s6->sin6_family = AF_INET6;
+        s6->sin6_port = htons(port);
+        memcpy(&s6->sin6_addr, ip.u_addr.ip6.addr, 16);
+#if LWIP_IPV6_SCOPES
+        s6->sin6_scope_id = ip.u_addr.ip6.zone;
+#endif
+        return sizeof(struct sockaddr_in6);
+    }
+#endif
+    struct sockaddr_in * s4 = (struct sockaddr_in *)ss;
+    s4->sin_family = AF_INET;
+    s4->sin_port = htons(port);
+    s4->sin_addr.s_addr = ip.u_addr.ip4.addr;
+    return sizeof(struct sockaddr_in);
+}
+
+void AsyncClient::_setPeer(const struct sockaddr * addr) {
+    _peer_port = _asyncsock_from_sockaddr(addr, &_peer_addr);
+    _peer_cached = true;
+}
+
+void AsyncClient::_cachePeer(void) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    if (getpeername(_socket, (struct sockaddr*)&addr, &len) < 0) return;
+    _setPeer((struct sockaddr*)&addr);
+}
+
+void AsyncClient::_cacheLocal(void) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    if (getsockname(_socket, (struct sockaddr*)&addr, &len) < 0) return;
+    _local_port = _asyncsock_from_sockaddr((struct sockaddr*)&addr, &_local_addr);
+    _local_cached = true;
+}
+
+bool AsyncClient::getRemoteAddr(ip_addr_t * addr) {
+    if (_socket == -1) {
+        return false;
+    }
+    if (!_peer_cached) _cachePeer();
+    if (!_peer_cached) return false;
+    if (addr != NULL) *addr = _peer_addr;
+    return true;
+}
+
+bool AsyncClient::getLocalAddr(ip_addr_t * addr) {
+    if (_socket == -1) {
+        return false;
+    }
+    if (!_local_cached) _cacheLocal();
+    if (!_local_cached) return false;
+    if (addr != NULL) *addr = _local_addr;
+    return true;
+}
+
+uint32_t AsyncClient::getRemoteAddress() {
+    ip_addr_t addr;
+    if (!getRemoteAddr(&addr) || !IP_IS_V4(&addr)) return 0;
+    return addr.u_addr.ip4.addr;
+}
+
+uint16_t AsyncClient::getRemotePort() {
+    if (!getRemoteAddr(NULL)) return 0;
+    return _peer_port;
+}
+
+uint32_t AsyncClient::getLocalAddress() {
+    ip_addr_t addr;
+    if (!getLocalAddr(&addr) || !IP_IS_V4(&addr)) return 0;
+    return addr.u_addr.ip4.addr;
+}
+
+uint16_t AsyncClient::getLocalPort() {
+    if (!getLocalAddr(NULL)) return 0;
+    return _local_port;
+}
+
+#if LWIP_IPV6
+ip6_addr_t AsyncClient::getRemoteAddress6() {
+    ip_addr_t addr;
+    ip6_addr_t r;
+    memset(&r, 0, sizeof(r));
+    if (getRemoteAddr(&addr) && IP_IS_V6(&addr)) r = addr.u_addr.ip6;
+    return r;
+}
+
+ip6_addr_t AsyncClient::getLocalAddress6() {
+    ip_addr_t addr;
+    ip6_addr_t r;
+    memset(&r, 0, sizeof(r));
+    if (getLocalAddr(&addr) && IP_IS_V6(&addr)) r = addr.u_addr.ip6;
+    return r;
+}
+
+bool AsyncClient::isV6() {
+    ip_addr_t addr;
+    return getRemoteAddr(&addr) && IP_IS_V6(&addr);
+}
+
+IPv6Address AsyncClient::remoteIP6() {
+    return IPv6Address(getRemoteAddress6().addr);
+}
+
+IPv6Address AsyncClient::localIP6() {
+    return IPv6Address(getLocalAddress6().addr);
+}
+#endif
+
+IPAddress AsyncClient::remoteIP() {
+    return IPAddress(getRemoteAddress());
+}
+
+uint16_t AsyncClient::remotePort() {
+    return getRemotePort();
+}
+
+IPAddress AsyncClient::localIP() {
+    return IPAddress(getLocalAddress());
+}
+
+uint16_t AsyncClient::localPort() {
+    return getLocalPort();
+}
+
+
+#if ASYNC_TCP_SSL_ENABLED
+bool AsyncClient::connect(IPAddress ip, uint16_t port, bool secure)
+#else
+bool AsyncClient::connect(IPAddress ip, uint16_t port)
+#endif
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V4;
+    addr.u_addr.ip4.addr = (uint32_t)ip;
+    memset(&_connect_alt, 0, sizeof(_connect_alt));
+    ::free(_reconnect_host);
+    _reconnect_host = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+    _secure = secure;
+    ::free(_tls_host);
+    _tls_host = NULL;
+#endif
+    return _connect(addr, port);
+}
+
+#if LWIP_IPV6
+#if ASYNC_TCP_SSL_ENABLED
+bool AsyncClient::connect(IPv6Address ip, uint16_t port, bool secure)
+#else
+bool AsyncClient::connect(IPv6Address ip, uint16_t port)
+#endif
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V6;
+    memcpy(addr.u_addr.ip6.addr, (const uint8_t *)ip, 16);
+    memset(&_connect_alt, 0, sizeof(_connect_alt));
+    ::free(_reconnect_host);
+    _reconnect_host = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+    _secure = secure;
+    ::free(_tls_host);
+    _tls_host = NULL;
+#endif
+    return _connect(addr, port);
+}
+#endif
+
+// Create a non-blocking socket, and start connecting it. Returns the socket,
+// or -1 on failure.
+static int _asyncsock_connect(const ip_addr_t & addr, uint16_t port)
+{
+    struct sockaddr_storage serveraddr;
+    socklen_t serveraddr_len = _asyncsock_to_sockaddr(addr, port, &serveraddr);
+
+    int sockfd = socket(serveraddr.ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        log_e("socket: %d", errno);
+        return -1;
+    }
+    int r = fcntl( sockfd, F_SETFL, fcntl( sockfd, F_GETFL, 0 ) | O_NONBLOCK );
+
+#ifdef EINPROGRESS
+    #if EINPROGRESS != 119
+    #error EINPROGRESS invalid
+    #endif
+#endif
+
+    //Serial.printf("DEBUG: connect to %08x port %d using IP... ", ip_addr, port);
+    errno = 0;
+#ifdef ESP_IDF_VERSION_MAJOR
+    r = lwip_connect(sockfd, (struct sockaddr*)&serveraddr, serveraddr_len);
+#else
+    r = lwip_connect_r(sockfd, (struct sockaddr*)&serveraddr, serveraddr_len);
+#endif
+    //Serial.printf("r=%d errno=%d\r\n", r, errno);
+    if (r < 0 && errno != EINPROGRESS) {
+        //Serial.println("\t(connect failed)");
+        log_e("connect on fd %d, errno: %d, \"%s\"", sockfd, errno, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+bool AsyncClient::_connect(const ip_addr_t & addr, uint16_t port)
+{
+    if (_socket != -1) {
+        log_w("already connected, state %d", _conn_state);
+        return false;
+    }
+
+    if (_slot < 0) {
+        log_e("socket not monitored, too many sockets");
+        return false;
+    }
+
+    if(!_start_asyncsock_task()){
+        log_e("failed to start task");
+        return false;
+    }
+
+    int sockfd = _asyncsock_connect(addr, port);
+    if (sockfd < 0) return false;
+
+    // Updating state visible to asyncTcpSock task
+    AsyncSocketWorker * w = _lockWorker();
+    _conn_state = 2;
+    _socket = sockfd;
+    _peer_addr = addr;
+    _peer_port = port;
+    _peer_cached = true;
+    _local_cached = false;
+    _connect_addr = addr;
+    _connect_port = port;
+    _connect_started = millis();
+    _unlockWorker(w);
+
+    // Socket is now connecting. Should become writable in asyncTcpSock task.
+    // If racing to another address, its timer must also be due in time.
+    //Serial.printf("\twaiting for connect finished on socket: %d\r\n", _socket);
+    if (CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY > 0 && !ip_addr_isany(&_connect_alt)) {
+        _rearmTimer();
+    } else {
+        _asyncsock_wakeup(w);
+    }
+    return true;
+}
+
+// Start connecting to the other address now, and carry on with that attempt
+// only, since the first one has failed
+bool AsyncClient::_failOverConnect(void)
+{
+    if (ip_addr_isany(&_connect_alt)) return false;
+    if (_alt_socket == -1) {
+        _alt_socket = _asyncsock_connect(_connect_alt, _connect_port);
+        if (_alt_socket == -1) return false;
+    }
+    _switchToAltSocket();
+    _connect_started = millis();
+    return true;
+}
+
+// Called from the asyncTcpSock task, while connecting
+void AsyncClient::_switchToAltSocket(void)
+{
+    AsyncSocketWorker * w = _lockWorker();
+#ifdef ESP_IDF_VERSION_MAJOR
+    lwip_close(_socket);
+#else
+    lwip_close_r(_socket);
+#endif
+    _socket = _alt_socket;
+    _alt_socket = -1;
+    _selected = false;
+    _peer_addr = _connect_alt;
+    _peer_cached = true;
+    memset(&_connect_alt, 0, sizeof(_connect_alt));
+    _unlockWorker(w);
+}
+
+void AsyncClient::_closeAltSocket(void)
+{
+    if (_alt_socket != -1) {
+#ifdef ESP_IDF_VERSION_MAJOR
+        lwip_close(_alt_socket);
+#else
+        lwip_close_r(_alt_socket);
+#endif
+        _alt_socket = -1;
+    }
+    memset(&_connect_alt, 0, sizeof(_connect_alt));
+}
+
+// Happy Eyeballs: start the attempt to the other address when the first one
+// is taking too long, then check whether it has completed. Returns true if the
+// client has connected through it, in which case onConnect has been called.
+bool AsyncClient::_raceConnect(uint32_t now)
+{
+    if (_alt_socket == -1) {
+        if (now - _connect_started < CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY) return false;
+        _alt_socket = _asyncsock_connect(_connect_alt, _connect_port);
+        if (_alt_socket == -1) memset(&_connect_alt, 0, sizeof(_connect_alt));
+        return false;
+    }
+
+    fd_set sockSet_w;
+    struct timeval tv;
+    FD_ZERO(&sockSet_w);
+    FD_SET(_alt_socket, &sockSet_w);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (select(_alt_socket + 1, NULL, &sockSet_w, NULL, &tv) <= 0) return false;
+
+    int sockerr = 0;
+    socklen_t len = (socklen_t)sizeof(int);
+    if (getsockopt(_alt_socket, SOL_SOCKET, SO_ERROR, &sockerr, &len) < 0 || sockerr != 0) {
+        // Leave the first attempt on its own
+        _closeAltSocket();
+        return false;
+    }
+
+    // The other attempt won. Finish connecting through it.
+    _switchToAltSocket();
+    _sockIsWriteable();
+    return true;
+}
+
+void _tcpsock_dns_found(const char * name, struct ip_addr * ipaddr, void * arg);
+
+/*
+ * Host name lookups
+ * */
+
+AsyncDnsCache::Entry AsyncDnsCache::entries[CONFIG_ASYNC_TCP_DNS_CACHE_SIZE];
+
+int AsyncDnsCache::lookup(AsyncClient * c, const char * host)
+{
+    Entry * e = NULL;
+    Entry * victim = NULL;
+    uint32_t now = millis();
+    bool both = ASYNCSOCK_DNS_BOTH && CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY > 0;
+
+    if (strlen(host) >= CONFIG_ASYNC_TCP_DNS_NAME_MAX) {
+        log_e("host name too long: %s", host);
+        return -1;
+    }
+
+    portENTER_CRITICAL(&_asyncsock_dns_mux);
+    // Still listed if waiting for the other address of an earlier lookup
+    _unlink(c);
+    for (int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE; i++) {
+        Entry * it = &entries[i];
+        // Reuse a free entry, or else the oldest result
+        if (it->pending == 0 && it->late == NULL && (victim == NULL || (victim->name[0] != '\0'
+                && (it->name[0] == '\0' || (int32_t)(it->resolved_at - victim->resolved_at) < 0)))) {
+            victim = it;
+        }
+        if (it->name[0] != '\0' && strcmp(it->name, host) == 0) e = it;
+    }
+
+    if (e != NULL && e->pending > 0) {
+        // Name is being looked up for another client already
+        c->_dns_next = e->waiters;
+        e->waiters = c;
+        portEXIT_CRITICAL(&_asyncsock_dns_mux);
+        return 0;
+    }
+    if (e != NULL && (!ip_addr_isany(&e->addr[0]) || !ip_addr_isany(&e->addr[1]))
+            && now - e->resolved_at < CONFIG_ASYNC_TCP_DNS_CACHE_TTL * 1000UL) {
+        _assign(c, e);
+        portEXIT_CRITICAL(&_asyncsock_dns_mux);
+        return 1;
+    }
+    if (e == NULL) e = victim;
+    if (e == NULL) {
+        portEXIT_CRITICAL(&_asyncsock_dns_mux);
+        log_e("too many host name lookups in progress");
+        return -1;
+    }
+    strcpy(e->name, host);
+    memset(e->addr, 0, sizeof(e->addr));
+    e->pending = both ? 2 : 1;
+    c->_dns_next = NULL;
+    e->waiters = c;
+    portEXIT_CRITICAL(&_asyncsock_dns_mux);
+
+    // Looked up outside of the lock, since results might be reported right
+    // away. With Happy Eyeballs, both address families are looked up at once.
+    ip_addr_t addr;
+    err_t err;
+    for (int k = 0; k < (both ? 2 : 1); k++) {
+#if LWIP_IPV6
+        uint8_t addrtype = !both ? CONFIG_ASYNC_TCP_DNS_ADDRTYPE
+            : ((k == 0) == (bool)ASYNCSOCK_DNS_PREFER_V6) ? LWIP_DNS_ADDRTYPE_IPV6 : LWIP_DNS_ADDRTYPE_IPV4;
+        err = dns_gethostbyname_addrtype(host, &addr, (dns_found_callback)&_tcpsock_dns_found, e, addrtype);
+#else
+        err = dns_gethostbyname(host, &addr, (dns_found_callback)&_tcpsock_dns_found, e);
+#endif
+        if (err == ERR_OK) {
+            found(e, &addr);
+        } else if (err != ERR_INPROGRESS) {
+            log_e("error: %d", err);
+            found(e, NULL);
+        }
+    }
+
+    // If already resolved, connect right away rather than in the asyncTcpSock
+    // task, unless that task has already picked up the result
+    int r = 0;
+    portENTER_CRITICAL(&_asyncsock_dns_mux);
+    if (c->_isdnsfinished) {
+        c->_isdnsfinished = false;
+        r = ip_addr_isany(&c->_connect_addr) ? -1 : 1;
+    }
+    portEXIT_CRITICAL(&_asyncsock_dns_mux);
+    return r;
+}
+
+// May run in the LWIP thread
+void AsyncDnsCache::found(Entry * e, const ip_addr_t * ipaddr)
+{
+    bool wake[CONFIG_ASYNC_TCP_WORKER_COUNT] = { false };
+    AsyncSocketWorker * workers = _asyncsock_workers();
+
+    // Updating state visible to asyncTcpSock task. The worker mutex must not
+    // be taken here, since the worker might be holding it while waiting for
+    // the LWIP thread to complete a socket call.
+    portENTER_CRITICAL(&_asyncsock_dns_mux);
+    if (ipaddr) {
+        int k = (ASYNCSOCK_DNS_BOTH && IP_IS_V6(ipaddr) != (bool)ASYNCSOCK_DNS_PREFER_V6) ? 1 : 0;
+        memcpy(&e->addr[k], ipaddr, sizeof(struct ip_addr));
+    }
+    if (e->pending > 0) e->pending--;
+
+    // Waiters connect as soon as the preferred address is known, or once all
+    // lookups are done. Those connecting before the other address is known
+    // are told again once it is, and pick it up with alternate().
+    if (e->pending == 0 || !ip_addr_isany(&e->addr[0])) {
+        e->resolved_at = millis();
+        AsyncClient * last = NULL;
+        for (AsyncClient * c = e->waiters; c != NULL; c = c->_dns_next) {
+            _assign(c, e);
+            c->_isdnsfinished = true;
+            wake[c->_worker->index] = true;
+            last = c;
+        }
+        if (e->pending > 0 && last != NULL) {
+            last->_dns_next = e->late;
+            e->late = e->waiters;
+        }
+        e->waiters = NULL;
+    }
+    if (e->pending == 0) {
+        for (AsyncClient ** p = &e->late; *p != NULL; ) {
+            AsyncClient * c = *p;
+            if (c->_isdnsfinished) {
+                // Not connecting yet, so it takes both addresses at once
+                _assign(c, e);
+                *p = c->_dns_next;
+                c->_dns_next = NULL;
+            } else {
+                c->_isdnsfinished = true;
+                wake[c->_worker->index] = true;
+                p = &c->_dns_next;
+            }
+        }
+    }
+    if (e->pending == 0 && ip_addr_isany(&e->addr[0]) && ip_addr_isany(&e->addr[1])) {
+        // Failures are not cached
+        e->name[0] = '\0';
+    }
+    portEXIT_CRITICAL(&_asyncsock_dns_mux);
+
+    // Socket API cannot be used from the LWIP thread, so the wakeup of the
+    // asyncTcpSock task is deferred to the timer service task.
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT; i++) {
+        if (wake[i]) xTimerPendFunctionCall(_asyncsock_wakeup_deferred, &workers[i], 0, 0);
+    }
+}
+
+// Client no longer waits for a lookup it started, or joined
+void AsyncDnsCache::cancel(AsyncClient * c)
+{
+    portENTER_CRITICAL(&_asyncsock_dns_mux);
+    _unlink(c);
+    c->_isdnsfinished = false;
+    portEXIT_CRITICAL(&_asyncsock_dns_mux);
+}
+
+bool AsyncDnsCache::alternate(AsyncClient * c, ip_addr_t * addr)
+{
+    bool late = false;
+    memset(addr, 0, sizeof(*addr));
+    portENTER_CRITICAL(&_asyncsock_dns_mux);
+    for (int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE && !late; i++) {
+        Entry * e = &entries[i];
+        if (e->pending > 0) continue;
+        for (AsyncClient ** p = &e->late; *p != NULL; p = &(*p)->_dns_next) {
+            if (*p == c) {
+                *p = c->_dns_next;
+                c->_dns_next = NULL;
+                late = true;
+                if (!ip_addr_isany(&e->addr[0])) *addr = e->addr[1];
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&_asyncsock_dns_mux);
+    return late;
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+bool AsyncClient::connect(const char* host, uint16_t port, bool secure){
+#else
+bool AsyncClient::connect(const char* host, uint16_t port){
+#endif
+    ip_addr_t addr;
+    
+    if (_slot < 0) {
+      log_e("socket not monitored, too many sockets");
+      return false;
+    }
+
+    if(!_start_asyncsock_task()){
+      log_e("failed to start task");
+      return false;
+    }
+
+    // Keep the name to look it up again when retrying
+    if (_reconnect_min > 0 && host != _reconnect_host) {
+        ::free(_reconnect_host);
+        _reconnect_host = strdup(host);
+    }
+
+    // Numeric addresses need no lookup
+    bool numeric = ipaddr_aton(host, &addr);
+
+#if ASYNC_TCP_SSL_ENABLED
+    // Name for SNI and for checking the server certificate
+    _secure = secure;
+    if (host != _tls_host) {
+        ::free(_tls_host);
+        _tls_host = (secure && !numeric) ? strdup(host) : NULL;
+    }
+#endif
+
+    if (numeric) {
+        AsyncDnsCache::cancel(this);
+        memset(&_connect_alt, 0, sizeof(_connect_alt));
+        return _connect(addr, port);
+    }
+
+    //Serial.printf("DEBUG: connect to %s port %d using DNS...\r\n", host, port);
+    _connect_port = port;
+    int r = AsyncDnsCache::lookup(this, host);
+    if (r > 0) {
+        //Serial.printf("\taddr resolved as %08x, connecting...\r\n", _connect_addr.u_addr.ip4.addr);
+        return _connect(_connect_addr, port);
+    }
+    //Serial.println("\twaiting for DNS resolution");
+    return r == 0;
+}
+
+// This function runs in the LWIP thread
+void _tcpsock_dns_found(const char * name, struct ip_addr * ipaddr, void * arg)
+{
+    ASYNCSOCK_TRACE_EVENT(ASYNC_TRACE_DNS, -1);
+    AsyncDnsCache::found((AsyncDnsCache::Entry *)arg, ipaddr);
+}
+
+// DNS resolving has finished. Check for error or connect
+void AsyncClient::_sockDelayedConnect(void)
+{
+#if ASYNC_TCP_SSL_ENABLED && CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    // Also raised once an offloaded TLS handshake is over
+    if (_tls_job != NULL) {
+        portENTER_CRITICAL(&_asyncsock_dns_mux);
+        bool done = _tls_job->done;
+        int r = _tls_job->result;
+        portEXIT_CRITICAL(&_asyncsock_dns_mux);
+        if (!done) return;
+        delete _tls_job;
+        _tls_job = NULL;
+        _tlsFinished(r);
+        return;
+    }
+#endif
+    // Other address, known once already connecting to the preferred one
+    ip_addr_t alt;
+    if (AsyncDnsCache::alternate(this, &alt)) {
+        if (_conn_state == 2 && CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY > 0
+                && !ip_addr_isany(&alt) && ip_addr_isany(&_connect_alt)) {
+            _connect_alt = alt;
+            _rearmTimer();
+        }
+        return;
+    }
+    // Unresolved names leave an all-zero address, of either type
+    if (!ip_addr_isany(&_connect_addr)) {
+        if (!_connect(_connect_addr, _connect_port) && _socket == -1) _connectFailed(ERR_CONN);
+    } else {
+        _connectFailed(-55);
+    }
+}
+
+// A connection attempt has failed, and the socket, if any, is closed already.
+// Unless retrying later, the client is now disconnected.
+void AsyncClient::_connectFailed(int8_t err)
+{
+    _notifyError(err);
+
+    // Error handler might have connected again already
+    if (_socket != -1 || _scheduleReconnect()) return;
+    _reconnect_attempts = 0;
+    _notifyDisconnect();
+}
+
+bool AsyncClient::_scheduleReconnect(void)
+{
+    if (_reconnect_min == 0) return false;
+    if (_reconnect_max_attempts > 0 && _reconnect_attempts >= _reconnect_max_attempts) return false;
+
+    // Exponential backoff, with a random delay between half and all of it
+    uint32_t delay = _reconnect_min;
+    for (uint8_t i = 0; i < _reconnect_attempts && delay < _reconnect_max; i++) delay <<= 1;
+    if (delay > _reconnect_max) delay = _reconnect_max;
+    delay = delay / 2 + esp_random() % (delay / 2 + 1);
+
+    _reconnect_attempts++;
+    _reconnect_at = millis() + delay;
+    _reconnect_pending = true;
+    _rearmTimer();
+    return true;
+}
+
+void AsyncClient::_reconnect(void)
+{
+    _reconnect_pending = false;
+#if ASYNC_TCP_SSL_ENABLED
+    bool ok = (_reconnect_host != NULL)
+        ? connect(_reconnect_host, _connect_port, _secure)
+        : _connect(_connect_addr, _connect_port);
+#else
+    bool ok = (_reconnect_host != NULL)
+        ? connect(_reconnect_host, _connect_port)
+        : _connect(_connect_addr, _connect_port);
+#endif
+    if (!ok && _socket == -1) _connectFailed(ERR_CONN);
+}
+
+static_assert(TCP_SND_BUF <= 0xFFFF, "queued_writebuf lengths are 16 bits");
+static_assert(CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE <= 0xFFFF, "queued_writebuf lengths are 16 bits");
+
+bool AsyncClient::_sockIsWriteable(void)
+{
+    int res;
+    int sockerr;
+    socklen_t len;
+    bool activity = false;
+    bool hasErr = false;
+
+    int sent_errno = 0;
+
+    // Socket is now writeable. What should we do?
+    switch (_conn_state) {
+    case 3:
+#if ASYNC_TCP_SSL_ENABLED
+        // TLS handshake is waiting for room in the socket
+        if (_tls != NULL) {
+            _tlsHandshake();
+            activity = true;
+            break;
+        }
+#endif
+        // fall through
+    case 2:
+        // Socket has finished connecting. What happened?
+        len = (socklen_t)sizeof(int);
+        res = getsockopt(_socket, SOL_SOCKET, SO_ERROR, &sockerr, &len);
+        if (res < 0 || sockerr != 0) {
+            // The other address family, if any, might still work
+            int err = (res < 0) ? errno : sockerr;
+            if (!_failOverConnect()) _error(err);
+        } else {
+            // Socket is now fully connected, and its local endpoint known
+            _closeAltSocket();
+            _cacheLocal();
+            activity = true;
+#if ASYNC_TCP_SSL_ENABLED
+            if (_secure) {
+                int r = _startTLS();
+                if (r != 0) {
+                    _error((r == MBEDTLS_ERR_SSL_ALLOC_FAILED) ? ERR_MEM : ERR_CONN);
+                } else {
+                    _tlsHandshake();
+                }
+                break;
+            }
+#endif
+            _connected();
+        }
+        break;
+    case 4:
+    default:
+        // Socket can accept some new data...
+        {
+            AsyncSocketWorker * w = _worker;
+            uint8_t nAcks = 0;
+            size_t ack_length[ASYNCSOCK_ACK_BATCH] = {0};
+            uint32_t ack_delay[ASYNCSOCK_ACK_BATCH] = {0};
+
+            // Source might close or even destroy this client
+            if (_stream != NULL) {
+                activity = _pullStream();
+                if (w->current != this || _socket == -1) break;
+            }
+
+            _writeLock();
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+            _drainWriteRing();
+#endif
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+            bool awaiting = _sockAwaitingAck();
+#endif
+            if (_writeQueue.size() > 0) {
+                activity = _flushWriteQueue() || activity;
+            }
+
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+            // Data written before this pass might be acknowledged by now
+            if (awaiting && _checkAcked()) activity = true;
+            uint32_t now = millis();
+#endif
+
+            // Retire all buffers fully written to the socket (or acknowledged
+            // by the remote side, if tracked) on this pass
+            while (_writeQueue.size() > 0 && (!CONFIG_ASYNC_TCP_ACK_PER_BUFFER || nAcks < ASYNCSOCK_ACK_BATCH)) {
+                auto & qwb = _writeQueue.front();
+                if (qwb.write_errno != 0) {
+                    hasErr = true;
+                    sent_errno = qwb.write_errno;
+                    break;
+                }
+                if (qwb.written < qwb.length) break;
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+                if (_tx_acked < qwb.length) break;
+                _tx_acked -= qwb.length;
+                uint32_t acked_at = now;
+#else
+                uint32_t acked_at = qwb.written_at;
+#endif
+
+                if (acked_at > _rx_last_packet) {
+                    _rx_last_packet = acked_at;
+                }
+#if CONFIG_ASYNC_TCP_STATS
+                uint32_t latency = qwb.written_at - qwb.queued_at;
+                if (latency > _stats.write_latency_max) _stats.write_latency_max = latency;
+                _asyncsock_stat_latency(w, latency);
+#endif
+                if (qwb.streamed) _releaseStream(qwb);
+                _freeWriteBuffer(qwb);
+#if CONFIG_ASYNC_TCP_ACK_PER_BUFFER
+                ack_length[nAcks] = qwb.length;
+                ack_delay[nAcks] = acked_at - qwb.queued_at;
+                nAcks++;
+#else
+                // Single aggregated ACK, reporting delay of the oldest buffer
+                if (nAcks == 0) {
+                    ack_length[0] = 0;
+                    ack_delay[0] = acked_at - qwb.queued_at;
+                    nAcks = 1;
+                }
+                ack_length[0] += qwb.length;
+#endif
+                _writeQueue.pop_front();
+                activity = true;
+            }
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+            // Sent data now waiting for acknowledgement is checked for from
+            // the socket timer
+            bool arm = !awaiting && _sockAwaitingAck();
+            _writeUnlock();
+            if (arm) _armAckCheck();
+#else
+            _writeUnlock();
+#endif
+
+            if (hasErr) {
+                _error(sent_errno);
+                break;
+            }
+            for (uint8_t i = 0; i < nAcks; i++) {
+                if (!_notifyAck(ack_length[i], ack_delay[i])) break;
+
+                // Callback might have closed or even destroyed this client
+                if (w->current != this || _socket == -1) break;
+            }
+        }
+        break;
+    }
+
+    return activity;
+}
+
+// Connection is established, secure if requested, and usable
+void AsyncClient::_connected(void)
+{
+    _conn_state = 4;
+    _reconnect_attempts = 0;
+    _rx_last_packet = millis();
+    _ack_timeout_signaled = false;
+    _notifyConnect();
+}
+
+bool AsyncClient::_flushWriteQueue(void)
+{
+    bool activity = false;
+    struct iovec iov[CONFIG_ASYNC_TCP_WRITEV_MAX];
+    int iovcnt = 0;
+
+    if (_socket == -1) return false;
+#if ASYNC_TCP_SSL_ENABLED
+    if (_tls != NULL) return _flushWriteQueueTLS();
+#endif
+
+    // Gather as many pending buffers as possible into a single write
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end() && iovcnt < CONFIG_ASYNC_TCP_WRITEV_MAX; it++) {
+        if (it->write_errno != 0 || it->corked) break;
+        if (it->written >= it->length) continue;
+        iov[iovcnt].iov_base = it->data + it->written;
+        iov[iovcnt].iov_len = it->length - it->written;
+        iovcnt++;
+    }
+    if (iovcnt == 0) return false;
+
+    errno = 0;
+    ssize_t r = (iovcnt == 1)
+        ? lwip_write(_socket, iov[0].iov_base, iov[0].iov_len)
+        : lwip_writev(_socket, iov, iovcnt);
+
+    if (r >= 0) {
+        // Written some data into the socket
+        size_t remaining = r;
+        uint32_t now = millis();
+        ASYNCSOCK_CLIENT_STAT(bytes_out, r);
+        ASYNCSOCK_STAT_ADD(_worker, bytes_out, r);
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+        // Space is given back once the remote side acknowledges the data
+        if (_tx_inflight == 0) _ack_check_at = now;
+        _tx_inflight += r;
+#else
+        _writeSpaceRemaining += r;
+#endif
+        activity = true;
+
+        for (auto it = _writeQueue.begin(); it != _writeQueue.end() && remaining > 0; it++) {
+            if (it->written >= it->length) continue;
+            size_t n = it->length - it->written;
+            if (n > remaining) n = remaining;
+            it->written += n;
+            remaining -= n;
+
+            if (it->written >= it->length) {
+                it->written_at = now;
+            }
+        }
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Socket is full, could not write anything
+        ASYNCSOCK_CLIENT_STAT(tx_eagain, 1);
+        ASYNCSOCK_STAT_ADD(_worker, tx_eagain, 1);
+    } else {
+        for (auto it = _writeQueue.begin(); it != _writeQueue.end(); it++) {
+            if (it->written < it->length) {
+                it->write_errno = errno;
+                break;
+            }
+        }
+    }
+
+    return activity;
+}
+
+void AsyncClient::_sockIsReadable(void)
+{
+    AsyncSocketWorker * w = _worker;
+    uint8_t * readBuffer = w->readBuffer;
+    size_t budget = CONFIG_ASYNC_TCP_RX_BUDGET;
+
+    _rx_last_packet = millis();
+
+#if ASYNC_TCP_SSL_ENABLED
+    // Socket is readable with more of the TLS handshake
+    if (_conn_state == 3 && _tls != NULL) {
+        _tlsHandshake();
+        return;
+    }
+#endif
+
+    // Paused from another task after the socket was found readable
+    if (_rx_paused) return;
+
+    // Keep reading until the socket has no more data, or until this socket
+    // has used up its share for this pass, so other sockets are not starved.
+    do {
+        size_t n = (budget > 0 && budget < CONFIG_ASYNC_TCP_RX_BUFFER_SIZE) ? budget : CONFIG_ASYNC_TCP_RX_BUFFER_SIZE;
+        if (n > CONFIG_ASYNC_TCP_RX_UNACKED_MAX - _rx_unacked) n = CONFIG_ASYNC_TCP_RX_UNACKED_MAX - _rx_unacked;
+
+        // With a packet handler, data is read straight into a pbuf that is
+        // handed over to the application, instead of into the shared buffer.
+        // Deferred data is always handed over to the handler task that way.
+        struct pbuf * pb = NULL;
+        uint8_t * p = readBuffer;
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+        bool to_pbuf = _listener || (_cbs && (_cbs->_recv_cb || _cbs->_pb_cb));
+        if (to_pbuf && !_deferRoom()) return;
+#else
+        bool to_pbuf = !_listener && _cbs && _cbs->_pb_cb;
+#endif
+        if (to_pbuf) {
+            pb = pbuf_alloc(PBUF_RAW, n, PBUF_RAM);
+            if (pb == NULL) {
+                // Try again on next poll
+                log_w("no memory for pbuf of %u bytes", (unsigned)n);
+                _rx_nomem = true;
+                return;
+            }
+            p = (uint8_t *)pb->payload;
+        }
+
+        ssize_t r = _sockRead(p, n);
+        if (r > 0) {
+            ASYNCSOCK_CLIENT_STAT(bytes_in, r);
+            ASYNCSOCK_STAT_ADD(w, bytes_in, r);
+            if (pb) {
+                pbuf_realloc(pb, r);
+                _rx_unacked += r;
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+                // Dropped if the client is being destroyed
+                if (!_defer(ASYNCSOCK_EVENT_DATA, 0, 0, 0, pb)) {
+                    _rx_unacked -= r;
+                    pbuf_free(pb);
+                }
+#else
+                _cbs->_pb_cb(_cbs->_pb_cb_arg, this, pb);
+#endif
+            } else if (_listener || (_cbs && _cbs->_recv_cb)) {
+                _rx_ack_later = false;
+                if (_listener) {
+                    _listener->onData(this, readBuffer, r);
+                } else {
+                    _cbs->_recv_cb(_cbs->_recv_cb_arg, this, readBuffer, r);
+                }
+                if (w->current == this && _rx_ack_later) {
+                    _rx_unacked += r;
+                    _rx_ack_later = false;
+                }
+            }
+
+            // Callback might have closed or even destroyed this client
+            if (w->current != this || _socket == -1) return;
+            if (!_sockWantsRead()) return;
+            if (budget == 0 && !_tlsPending()) return;
+            budget -= (budget > (size_t)r) ? r : budget;
+        } else {
+            if (pb) pbuf_free(pb);
+            if (r == 0) {
+                // A successful read of 0 bytes indicates remote side closed connection
+                _close();
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Do nothing, will try later
+                ASYNCSOCK_CLIENT_STAT(rx_eagain, 1);
+                ASYNCSOCK_STAT_ADD(w, rx_eagain, 1);
+            } else {
+                _error(errno);
+            }
+            return;
+        }
+    } while (budget > 0 || _tlsPending());
+}
+
+// Reads from the socket, through TLS if set up, with the same results as
+// lwip_read(). TLS errors other than waiting for more data are not errno
+// values, and are reported as EIO.
+ssize_t AsyncClient::_sockRead(uint8_t * buf, size_t len)
+{
+#if ASYNC_TCP_SSL_ENABLED
+    if (_tls != NULL) {
+        int r = _tls->read(buf, len);
+        if (r >= 0) return r;
+        if (r == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) return 0;
+        if (r == MBEDTLS_ERR_SSL_WANT_READ || r == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            errno = EAGAIN;
+        } else {
+            log_e("TLS read error: -0x%04x", -r);
+            errno = EIO;
+        }
+        return -1;
+    }
+#endif
+    errno = 0;
+    return lwip_read(_socket, buf, len);
+}
+
+bool AsyncClient::_tlsPending(void)
+{
+#if ASYNC_TCP_SSL_ENABLED
+    return _tls != NULL && _conn_state == 4 && _tls->pending() > 0;
+#else
+    return false;
+#endif
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+
+// Set up TLS over the socket just connected or accepted. Returns 0, or an
+// mbedTLS error, the socket being left to the caller to close.
+int AsyncClient::_startTLS(void)
+{
+    AsyncTCP_TLS_Context * tls = new (std::nothrow) AsyncTCP_TLS_Context();
+    if (tls == NULL) return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+
+    int r = _tls_server
+        ? tls->startServer(_socket, _tls_server)
+        : tls->startClient(_socket, _tls_host, _connect_port, _root_ca, _cli_cert, _cli_key);
+    if (r != 0) {
+        log_e("TLS setup failed: -0x%04x", -r);
+        delete tls;
+        return r;
+    }
+
+    // Connect timeout covers the handshake of accepted clients too
+    AsyncSocketWorker * w = _lockWorker();
+    _tls = tls;
+    _conn_state = 3;
+    if (_tls_server) _connect_started = millis();
+    _unlockWorker(w);
+    return 0;
+}
+
+// Handshake is driven by the socket becoming readable or writable, unless it
+// runs in the handshake task
+void AsyncClient::_tlsHandshake(void)
+{
+#if CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    if (_tls_job != NULL) return;
+    AsyncTLSHandshakeJob * job = new (std::nothrow) AsyncTLSHandshakeJob();
+    if (job != NULL) {
+        job->tls = _tls;
+        job->client = this;
+        AsyncSocketWorker * w = _lockWorker();
+        _tls_job = job;
+        _unlockWorker(w);
+        if (xQueueSend(_asyncsock_tls_queue, &job, 0) == pdTRUE) return;
+
+        // Queue is full, handshake runs right here instead
+        w = _lockWorker();
+        _tls_job = NULL;
+        _unlockWorker(w);
+        delete job;
+    }
+#endif
+
+    int r = _tls->handshake();
+    if (r == MBEDTLS_ERR_SSL_WANT_READ || r == MBEDTLS_ERR_SSL_WANT_WRITE) return;
+    _tlsFinished(r);
+}
+
+void AsyncClient::_tlsFinished(int r)
+{
+    if (r != 0) {
+        log_e("TLS handshake failed: -0x%04x", -r);
+        _error(ERR_CONN);
+        return;
+    }
+
+    // Accepted clients have no onConnect to report to
+    if (_tls_server) {
+        _conn_state = 4;
+        _rx_last_packet = millis();
+        _ack_timeout_signaled = false;
+    } else {
+        _connected();
+    }
+}
+
+// Drop the TLS session of the socket about to be closed. Returns true if the
+// socket now belongs to the handshake task, which closes it once it is done.
+bool AsyncClient::_releaseTLS(bool notify)
+{
+    bool handed_over = false;
+#if CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    if (_tls_job != NULL) {
+        portENTER_CRITICAL(&_asyncsock_dns_mux);
+        handed_over = !_tls_job->done;
+        if (handed_over) _tls_job->client = NULL;
+        _isdnsfinished = false;
+        portEXIT_CRITICAL(&_asyncsock_dns_mux);
+        if (!handed_over) delete _tls_job;
+        _tls_job = NULL;
+        notify = false;
+    }
+#endif
+    if (handed_over) {
+        _tls = NULL;
+    } else if (_tls != NULL) {
+        if (notify && _conn_state == 4) _tls->closeNotify();
+        delete _tls;
+        _tls = NULL;
+    }
+    return handed_over;
+}
+
+// Buffers are written one by one as TLS records. Once accepted by mbedTLS, the
+// data is encrypted and out of the queue, so it counts as acknowledged, since
+// record overhead keeps sent bytes from being matched with plain ones.
+bool AsyncClient::_flushWriteQueueTLS(void)
+{
+    bool activity = false;
+    uint32_t now = millis();
+
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end(); it++) {
+        if (it->write_errno != 0 || it->corked) break;
+        if (it->written >= it->length) continue;
+
+        int r = _tls->write(it->data + it->written, it->length - it->written);
+        if (r == MBEDTLS_ERR_SSL_WANT_WRITE || r == MBEDTLS_ERR_SSL_WANT_READ) {
+            ASYNCSOCK_CLIENT_STAT(tx_eagain, 1);
+            ASYNCSOCK_STAT_ADD(_worker, tx_eagain, 1);
+            break;
+        }
+        if (r < 0) {
+            log_e("TLS write error: -0x%04x", -r);
+            it->write_errno = EIO;
+            break;
+        }
+
+        ASYNCSOCK_CLIENT_STAT(bytes_out, r);
+        ASYNCSOCK_STAT_ADD(_worker, bytes_out, r);
+        it->written += r;
+        _writeSpaceRemaining += r;
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+        _tx_acked += r;
+#endif
+        activity = true;
+        if (it->written < it->length) break;
+        it->written_at = now;
+    }
+    return activity;
+}
+
+#if CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+// Runs handshakes side by side, since the peers of several of them might be
+// clients and servers of this very device, waiting on each other. Jobs are
+// handed back to the client through _asyncsock_dns_mux, as done for host name
+// lookups, unless the client has given up on them meanwhile.
+void _asyncsock_tls_task(void * arg)
+{
+    AsyncTLSHandshakeJob * jobs[ASYNCSOCK_TLS_JOBS];
+    int nJobs = 0;
+
+    while (true) {
+        // Take on new jobs, blocking only while there is nothing else to do
+        AsyncTLSHandshakeJob * job;
+        while (nJobs < ASYNCSOCK_TLS_JOBS
+            && xQueueReceive(_asyncsock_tls_queue, &job, (nJobs == 0) ? portMAX_DELAY : 0) == pdTRUE) {
+            job->result = MBEDTLS_ERR_SSL_WANT_WRITE;
+            job->ready = true;
+            jobs[nJobs++] = job;
+        }
+
+        // Go on with each handshake whose socket is ready, and hand back
+        // those that are over
+        fd_set sockSet_r;
+        fd_set sockSet_w;
+        int max_sock = 0;
+        FD_ZERO(&sockSet_r); FD_ZERO(&sockSet_w);
+        for (int i = 0; i < nJobs; ) {
+            job = jobs[i];
+            int fd = job->tls->socket();
+            if (job->ready) job->result = job->tls->handshake();
+            job->ready = false;
+
+            bool over = (job->result != MBEDTLS_ERR_SSL_WANT_READ && job->result != MBEDTLS_ERR_SSL_WANT_WRITE);
+            AsyncSocketWorker * w = NULL;
+            bool cancelled;
+            portENTER_CRITICAL(&_asyncsock_dns_mux);
+            cancelled = (job->client == NULL);
+            if (over && !cancelled) {
+                job->done = true;
+                job->client->_isdnsfinished = true;
+                w = job->client->_worker;
+            }
+            portEXIT_CRITICAL(&_asyncsock_dns_mux);
+
+            if (!over && !cancelled) {
+                FD_SET(fd, (job->result == MBEDTLS_ERR_SSL_WANT_READ) ? &sockSet_r : &sockSet_w);
+                if (max_sock <= fd) max_sock = fd + 1;
+                i++;
+                continue;
+            }
+
+            if (w != NULL) {
+                _asyncsock_wakeup(w);
+            } else {
+#ifdef ESP_IDF_VERSION_MAJOR
+                lwip_close(fd);
+#else
+                lwip_close_r(fd);
+#endif
+                delete job->tls;
+                delete job;
+            }
+            jobs[i] = jobs[--nJobs];
+        }
+        if (nJobs == 0) continue;
+
+        // Check back soon for new jobs, and for cancelled ones
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = CONFIG_ASYNC_TCP_TIMER_RESOLUTION * 1000;
+        int r = select(max_sock, &sockSet_r, &sockSet_w, NULL, &tv);
+        for (int i = 0; i < nJobs; i++) {
+            int fd = jobs[i]->tls->socket();
+            jobs[i]->ready = (r < 0) || (r > 0 && (FD_ISSET(fd, &sockSet_r) || FD_ISSET(fd, &sockSet_w)));
+        }
+    }
+}
+#endif
+
+#endif /* ASYNC_TCP_SSL_ENABLED */
+
+bool AsyncClient::_sockWantsRead(void)
+{
+#if ASYNC_TCP_SSL_ENABLED && CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    // Handshake task is waiting on the socket itself
+    if (_tls_job != NULL) return false;
+#endif
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // Handler task has yet to take data off the queue
+    if (_deferred_blocked) return false;
+#endif
+    // Stop reading while paused, or while the application holds too much
+    // unacknowledged data
+    return !_rx_paused && !_rx_nomem && _rx_unacked < CONFIG_ASYNC_TCP_RX_UNACKED_MAX;
+}
+
+size_t AsyncClient::ack(size_t len)
+{
+    AsyncSocketWorker * w = _lockWorker();
+    bool resume = !_sockWantsRead();
+    if (len > _rx_unacked) len = _rx_unacked;
+    _rx_unacked -= len;
+    resume = resume && _sockWantsRead();
+    bool drain = resume && _tlsPending();
+    _unlockWorker(w);
+
+    // Socket is of interest for reading again. Decrypted data left over is
+    // delivered from the timer, since the socket might not become readable.
+    if (drain) _rearmTimer();
+    if (resume) _asyncsock_wakeup(w);
+    return len;
+}
+
+void AsyncClient::ackPacket(struct pbuf * pb)
+{
+    if (pb == NULL) return;
+    ack(pb->tot_len);
+    pbuf_free(pb);
+}
+
+void AsyncClient::pauseRecv()
+{
+    AsyncSocketWorker * w = _lockWorker();
+    _rx_paused = true;
+    _unlockWorker(w);
+}
+
+void AsyncClient::resumeRecv()
+{
+    AsyncSocketWorker * w = _lockWorker();
+    bool resume = !_sockWantsRead();
+    if (_rx_paused) _rx_last_packet = millis();
+    _rx_paused = false;
+    resume = resume && _sockWantsRead();
+    bool drain = resume && _tlsPending();
+    _unlockWorker(w);
+
+    // Same as for ack()
+    if (drain) _rearmTimer();
+    if (resume) _asyncsock_wakeup(w);
+}
+
+bool AsyncClient::_sockNextDeadline(uint32_t & deadline)
+{
+    if (_socket == -1) {
+        // Only a retry of a failed connection might be due
+        if (!_reconnect_pending) return false;
+        deadline = _reconnect_at;
+        return true;
+    }
+
+    // Activity poll
+    deadline = _sock_lastactivity + _poll_interval;
+
+    // Connect timeout
+    if ((_conn_state == 2 || _conn_state == 3) && _connect_timeout) {
+        uint32_t d = _connect_started + _connect_timeout;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    // Happy Eyeballs: start, then keep checking, the attempt to the other address
+    if (_conn_state == 2 && !ip_addr_isany(&_connect_alt)) {
+        uint32_t d = (_alt_socket == -1) ? _connect_started + CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY
+            : millis() + CONFIG_ASYNC_TCP_TIMER_RESOLUTION;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    // RX Timeout
+    if (_rx_since_timeout && !_rx_paused) {
+        uint32_t d = _rx_last_packet + _rx_since_timeout * 1000;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    // Decrypted data left over
+    if (_tlsPending() && _sockWantsRead()) {
+        uint32_t d = millis();
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    _writeLock();
+    // Data held back by ASYNC_WRITE_FLAG_MORE
+    if (_cork_len > 0) {
+        uint32_t d = _cork_since + CONFIG_ASYNC_TCP_CORK_DELAY;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    // ACK Timeout
+    if (_ack_timeout && _writeQueue.size() > 0 && !_ack_timeout_signaled) {
+        uint32_t d = _writeQueue.front().queued_at + _ack_timeout;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+
+    // Sent data acknowledged since the last check
+    if (_sockAwaitingAck()) {
+        uint32_t d = _ack_check_at + CONFIG_ASYNC_TCP_ACK_CHECK_INTERVAL;
+        if ((int32_t)(d - deadline) < 0) deadline = d;
+    }
+    _writeUnlock();
+    return true;
+}
+
+void AsyncClient::_sockPoll(void)
+{
+    if (_socket == -1) {
+        if (_reconnect_pending && (int32_t)(millis() - _reconnect_at) >= 0) _reconnect();
+        return;
+    }
+
+    uint32_t now = millis();
+
+    // Connect timeout
+    if ((_conn_state == 2 || _conn_state == 3) && _connect_timeout && now - _connect_started >= _connect_timeout) {
+        _error(ERR_TIMEOUT);
+        return;
+    }
 
-    uint32_t ip_addr = ip;
-    struct sockaddr_in serveraddr;
-    memset(&serveraddr, 0, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    memcpy(&(serveraddr.sin_addr.s_addr), &ip_addr, 4);
-    serveraddr.sin_port = htons(port);
+    // Connection attempts racing to both address families
+    if (_conn_state == 2 && !ip_addr_isany(&_connect_alt) && _raceConnect(now)) return;
+
+    // Retry reading after failing to allocate a pbuf, and asking the stream
+    // source for data
+    _rx_nomem = false;
+    _stream_wait = false;
+
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Acknowledgements do not make the socket writable again, so they are
+    // checked for from here, unless the socket was found writable meanwhile
+    if (_sockAwaitingAck() && now - _ack_check_at >= CONFIG_ASYNC_TCP_ACK_CHECK_INTERVAL) {
+        AsyncSocketWorker * w = _worker;
+        w->current = this;
+        _sockIsWriteable();
+        if (w->current != this) return;
+        w->current = NULL;
+        if (_socket == -1) return;
+    }
+#endif
+
+    // Deliver decrypted data held back while the application was not reading
+    if (_tlsPending() && _sockWantsRead()) {
+        AsyncSocketWorker * w = _worker;
+        w->current = this;
+        _sockIsReadable();
+        if (w->current == this) w->current = NULL;
+        return;
+    }
+
+    // Data held back for long enough by ASYNC_WRITE_FLAG_MORE goes out
+    // on the next pass
+    _writeLock();
+    if (_cork_len > 0 && now - _cork_since >= CONFIG_ASYNC_TCP_CORK_DELAY) _uncork();
+
+    // ACK Timeout - simulated by write queue staleness
+    if (_writeQueue.size() > 0 && !_ack_timeout_signaled && _ack_timeout) {
+        uint32_t sent_delay = now - _writeQueue.front().queued_at;
+        if (sent_delay >= _ack_timeout) {
+            _ack_timeout_signaled = true;
+            //log_w("ack timeout %d", pcb->state);
+            _writeUnlock();
+            _notifyTimeout(sent_delay);
+            return;
+        }
+    }
+    _writeUnlock();
+
+    // RX Timeout
+    if (_rx_since_timeout && !_rx_paused && (now - _rx_last_packet) >= (_rx_since_timeout * 1000)) {
+        //log_w("rx timeout %d", pcb->state);
+        _close();
+        return;
+    }
+
+    // Only a timeout might have been due
+    uint32_t late = now - _sock_lastactivity - _poll_interval;
+    if ((int32_t)late < 0) return;
+
+    // Keep to the poll interval, unless the socket was far behind schedule
+    _sock_lastactivity = (late < _poll_interval) ? now - late : now;
+
+    // Everything is fine
+    _notifyPoll();
+}
+
+void AsyncClient::_removeAllCallbacks(void)
+{
+    _listener = NULL;
+    if (_cbs == NULL) return;
+    _cbs->_connect_cb = NULL;
+    _cbs->_connect_cb_arg = NULL;
+    _cbs->_discard_cb = NULL;
+    _cbs->_discard_cb_arg = NULL;
+    _cbs->_sent_cb = NULL;
+    _cbs->_sent_cb_arg = NULL;
+    _cbs->_error_cb = NULL;
+    _cbs->_error_cb_arg = NULL;
+    _cbs->_recv_cb = NULL;
+    _cbs->_recv_cb_arg = NULL;
+    _cbs->_timeout_cb = NULL;
+    _cbs->_timeout_cb_arg = NULL;
+    _cbs->_poll_cb = NULL;
+    _cbs->_poll_cb_arg = NULL;
+    _cbs->_pb_cb = NULL;
+    _cbs->_pb_cb_arg = NULL;
+}
+
+void AsyncClient::_notifyConnect(void)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_CONNECT)) return;
+#endif
+    if (_listener) {
+        _listener->onConnect(this);
+    } else if (_cbs && _cbs->_connect_cb) {
+        _cbs->_connect_cb(_cbs->_connect_cb_arg, this);
+    }
+}
+
+// Returns false if there is no handler for it
+bool AsyncClient::_notifyAck(size_t len, uint32_t time)
+{
+    if (!_listener && !(_cbs && _cbs->_sent_cb)) return false;
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_ACK, 0, len, time)) return true;
+#endif
+    if (_listener) {
+        _listener->onAck(this, len, time);
+    } else {
+        _cbs->_sent_cb(_cbs->_sent_cb_arg, this, len, time);
+    }
+    return true;
+}
+
+void AsyncClient::_notifyError(int8_t err)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_ERROR, err)) return;
+#endif
+    if (_listener) {
+        _listener->onError(this, err);
+    } else if (_cbs && _cbs->_error_cb) {
+        _cbs->_error_cb(_cbs->_error_cb_arg, this, err);
+    }
+}
+
+void AsyncClient::_notifyTimeout(uint32_t time)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_TIMEOUT, 0, 0, time)) return;
+#endif
+    if (_listener) {
+        _listener->onTimeout(this, time);
+    } else if (_cbs && _cbs->_timeout_cb) {
+        _cbs->_timeout_cb(_cbs->_timeout_cb_arg, this, time);
+    }
+}
+
+void AsyncClient::_notifyPoll(void)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_POLL)) return;
+#endif
+    if (_listener) {
+        _listener->onPoll(this);
+    } else if (_cbs && _cbs->_poll_cb) {
+        _cbs->_poll_cb(_cbs->_poll_cb_arg, this);
+    }
+}
+
+// Invoke onDisconnect handler. Callbacks are removed before invoking it,
+// since the handler is allowed to delete this object.
+void AsyncClient::_notifyDisconnect(void)
+{
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    if (_defer(ASYNCSOCK_EVENT_DISCONNECT)) return;
+#endif
+    AsyncClientListener * listener = _listener;
+    AcConnectHandler discard_cb;
+    void * discard_cb_arg = NULL;
+    if (_cbs) {
+        discard_cb = std::move(_cbs->_discard_cb);
+        discard_cb_arg = _cbs->_discard_cb_arg;
+    }
+    _removeAllCallbacks();
+    if (listener) {
+        listener->onDisconnect(this);
+    } else if (discard_cb) {
+        discard_cb(discard_cb_arg, this);
+    }
+}
+
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+inline AsyncEventHandler * AsyncClient::_handler(void)
+{
+    return &(_asyncsock_handlers()[_deferred_handler]);
+}
+
+// Queue an event for the handler task of this client. Returns false if it is
+// to be delivered right away instead: on the handler task itself, while
+// delivering the events of this client, or once deferral is turned off.
+bool AsyncClient::_defer(uint8_t type, int8_t error, uint32_t len, uint32_t time, struct pbuf * pb)
+{
+    AsyncEventHandler * h = _handler();
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    deferred_event * ev = NULL;
+    bool wake = false;
+
+    if (h->task == NULL) return false;
+    portENTER_CRITICAL(&h->mux);
+    if (_deferred_off || (h->current == this && self == h->task)) {
+        portEXIT_CRITICAL(&h->mux);
+        return false;
+    }
+
+    // Acknowledgements are added up, reporting the delay of the oldest, and
+    // polls and timeouts are only reported once
+    if (type == ASYNCSOCK_EVENT_ACK || type == ASYNCSOCK_EVENT_POLL || type == ASYNCSOCK_EVENT_TIMEOUT) {
+        for (uint8_t i = 0; i < _deferred_count; i++) {
+            deferred_event & e = _deferred[(_deferred_head + i) % CONFIG_ASYNC_TCP_DEFERRED_EVENTS];
+            if (e.type != type) continue;
+            e.len += len;
+            ev = &e;
+            break;
+        }
+    }
+    if (ev == NULL && _deferred_count < CONFIG_ASYNC_TCP_DEFERRED_EVENTS) {
+        ev = &(_deferred[(_deferred_head + _deferred_count) % CONFIG_ASYNC_TCP_DEFERRED_EVENTS]);
+        ev->type = type;
+        ev->error = error;
+        ev->len = len;
+        ev->time = time;
+        ev->pb = pb;
+        _deferred_count++;
+        if (type == ASYNCSOCK_EVENT_DATA) _deferred_data++;
+    }
+    if (ev != NULL && !_deferred_queued) {
+        h->queue[(h->head + h->count) % ASYNCSOCK_HANDLER_QUEUE_SIZE] = this;
+        h->count++;
+        _deferred_queued = true;
+        wake = true;
+    }
+    portEXIT_CRITICAL(&h->mux);
+
+    if (ev == NULL) {
+        // Only a handler task stuck for long could let this happen
+        log_e("event queue full, event %u dropped", type);
+        if (pb != NULL) ackPacket(pb);
+    }
+    if (wake) xSemaphoreGive(h->ready);
+    return true;
+}
+
+// Whether more received data may be queued. If not, reading is held back
+// until the handler task takes data off the queue.
+bool AsyncClient::_deferRoom(void)
+{
+    AsyncEventHandler * h = _handler();
+    portENTER_CRITICAL(&h->mux);
+    bool room = _deferred_data < ASYNCSOCK_DEFERRED_DATA_MAX;
+    if (!room) _deferred_blocked = true;
+    portEXIT_CRITICAL(&h->mux);
+    return room;
+}
+
+// Deliver the waiting events, until none is left, or the client is destroyed
+void AsyncClient::_runDeferred(AsyncEventHandler * h)
+{
+    while (true) {
+        portENTER_CRITICAL(&h->mux);
+        if (h->current != this || _deferred_count == 0) {
+            portEXIT_CRITICAL(&h->mux);
+            return;
+        }
+        deferred_event ev = _deferred[_deferred_head];
+        _deferred_head = (_deferred_head + 1) % CONFIG_ASYNC_TCP_DEFERRED_EVENTS;
+        _deferred_count--;
+        bool resume = false;
+        if (ev.type == ASYNCSOCK_EVENT_DATA) {
+            _deferred_data--;
+            resume = _deferred_blocked;
+            _deferred_blocked = false;
+        }
+        portEXIT_CRITICAL(&h->mux);
+
+        // Same as for ack()
+        if (resume) {
+            AsyncSocketWorker * w = _lockWorker();
+            bool drain = _tlsPending();
+            _unlockWorker(w);
+            if (drain) _rearmTimer();
+            _asyncsock_wakeup(w);
+        }
+        _deliver(ev);
+    }
+}
+
+void AsyncClient::_deliver(const deferred_event & ev)
+{
+    switch (ev.type) {
+    case ASYNCSOCK_EVENT_CONNECT:
+        _notifyConnect();
+        break;
+    case ASYNCSOCK_EVENT_DATA:
+        _deliverData(ev.pb);
+        break;
+    case ASYNCSOCK_EVENT_ACK:
+        _notifyAck(ev.len, ev.time);
+        break;
+    case ASYNCSOCK_EVENT_TIMEOUT:
+        _notifyTimeout(ev.time);
+        break;
+    case ASYNCSOCK_EVENT_POLL:
+        _notifyPoll();
+        break;
+    case ASYNCSOCK_EVENT_ERROR:
+        _notifyError(ev.error);
+        break;
+    case ASYNCSOCK_EVENT_DISCONNECT:
+        // Error handler might have connected again already
+        if (_socket == -1 && !_reconnect_pending) _notifyDisconnect();
+        break;
+    }
+}
+
+// Received data is counted as unacknowledged once queued. Unless a packet
+// handler takes over the pbuf, it is acknowledged once the data handler
+// returns, as when not deferred.
+void AsyncClient::_deliverData(struct pbuf * pb)
+{
+    if (!_listener && _cbs && _cbs->_pb_cb) {
+        _cbs->_pb_cb(_cbs->_pb_cb_arg, this, pb);
+        return;
+    }
+
+    AsyncEventHandler * h = _handler();
+    size_t len = pb->tot_len;
+    _rx_ack_later = false;
+    if (_listener) {
+        _listener->onData(this, pb->payload, len);
+    } else if (_cbs && _cbs->_recv_cb) {
+        _cbs->_recv_cb(_cbs->_recv_cb_arg, this, pb->payload, len);
+    }
+    pbuf_free(pb);
+
+    // Handler might have destroyed this client
+    if (h->current != this) return;
+    if (!_rx_ack_later) ack(len);
+    _rx_ack_later = false;
+}
+
+// Drop the waiting events of a client being destroyed, once its handler task
+// is not delivering any to it, unless it is being destroyed from there. A
+// disconnection still waiting is reported right away, as it would have been
+// when not deferred. Returns true if the client is left dying, since this
+// task holds a worker mutex, which the handler might be waiting for.
+bool AsyncClient::_cancelDeferred(void)
+{
+    AsyncEventHandler * h = _handler();
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    AsyncSocketWorker * workers = _asyncsock_workers();
+
+    portENTER_CRITICAL(&h->mux);
+    bool wait = (h->current == this && self != h->task);
+    portEXIT_CRITICAL(&h->mux);
+    for (int i = 0; i < CONFIG_ASYNC_TCP_WORKER_COUNT && wait; i++) {
+        if (xSemaphoreGetMutexHolder(workers[i].mutex) == self) wait = false;
+    }
+    if (wait) xSemaphoreTakeRecursive(h->mutex, portMAX_DELAY);
+
+    portENTER_CRITICAL(&h->mux);
+    _deferred_off = true;
+    bool dying = (h->current == this && self != h->task);
+    if (h->current == this) h->current = NULL;
+    if (dying) {
+        h->dying = this;
+        h->dying_busy = true;
+        h->dying_destroyed = false;
+        h->dying_deleted = false;
+    }
+    if (_deferred_queued) {
+        uint16_t n = 0;
+        for (uint16_t i = 0; i < h->count; i++) {
+            AsyncClient * c = h->queue[(h->head + i) % ASYNCSOCK_HANDLER_QUEUE_SIZE];
+            if (c != this) h->queue[(h->head + n++) % ASYNCSOCK_HANDLER_QUEUE_SIZE] = c;
+        }
+        h->count = n;
+        _deferred_queued = false;
+    }
+    portEXIT_CRITICAL(&h->mux);
+    if (wait) xSemaphoreGiveRecursive(h->mutex);
+
+    // Nothing else touches the events anymore
+    bool disconnected = false;
+    for (uint8_t i = 0; i < _deferred_count; i++) {
+        deferred_event & e = _deferred[(_deferred_head + i) % CONFIG_ASYNC_TCP_DEFERRED_EVENTS];
+        if (e.pb != NULL) pbuf_free(e.pb);
+        if (e.type == ASYNCSOCK_EVENT_DISCONNECT) disconnected = true;
+    }
+    _deferred_count = 0;
+    _deferred_data = 0;
+    if (disconnected) _deliver({ ASYNCSOCK_EVENT_DISCONNECT, 0, 0, 0, NULL });
+    return dying;
+}
+
+// End of the destructor of a dying client. Returns true if its handler task
+// is still delivering to it, and releases its callbacks and write mutex once
+// done.
+bool AsyncClient::_handOverDying(void)
+{
+    AsyncEventHandler * h = _handler();
+    portENTER_CRITICAL(&h->mux);
+    bool busy = (h->dying == this && h->dying_busy);
+    if (busy) {
+        h->dying_cbs = _cbs;
+#if ASYNCSOCK_WRITE_MUTEX
+        h->dying_mutex = _write_mutex;
+#endif
+        h->dying_destroyed = true;
+    } else if (h->dying == this) {
+        h->dying = NULL;
+    }
+    portEXIT_CRITICAL(&h->mux);
+    if (busy) _cbs = NULL;
+    return busy;
+}
+
+// Client left dying is destroyed already, and its handler task is done with
+// it: release what its destructor handed over, and its memory, unless
+// operator delete still has to.
+static void _asyncsock_dying_release(AsyncEventHandler * h)
+{
+    // Still counted busy meanwhile, so that operator delete hands over too
+    delete h->dying_cbs;
+    h->dying_cbs = NULL;
+#if ASYNCSOCK_WRITE_MUTEX
+    vSemaphoreDelete(h->dying_mutex);
+    h->dying_mutex = NULL;
+#endif
+    portENTER_CRITICAL(&h->mux);
+    AsyncClient * c = h->dying;
+    bool release = h->dying_deleted;
+    h->dying_busy = false;
+    if (release) h->dying = NULL;
+    portEXIT_CRITICAL(&h->mux);
+    if (release) _asyncsock_client_free(c);
+}
+
+void _asyncsock_handler_task(void * arg)
+{
+    AsyncEventHandler * h = (AsyncEventHandler *)arg;
+
+    while (true) {
+        xSemaphoreTake(h->ready, portMAX_DELAY);
+
+        // Queue might hold fewer clients than counted, if some were destroyed
+        xSemaphoreTakeRecursive(h->mutex, portMAX_DELAY);
+        portENTER_CRITICAL(&h->mux);
+        AsyncClient * c = NULL;
+        if (h->count > 0) {
+            c = h->queue[h->head];
+            h->head = (h->head + 1) % ASYNCSOCK_HANDLER_QUEUE_SIZE;
+            h->count--;
+            c->_deferred_queued = false;
+            h->current = c;
+        }
+        portEXIT_CRITICAL(&h->mux);
+
+        if (c != NULL) {
+            c->_runDeferred(h);
+            portENTER_CRITICAL(&h->mux);
+            h->current = NULL;
+            bool destroyed = (h->dying == c && h->dying_destroyed);
+            // Otherwise its destructor releases everything, if left dying
+            if (h->dying == c && !destroyed) h->dying_busy = false;
+            portEXIT_CRITICAL(&h->mux);
+            if (destroyed) _asyncsock_dying_release(h);
+        }
+        xSemaphoreGiveRecursive(h->mutex);
+    }
+}
+#endif
 
-#ifdef EINPROGRESS
-    #if EINPROGRESS != 119
-    #error EINPROGRESS invalid
-    #endif
+void AsyncClient::_close(void)
+{
+    //Serial.print("AsyncClient::_close: "); Serial.println(_socket);
+    AsyncSocketWorker * w = _lockWorker();
+    _closeAltSocket();
+#if ASYNC_TCP_SSL_ENABLED
+    if (!_releaseTLS(true))
+#endif
+#ifdef ESP_IDF_VERSION_MAJOR
+    lwip_close(_socket);
+#else
+    lwip_close_r(_socket);
 #endif
+    _conn_state = 0;
+    _socket = -1;
+    _selected = false;
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
 
-    //Serial.printf("DEBUG: connect to %08x port %d using IP... ", ip_addr, port);
-    errno = 0;
+    _clearWriteQueue();
+    _endStream(false);
+    _rx_unacked = 0;
+    _rx_paused = false;
+    _releaseServerSlot();
+    _notifyDisconnect();
+}
+
+void AsyncClient::_error(int8_t err)
+{
+    AsyncSocketWorker * w = _lockWorker();
+    bool connecting = (_conn_state == 2 || _conn_state == 3);
+    _conn_state = 0;
+    _closeAltSocket();
+#if ASYNC_TCP_SSL_ENABLED
+    if (!_releaseTLS(false))
+#endif
 #ifdef ESP_IDF_VERSION_MAJOR
-    r = lwip_connect(sockfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr));
+    lwip_close(_socket);
 #else
-    r = lwip_connect_r(sockfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr));
+    lwip_close_r(_socket);
 #endif
-    //Serial.printf("r=%d errno=%d\r\n", r, errno);
-    if (r < 0 && errno != EINPROGRESS) {
-        //Serial.println("\t(connect failed)");
-        log_e("connect on fd %d, errno: %d, \"%s\"", sockfd, errno, strerror(errno));
-        close(sockfd);
-        return false;
-    }
+    _socket = -1;
+    _selected = false;
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
 
-    // Updating state visible to asyncTcpSock task
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    _conn_state = 2;
-    _socket = sockfd;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
+    _clearWriteQueue();
+    _endStream(false);
+    _rx_unacked = 0;
+    _rx_paused = false;
+    _releaseServerSlot();
 
-    // Socket is now connecting. Should become writable in asyncTcpSock task
-    //Serial.printf("\twaiting for connect finished on socket: %d\r\n", _socket);
-    return true;
+    if (connecting) {
+        _connectFailed(err);
+        return;
+    }
+    _notifyError(err);
+    _notifyDisconnect();
 }
 
-void _tcpsock_dns_found(const char * name, struct ip_addr * ipaddr, void * arg);
-bool AsyncClient::connect(const char* host, uint16_t port){
-    ip_addr_t addr;
-    
-    if(!_start_asyncsock_task()){
-      log_e("failed to start task");
-      return false;
+// Connection accepted by a server no longer counts against its client limit
+void AsyncClient::_releaseServerSlot(void)
+{
+    if (_server_clients) {
+        (*_server_clients)--;
+        _server_clients.reset();
     }
+}
 
-    //Serial.printf("DEBUG: connect to %s port %d using DNS...\r\n", host, port);
-    err_t err = dns_gethostbyname(host, &addr, (dns_found_callback)&_tcpsock_dns_found, this);
-    if(err == ERR_OK) {
-        //Serial.printf("\taddr resolved as %08x, connecting...\r\n", addr.u_addr.ip4.addr);
-        return connect(IPAddress(addr.u_addr.ip4.addr), port);
-    } else if(err == ERR_INPROGRESS) {
-        //Serial.println("\twaiting for DNS resolution");
-        _connect_port = port;
+bool AsyncClient::_sockWantsWrite(void)
+{
+    // Connecting socket becomes writable when connection finishes
+    if (_conn_state == 2) return true;
+    if (_conn_state == 3) {
+#if ASYNC_TCP_SSL_ENABLED
+        if (_tls != NULL) {
+#if CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+            if (_tls_job != NULL) return false;
+#endif
+            return _tls->wantsWrite();
+        }
+#endif
         return true;
     }
-    log_e("error: %d", err);
+
+    bool pending;
+    _writeLock();
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+    _drainWriteRing();
+#endif
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Buffers already written are only waiting for acknowledgement
+    pending = (_writeQueue.size() > 0 && _writeQueue.back().written < _writeQueue.back().length);
+#else
+    pending = (_writeQueue.size() > 0);
+#endif
+    // Data held back by ASYNC_WRITE_FLAG_MORE does not count
+    if (pending && _cork_len > 0) pending = _writePending();
+    // Stream source has more data, and there is room for it
+    uint32_t off;
+    if (_stream != NULL && !_stream_wait && _streamSpace(off) > 0) pending = true;
+    _writeUnlock();
+    return pending;
+}
+
+bool AsyncClient::_sockAwaitingAck(void)
+{
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    return _conn_state == 4 && _tx_inflight > 0;
+#else
     return false;
+#endif
 }
 
-// This function runs in the LWIP thread
-void _tcpsock_dns_found(const char * name, struct ip_addr * ipaddr, void * arg)
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+// Find out how much of the written data the remote side has acknowledged
+// since the last check, and give back its space. Called with the worker
+// mutex and the write lock held.
+bool AsyncClient::_checkAcked(void)
 {
-    AsyncClient * c = (AsyncClient *)arg;
-    if (ipaddr) {
-        memcpy(&(c->_connect_addr), ipaddr, sizeof(struct ip_addr));
-    } else {
-        memset(&(c->_connect_addr), 0, sizeof(struct ip_addr));
+    _ack_check_at = millis();
+    int queued = _asyncsock_sndqueue(_socket);
+    if (queued < 0) {
+        // Bytes stay in flight, until a later check finds them acknowledged
+        // or the connection is closed
+        if (!_ack_check_failed) log_w("cannot read send queue of socket %d", _socket);
+        _ack_check_failed = true;
+        return false;
     }
+    uint32_t acked = (_tx_inflight > (uint32_t)queued) ? _tx_inflight - queued : 0;
+    if (acked == 0) return false;
+    _tx_inflight -= acked;
+    _tx_acked += acked;
+    _writeSpaceRemaining += acked;
+    return true;
+}
 
-    // Updating state visible to asyncTcpSock task
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    c->_isdnsfinished = true;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
+// Writer is short of space: check for acknowledgements now rather than
+// waiting for the socket timer. Called without the write lock held.
+bool AsyncClient::_refreshAcked(void)
+{
+    if (!_sockAwaitingAck()) return false;
+    AsyncSocketWorker * w = _lockWorker();
+    _writeLock();
+    bool acked = _sockAwaitingAck() && _checkAcked();
+    _writeUnlock();
+    _unlockWorker(w);
+    return acked;
+}
 
-    // TODO: actually use name
+// Sent data is now waiting for acknowledgement, which the socket timer checks
+// for. Called without the write lock held.
+void AsyncClient::_armAckCheck(void)
+{
+    AsyncSocketWorker * w = _worker;
+    if (_asyncsock_current_worker() != w) {
+        _rearmTimer();
+        return;
+    }
+    uint32_t deadline;
+    if (_sockNextDeadline(deadline) && (_timer_slot < 0 || (int32_t)(deadline - _timer_expires) < 0)) {
+        w->timerArm(this, deadline);
+    }
 }
+#endif
 
-// DNS resolving has finished. Check for error or connect
-void AsyncClient::_sockDelayedConnect(void)
+size_t AsyncClient::space()
 {
-    if (_connect_addr.u_addr.ip4.addr) {
-        connect(IPAddress(_connect_addr.u_addr.ip4.addr), _connect_port);
-    } else {
-        if(_error_cb) {
-            _error_cb(_error_cb_arg, this, -55);
+    if (!connected()) return 0;
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0 && CONFIG_ASYNC_TCP_WRITE_RING_SIZE <= 0
+    if (_writeQueue.full()) return 0;
+#endif
+    return _writeSpaceRemaining;
+}
+
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags)
+{
+    queued_writebuf n_entry;
+    size_t will_send;
+
+    if (!connected() || data == NULL || size <= 0) return 0;
+
+    // Reserve space, without any lock. Concurrent writers each get their own.
+    uint32_t room = _writeSpaceRemaining.load();
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Written data might have been acknowledged since the last check
+    if (room < size && _refreshAcked()) room = _writeSpaceRemaining.load();
+#endif
+    do {
+        if (room == 0) return 0;
+        will_send = (room < size) ? room : size;
+    } while (!_writeSpaceRemaining.compare_exchange_weak(room, room - will_send));
+
+    if (apiflags & ASYNC_WRITE_FLAG_COPY) {
+        n_entry.data = NULL;
+        n_entry.pooled = false;
+        n_entry.streamed = false;
+        if (will_send <= CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE) {
+            n_entry.data = _asyncsock_wpool_alloc();
+            n_entry.pooled = (n_entry.data != NULL);
         }
-        if(_discard_cb) {
-            _discard_cb(_discard_cb_arg, this);
+        if (n_entry.data == NULL) {
+            n_entry.data = (uint8_t *)malloc(will_send);
+            if (n_entry.data == NULL) {
+                _writeSpaceRemaining += will_send;
+                return 0;
+            }
+            _asyncsock_wpool_count(&AsyncWritePoolStats::heap_allocs);
         }
+        memcpy(n_entry.data, data, will_send);
+        n_entry.owned = true;
+    } else {
+        n_entry.data = (uint8_t *)data;
+        n_entry.owned = false;
+        n_entry.pooled = false;
+        n_entry.streamed = false;
+    }
+    n_entry.capacity = n_entry.pooled ? CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE : will_send;
+    n_entry.length = will_send;
+    n_entry.written = 0;
+    n_entry.queued_at = millis();
+    n_entry.written_at = 0;
+    n_entry.write_errno = 0;
+    n_entry.corked = (apiflags & ASYNC_WRITE_FLAG_MORE) != 0;
+
+    if (!_writeRing.push(n_entry)) {
+        _freeWriteBuffer(n_entry);
+        _writeSpaceRemaining += will_send;
+        return 0;
     }
+
+    // Wakeups are coalesced until the task runs, so this is cheap in bursts
+    _asyncsock_wakeup(_worker);
+    return will_send;
 }
 
-bool AsyncClient::_sockIsWriteable(void)
+// Called by the asyncTcpSock task, with the worker lock held, to take over the
+// buffers handed over by add()
+void AsyncClient::_drainWriteRing(void)
 {
-    int res;
-    int sockerr;
-    socklen_t len;
-    bool activity = false;
-    bool hasErr = false;
+    queued_writebuf qwb;
+    bool added = false;
+    bool rearm = false;
 
-    int sent_errno = 0;
-    size_t sent_cb_length = 0;
-    uint32_t sent_cb_delay = 0;
+    for (;;) {
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0
+        if (_writeQueue.full()) break;
+#endif
+        if (!_writeRing.pop(qwb)) break;
+        _writeQueue.push_back(qwb);
+#if CONFIG_ASYNC_TCP_STATS
+        _statQueued();
+#endif
+        rearm = _cork(qwb.length, qwb.corked) || rearm;
+        added = true;
+    }
+    if (!added) return;
 
-    // Socket is now writeable. What should we do?
-    switch (_conn_state) {
-    case 2:
-    case 3:
-        // Socket has finished connecting. What happened?
-        len = (socklen_t)sizeof(int);
-        res = getsockopt(_socket, SOL_SOCKET, SO_ERROR, &sockerr, &len);
-        if (res < 0) {
-            _error(errno);
-        } else if (sockerr != 0) {
-            _error(sockerr);
-        } else {
-            // Socket is now fully connected
-            _conn_state = 4;
-            activity = true;
-            _rx_last_packet = millis();
-            _ack_timeout_signaled = false;
+    _ack_timeout_signaled = false;
+    if (rearm || (_ack_timeout && _ack_timeout < _poll_interval)) _rearmTimer();
+}
+#else
+size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags)
+{
+    queued_writebuf n_entry;
+    bool coalesced = false;
+
+    if (!connected() || data == NULL || size <= 0) return 0;
+
+    size_t room = space();
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Written data might have been acknowledged since the last check
+    bool refreshed = (room < size && _refreshAcked());
+    if (refreshed) room = space();
+#endif
+    if (!room) return 0;
 
-            if(_connect_cb) {
-                _connect_cb(_connect_cb_arg, this);
+    size_t will_send = (room < size) ? room : size;
+
+    bool more = (apiflags & ASYNC_WRITE_FLAG_MORE) != 0;
+    _writeLock();
+    // Closed, or left dying, while waiting for the lock
+    if (!connected()) {
+        _writeUnlock();
+        return 0;
+    }
+    bool wasEmpty = (_writeQueue.size() == 0);
+    bool wasIdle = wasEmpty;
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Buffers already written are only waiting for acknowledgement
+    if (!wasEmpty) wasIdle = (_writeQueue.back().written >= _writeQueue.back().length);
+#endif
+    if (apiflags & ASYNC_WRITE_FLAG_COPY) {
+        // Small copies are appended to the last queued buffer, if it is one
+        // of ours and still has room for them. It must not have been written
+        // from yet, so that its queued_at still holds for the added bytes,
+        // and must be held back by ASYNC_WRITE_FLAG_MORE just as they are.
+        if (!wasEmpty) {
+            auto & tail = _writeQueue.back();
+            if (tail.owned && tail.written == 0 && tail.write_errno == 0 && tail.corked == more
+                && (size_t)(tail.capacity - tail.length) >= will_send) {
+                memcpy(tail.data + tail.length, data, will_send);
+                tail.length += will_send;
+                coalesced = true;
+                _asyncsock_wpool_count(&AsyncWritePoolStats::coalesced);
             }
         }
-        break;
-    case 4:
-    default:
-        // Socket can accept some new data...
-        xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY);
-        if (_writeQueue.size() > 0) {
-            activity = _flushWriteQueue();
-            if (_writeQueue.front().write_errno != 0) {
-                hasErr = true;
-                sent_errno = _writeQueue.front().write_errno;
-            }
 
-            if (!hasErr && _writeQueue.front().written >= _writeQueue.front().length) {
-                // Buffer has been fully written to the socket
-                if (_writeQueue.front().written_at > _rx_last_packet) {
-                    _rx_last_packet = _writeQueue.front().written_at;
+        if (!coalesced) {
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0
+            if (_writeQueue.full()) {
+                _writeUnlock();
+                return 0;
+            }
+#endif
+            n_entry.data = NULL;
+            n_entry.pooled = false;
+            n_entry.streamed = false;
+            if (will_send <= CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE) {
+                n_entry.data = _asyncsock_wpool_alloc();
+                n_entry.pooled = (n_entry.data != NULL);
+                n_entry.capacity = CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE;
+            }
+            if (n_entry.data == NULL) {
+                n_entry.data = (uint8_t *)malloc(will_send);
+                n_entry.capacity = will_send;
+                if (n_entry.data == NULL) {
+                    _writeUnlock();
+                    return 0;
                 }
-                if (_writeQueue.front().owned) ::free(_writeQueue.front().data);
-                sent_cb_length = _writeQueue.front().length;
-                sent_cb_delay = _writeQueue.front().written_at - _writeQueue.front().queued_at;
-                _writeQueue.pop_front();
+                _asyncsock_wpool_count(&AsyncWritePoolStats::heap_allocs);
             }
+            memcpy(n_entry.data, data, will_send);
+            n_entry.owned = true;
         }
-        xSemaphoreGive(_write_mutex);
-
-        if (hasErr) {
-            _error(sent_errno);
-        } else if (sent_cb_length > 0 && _sent_cb) {
-            _sent_cb(_sent_cb_arg, this, sent_cb_length, sent_cb_delay);
+    } else {
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0
+        if (_writeQueue.full()) {
+            _writeUnlock();
+            return 0;
         }
-
-        break;
+#endif
+        n_entry.data = (uint8_t *)data;
+        n_entry.capacity = will_send;
+        n_entry.owned = false;
+        n_entry.pooled = false;
+        n_entry.streamed = false;
+    }
+    if (!coalesced) {
+        n_entry.length = will_send;
+        n_entry.written = 0;
+        n_entry.queued_at = millis();
+        n_entry.written_at = 0;
+        n_entry.write_errno = 0;
+        n_entry.corked = more;
+        _writeQueue.push_back(n_entry);
+#if CONFIG_ASYNC_TCP_STATS
+        _statQueued();
+#endif
+    }
+    _writeSpaceRemaining -= will_send;
+    _ack_timeout_signaled = false;
+    bool corkChanged = _cork(will_send, more);
+    _writeUnlock();
+
+    // Socket is now of interest for writing, unless the data is held back
+    // until the cork deadline. An ACK timeout shorter than the poll interval
+    // also makes the socket due earlier than its timer.
+    bool wake = wasIdle;
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    // Buffers found acknowledged above are retired on the next pass
+    wake = wake || refreshed;
+#endif
+    if (corkChanged || (wasEmpty && _ack_timeout && _ack_timeout < _poll_interval)) {
+        _rearmTimer();
+    } else if (wake) {
+        _asyncsock_wakeup(_worker);
     }
 
-    return activity;
+    return will_send;
 }
+#endif
 
-bool AsyncClient::_flushWriteQueue(void)
+void AsyncClient::_freeWriteBuffer(queued_writebuf & qwb)
 {
-    bool activity = false;
+    if (qwb.pooled) {
+        _asyncsock_wpool_free(qwb.data);
+    } else if (qwb.owned) {
+        ::free(qwb.data);
+    }
+    qwb.data = NULL;
+}
 
-    if (_socket == -1) return false;
+bool AsyncClient::sendStream(AsyncStreamSource * source)
+{
+    if (source == NULL || !connected()) return false;
 
-    auto & qwb = _writeQueue.front();
+    AsyncSocketWorker * w = _lockWorker();
+    bool busy = (_stream != NULL);
+    if (!busy) {
+        _stream = source;
+        _stream_wait = false;
+    }
+    _unlockWorker(w);
+    if (busy) return false;
 
-    if (qwb.write_errno == 0 && qwb.written < qwb.length) {
-        uint8_t * p = qwb.data + qwb.written;
-        size_t n = qwb.length - qwb.written;
-        errno = 0; ssize_t r = lwip_write(_socket, p, n);
+    // Socket is now of interest for writing
+    _asyncsock_wakeup(w);
+    return true;
+}
 
-        if (r >= 0) {
-            // Written some data into the socket
-            qwb.written += r;
-            _writeSpaceRemaining += r;
-            activity = true;
+// Read from the stream source straight into the staging buffer, for as long
+// as the connection has room for more data, and queue what was read. The
+// source is called without the write lock held, since reading might be slow.
+bool AsyncClient::_pullStream(void)
+{
+    AsyncSocketWorker * w = _worker;
+    bool activity = false;
 
-            if (qwb.written >= qwb.length) {
-                qwb.written_at = millis();
-            }
-        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // Socket is full, could not write anything
-        } else {
-            qwb.write_errno = errno;
+    if (_stream_buf == NULL) {
+        _stream_buf = (uint8_t *)malloc(CONFIG_ASYNC_TCP_STREAM_BUFFER_SIZE);
+        if (_stream_buf == NULL) {
+            log_e("no memory for stream buffer");
+            _endStream(false);
+            return false;
         }
     }
 
-    return activity;
-}
+    while (_stream != NULL && !_stream_wait) {
+        uint32_t off;
+        _writeLock();
+        uint32_t len = _streamSpace(off);
+        _writeUnlock();
+        if (len == 0) break;
 
-void AsyncClient::_sockIsReadable(void)
-{
-    _rx_last_packet = millis();
-    errno = 0; ssize_t r = lwip_read(_socket, _readBuffer, MAX_PAYLOAD_SIZE);
-    if (r > 0) {
-        if(_recv_cb) {
-            _recv_cb(_recv_cb_arg, this, _readBuffer, r);
+        int r = _stream->read(_stream_buf + off, len);
+
+        // Source might have closed or even destroyed this client
+        if (w->current != this || _socket == -1) return activity;
+        if (r == 0) {
+            _stream_wait = true;
+            break;
         }
-    } else if (r == 0) {
-        // A successful read of 0 bytes indicates remote side closed connection
-        _close();
-    } else if (r < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // Do nothing, will try later
-        } else {
-            _error(errno);
+        if (r < 0) {
+            _endStream(true);
+            break;
         }
+        if ((uint32_t)r > len) r = len;
+
+        queued_writebuf n_entry;
+        n_entry.data = _stream_buf + off;
+        n_entry.length = r;
+        n_entry.capacity = r;
+        n_entry.written = 0;
+        n_entry.queued_at = millis();
+        n_entry.written_at = 0;
+        n_entry.write_errno = 0;
+        n_entry.owned = false;
+        n_entry.pooled = false;
+        n_entry.streamed = true;
+        n_entry.corked = false;
+
+        _writeLock();
+        _writeQueue.push_back(n_entry);
+#if CONFIG_ASYNC_TCP_STATS
+        _statQueued();
+#endif
+        _writeSpaceRemaining -= r;
+        _stream_head = off + r;
+        _stream_used += r;
+        _ack_timeout_signaled = false;
+        _uncork();
+        _writeUnlock();
+        activity = true;
     }
+    return activity;
 }
 
-void AsyncClient::_sockPoll(void)
+// Contiguous part of the staging buffer that can be filled next, no larger
+// than the room left for writing. Called with the write lock held.
+uint32_t AsyncClient::_streamSpace(uint32_t & off)
 {
-    if (_socket == -1) return;
-
-    uint32_t now = millis();
+    const uint32_t size = CONFIG_ASYNC_TCP_STREAM_BUFFER_SIZE;
+    uint32_t len;
 
-    // ACK Timeout - simulated by write queue staleness
-    xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY);
-    uint32_t sent_delay = now - _writeQueue.front().queued_at;
-    if (_writeQueue.size() > 0 && !_ack_timeout_signaled && _ack_timeout && sent_delay >= _ack_timeout) {
-        _ack_timeout_signaled = true;
-        //log_w("ack timeout %d", pcb->state);
-        xSemaphoreGive(_write_mutex);
-        if(_timeout_cb)
-            _timeout_cb(_timeout_cb_arg, this, sent_delay);
-        return;
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0
+    if (_writeQueue.full()) return 0;
+#endif
+    if (_stream_used == 0) {
+        _stream_head = _stream_tail = 0;
+        off = 0; len = size;
+    } else if (_stream_head > _stream_tail) {
+        // Wrap around rather than reading a short chunk at the end
+        off = _stream_head; len = size - _stream_head;
+        if (len < TCP_MSS && _stream_tail > len) {
+            off = 0; len = _stream_tail;
+        }
+    } else {
+        off = _stream_head; len = _stream_tail - _stream_head;
     }
-    xSemaphoreGive(_write_mutex);
+    return (len < _writeSpaceRemaining) ? len : (uint32_t)_writeSpaceRemaining;
+}
 
-    // RX Timeout
-    if (_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000)) {
-        //log_w("rx timeout %d", pcb->state);
-        _close();
-        return;
-    }
-    // Everything is fine
-    if(_poll_cb) {
-        _poll_cb(_poll_cb_arg, this);
-    }
+// Buffer of the stream was retired from the write queue. Called with the write
+// lock held.
+void AsyncClient::_releaseStream(const queued_writebuf & qwb)
+{
+    _stream_tail = (qwb.data - _stream_buf) + qwb.length;
+    _stream_used -= qwb.length;
 }
 
-void AsyncClient::_removeAllCallbacks(void)
+void AsyncClient::_endStream(bool complete)
 {
-    _connect_cb = NULL;
-    _connect_cb_arg = NULL;
-    _discard_cb = NULL;
-    _discard_cb_arg = NULL;
-    _sent_cb = NULL;
-    _sent_cb_arg = NULL;
-    _error_cb = NULL;
-    _error_cb_arg = NULL;
-    _recv_cb = NULL;
-    _recv_cb_arg = NULL;
-    _timeout_cb = NULL;
-    _timeout_cb_arg = NULL;
-    _poll_cb = NULL;
-    _poll_cb_arg = NULL;
+    AsyncStreamSource * source = _stream;
+    if (source == NULL) return;
+    _stream = NULL;
+    _stream_wait = false;
+    source->onStreamEnd(this, complete);
 }
 
-void AsyncClient::_close(void)
+void AsyncClient::getWritePoolStats(AsyncWritePoolStats * stats)
 {
-    //Serial.print("AsyncClient::_close: "); Serial.println(_socket);
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    _conn_state = 0;
-#ifdef ESP_IDF_VERSION_MAJOR
-    lwip_close(_socket);
+    if (stats == NULL) return;
+    portENTER_CRITICAL(&_asyncsock_wpool.mux);
+    memcpy(stats, &_asyncsock_wpool.stats, sizeof(AsyncWritePoolStats));
+    portEXIT_CRITICAL(&_asyncsock_wpool.mux);
+    stats->block_size = CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE;
+}
+
+void AsyncClient::getStats(AsyncClientStats * stats)
+{
+    if (stats == NULL) return;
+#if CONFIG_ASYNC_TCP_STATS
+    AsyncSocketWorker * w = _lockWorker();
+    _writeLock();
+    *stats = _stats;
+    stats->queue_depth = _writeQueue.size();
+    _writeUnlock();
+    stats->dispatches = _dispatches;
+    stats->dispatch_time_max = _dispatch_time_max;
+    stats->dispatch_time_total = _dispatch_time_total;
+    _unlockWorker(w);
 #else
-    lwip_close_r(_socket);
+    memset(stats, 0, sizeof(AsyncClientStats));
 #endif
-    _socket = -1;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
-
-    _clearWriteQueue();
-    if (_discard_cb) _discard_cb(_discard_cb_arg, this);
-    _removeAllCallbacks();
 }
 
-void AsyncClient::_error(int8_t err)
+#if CONFIG_ASYNC_TCP_STATS
+// Called with the write lock held, after queueing a buffer
+void AsyncClient::_statQueued(void)
 {
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
-    _conn_state = 0;
-#ifdef ESP_IDF_VERSION_MAJOR
-    lwip_close(_socket);
-#else
-    lwip_close_r(_socket);
+    uint16_t depth = _writeQueue.size();
+    if (depth > _stats.queue_max) {
+        _stats.queue_max = depth;
+        _asyncsock_stat_max(_worker, &AsyncTCPStats::queue_max, depth);
+    }
+}
 #endif
-    _socket = -1;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
 
-    _clearWriteQueue();
-    if (_error_cb) _error_cb(_error_cb_arg, this, err);
-    if (_discard_cb) _discard_cb(_discard_cb_arg, this);
-    _removeAllCallbacks();
+// Called with the write lock held, after queueing len bytes. Returns true if
+// data started or stopped being held back, so the timer needs to be set again.
+bool AsyncClient::_cork(size_t len, bool more)
+{
+    if (more) {
+        bool started = (_cork_len == 0);
+        if (started) _cork_since = millis();
+        _cork_len += len;
+        if (_cork_len < CONFIG_ASYNC_TCP_CORK_SIZE) return started;
+    }
+    return _uncork();
 }
 
-size_t AsyncClient::space()
+// Release all data held back. Since any add without ASYNC_WRITE_FLAG_MORE
+// releases it, held back buffers are always the last ones in the queue.
+bool AsyncClient::_uncork(void)
 {
-    if (!connected()) return 0;
-    return _writeSpaceRemaining;
+    if (_cork_len == 0) return false;
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end(); it++) {
+        it->corked = false;
+    }
+    _cork_len = 0;
+    return true;
 }
 
-size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags)
+// Whether the write queue has anything to write or retire, other than data
+// held back. Called with the write lock held.
+bool AsyncClient::_writePending(void)
 {
-    queued_writebuf n_entry;
-
-    if (!connected() || data == NULL || size <= 0) return 0;
-
-    size_t room = space();
-    if (!room) return 0;
-
-    size_t will_send = (room < size) ? room : size;
-    if (apiflags & ASYNC_WRITE_FLAG_COPY) {
-        n_entry.data = (uint8_t *)malloc(will_send);
-        if (n_entry.data == NULL) {
-            return 0;
-        }
-        memcpy(n_entry.data, data, will_send);
-        n_entry.owned = true;
-    } else {
-        n_entry.data = (uint8_t *)data;
-        n_entry.owned = false;
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end(); it++) {
+        if (it->written < it->length) return !it->corked;
+#if !CONFIG_ASYNC_TCP_ACK_TRACKING
+        return true;
+#endif
     }
-    n_entry.length = will_send;
-    n_entry.written = 0;
-    n_entry.queued_at = millis();
-    n_entry.written_at = 0;
-    n_entry.write_errno = 0;
-
-    xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY);
-    _writeQueue.push_back(n_entry);
-    _writeSpaceRemaining -= will_send;
-    _ack_timeout_signaled = false;
-    xSemaphoreGive(_write_mutex);
-
-    return will_send;
+    return false;
 }
 
 bool AsyncClient::send()
 {
+    // Stream source might have data again
+    if (_stream != NULL && _stream_wait) {
+        AsyncSocketWorker * w = _lockWorker();
+        _stream_wait = false;
+        _unlockWorker(w);
+        _asyncsock_wakeup(w);
+    }
+
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+    // Data is written by the asyncTcpSock task, which add() already woke up
+    return true;
+#else
+#if ASYNC_TCP_SSL_ENABLED
+    // TLS session may only be used by the asyncTcpSock task
+    if (_tls != NULL) {
+        AsyncSocketWorker * w = _lockWorker();
+        _unlockWorker(w);
+        _asyncsock_wakeup(w);
+        return true;
+    }
+#endif
     fd_set sockSet_w;
     struct timeval tv;
 
@@ -824,25 +4275,61 @@ bool AsyncClient::send()
     tv.tv_usec = 0;
 
     // TODO: data was already queued, what should be done here?
-    xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY);
+    _writeLock();
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    bool awaiting = _sockAwaitingAck();
+#endif
     int r = select(_socket + 1, NULL, &sockSet_w, NULL, &tv);
     if (r > 0) _flushWriteQueue();
-    xSemaphoreGive(_write_mutex);
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    bool arm = !awaiting && _sockAwaitingAck();
+    _writeUnlock();
+    if (arm) _armAckCheck();
+#else
+    _writeUnlock();
+#endif
     return true;
+#endif
 }
 
 // In normal operation this should be a no-op. Will only free something in case
 // of errors before all data was written.
 void AsyncClient::_clearWriteQueue(void)
 {
-    xSemaphoreTake(_write_mutex, (TickType_t)portMAX_DELAY);
+    _writeLock();
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+    // Writers might be reserving space concurrently, so only the space held
+    // by what is cleared is given back: unwritten bytes, and written bytes
+    // not yet acknowledged if tracked.
+    uint32_t unreserved = 0;
+    queued_writebuf qwb;
+    while (_writeRing.pop(qwb)) {
+        unreserved += qwb.length;
+        _freeWriteBuffer(qwb);
+    }
     while (_writeQueue.size() > 0) {
-        if (_writeQueue.front().owned) {
-            ::free(_writeQueue.front().data);
-        }
+        unreserved += _writeQueue.front().length - _writeQueue.front().written;
+        _freeWriteBuffer(_writeQueue.front());
         _writeQueue.pop_front();
     }
-    xSemaphoreGive(_write_mutex);
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    unreserved += _tx_inflight;
+#endif
+    _writeSpaceRemaining += unreserved;
+#else
+    while (_writeQueue.size() > 0) {
+        _freeWriteBuffer(_writeQueue.front());
+        _writeQueue.pop_front();
+    }
+    _writeSpaceRemaining = TCP_SND_BUF;
+#endif
+    _tx_inflight = 0;
+    _tx_acked = 0;
+    _cork_len = 0;
+    ::free(_stream_buf);
+    _stream_buf = NULL;
+    _stream_head = _stream_tail = _stream_used = 0;
+    _writeUnlock();
 }
 
 bool AsyncClient::free(){
@@ -867,7 +4354,9 @@ size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags) {
 
 void AsyncClient::close(bool now)
 {
+    _reconnect_pending = false;
     if (_socket != -1) _close();
+    else AsyncDnsCache::cancel(this);
 }
 
 int8_t AsyncClient::abort(){
@@ -936,14 +4425,31 @@ AsyncServer::AsyncServer(IPAddress addr, uint16_t port)
 , _noDelay(false)
 , _connect_cb(0)
 , _connect_cb_arg(0)
+, _clients(std::make_shared<std::atomic<uint16_t>>(0))
+{}
+
+#if LWIP_IPV6
+AsyncServer::AsyncServer(IPv6Address addr, uint16_t port)
+: _port(port)
+, _addr6(addr)
+, _bind6(true)
+, _noDelay(false)
+, _connect_cb(0)
+, _connect_cb_arg(0)
+, _clients(std::make_shared<std::atomic<uint16_t>>(0))
 {}
+#endif
 
 AsyncServer::AsyncServer(uint16_t port)
 : _port(port)
 , _addr((uint32_t) IPADDR_ANY)
+#if LWIP_IPV6
+, _bind6(true)
+#endif
 , _noDelay(false)
 , _connect_cb(0)
 , _connect_cb_arg(0)
+, _clients(std::make_shared<std::atomic<uint16_t>>(0))
 {}
 
 AsyncServer::~AsyncServer(){
@@ -959,19 +4465,42 @@ void AsyncServer::begin()
 {
     if (_socket != -1) return;
 
+    if (_slot < 0) {
+        log_e("socket not monitored, too many sockets");
+        return;
+    }
+
     if (!_start_asyncsock_task()) {
         log_e("failed to start task");
         return;
     }
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+#if LWIP_IPV6
+    if (_bind6) {
+        addr.type = IPADDR_TYPE_V6;
+        memcpy(addr.u_addr.ip6.addr, (const uint8_t *)_addr6, 16);
+    } else
+#endif
+    {
+        addr.type = IPADDR_TYPE_V4;
+        addr.u_addr.ip4.addr = (uint32_t) _addr;
+    }
+    struct sockaddr_storage server;
+    socklen_t server_len = _asyncsock_to_sockaddr(addr, _port, &server);
+
+    int sockfd = socket(server.ss_family, SOCK_STREAM, 0);
     if (sockfd < 0) return;
 
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = (uint32_t) _addr;
-    server.sin_port = htons(_port);
-    if (bind(sockfd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+#if LWIP_IPV6
+    // Bound to any IPv6 address, the socket also accepts IPv4 connections
+    if (_bind6) {
+        int v6only = 0;
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+#endif
+    if (bind(sockfd, (struct sockaddr *)&server, server_len) < 0) {
 #ifdef ESP_IDF_VERSION_MAJOR
         lwip_close(sockfd);
 #else
@@ -981,8 +4510,7 @@ void AsyncServer::begin()
         return;
     }
 
-    static uint8_t backlog = 5;
-    if (listen(sockfd , backlog) < 0) {
+    if (listen(sockfd , _backlog) < 0) {
 #ifdef ESP_IDF_VERSION_MAJOR
     lwip_close(sockfd);
 #else
@@ -994,31 +4522,73 @@ void AsyncServer::begin()
     int r = fcntl(sockfd, F_SETFL, O_NONBLOCK);
 
     // Updating state visible to asyncTcpSock task
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
+    AsyncSocketWorker * w = _lockWorker();
     _socket = sockfd;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
 }
 
 void AsyncServer::end()
 {
     if (_socket == -1) return;
-    xSemaphoreTakeRecursive(_asyncsock_mutex, (TickType_t)portMAX_DELAY);
+    AsyncSocketWorker * w = _lockWorker();
 #ifdef ESP_IDF_VERSION_MAJOR
     lwip_close(_socket);
 #else
     lwip_close_r(_socket);
 #endif
     _socket = -1;
-    xSemaphoreGiveRecursive(_asyncsock_mutex);
+    _selected = false;
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
+}
+
+uint16_t AsyncServer::getClientCount()
+{
+    return *_clients;
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+void AsyncServer::beginSecure(const char * cert, const char * private_key, const char * password)
+{
+    if (_socket != -1) return;
+
+    std::shared_ptr<AsyncTCP_TLS_ServerConfig> config = std::make_shared<AsyncTCP_TLS_ServerConfig>();
+    int r = config->init(cert, private_key, password);
+    if (r != 0) {
+        log_e("failed to load certificate or key: -0x%04x", -r);
+        return;
+    }
+    _tls_config = config;
+    begin();
+}
+#endif
+
+// Refuse an incoming connection with a RST, instead of a graceful close
+static void _asyncsock_reject(int sockfd)
+{
+    struct linger l;
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+#ifdef ESP_IDF_VERSION_MAJOR
+    lwip_close(sockfd);
+#else
+    lwip_close_r(sockfd);
+#endif
 }
 
 void AsyncServer::_sockIsReadable(void)
 {
     //Serial.print("AsyncServer::_sockIsReadable: "); Serial.println(_socket);
-
-    if (_connect_cb) {
-        struct sockaddr_in client;
-        size_t cs = sizeof(struct sockaddr_in);
+    AsyncSocketWorker * w = _worker;
+
+    // Accept all pending connections, so that a burst of connections is dealt
+    // with in a single pass. Connections keep arriving while doing so, so no
+    // more than the size of the backlog is accepted at once.
+    for (uint16_t n = 0; n < (_backlog > 0 ? _backlog : 1); n++) {
+        struct sockaddr_storage client;
+        size_t cs = sizeof(struct sockaddr_storage);
         errno = 0;
 #ifdef ESP_IDF_VERSION_MAJOR
         int accepted_sockfd = lwip_accept(_socket, (struct sockaddr *)&client, (socklen_t*)&cs);
@@ -1027,15 +4597,404 @@ void AsyncServer::_sockIsReadable(void)
 #endif
         //Serial.printf("\t new sockfd=%d errno=%d\r\n", accepted_sockfd, errno);
         if (accepted_sockfd < 0) {
-            log_e("accept error: %d - %s", errno, strerror(errno));
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_e("accept error: %d - %s", errno, strerror(errno));
+            }
             return;
         }
 
+        // Admission control, to keep connection bursts from exhausting memory
+        const char * refused = NULL;
+        if (!_connect_cb) {
+            refused = "no client handler";
+        } else if (_max_clients > 0 && *_clients >= _max_clients) {
+            refused = "too many clients";
+        } else if (_min_free_heap > 0 && heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < _min_free_heap) {
+            refused = "low memory";
+        }
+        if (refused) {
+            log_w("connection refused: %s", refused);
+            _asyncsock_reject(accepted_sockfd);
+            ASYNCSOCK_STAT_ADD(w, refusals, 1);
+            continue;
+        }
+
+#if CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE > 0
+        // Fall back to the heap once the pool is exhausted
+        void * p = _asyncsock_cpool_alloc();
+        AsyncClient * c = (p != NULL) ? new (p) AsyncClient(accepted_sockfd) : new AsyncClient(accepted_sockfd);
+#else
         AsyncClient * c = new AsyncClient(accepted_sockfd);
-        if (c) {
-            c->setNoDelay(_noDelay);
-            _connect_cb(_connect_cb_arg, c);
+#endif
+        if (c == NULL) {
+            _asyncsock_reject(accepted_sockfd);
+            ASYNCSOCK_STAT_ADD(w, refusals, 1);
+            continue;
+        }
+        if (c->_slot < 0) {
+            // Could not be monitored, just drop the connection
+            c->abort();
+            delete c;
+            ASYNCSOCK_STAT_ADD(w, refusals, 1);
+            continue;
+        }
+
+#if ASYNC_TCP_SSL_ENABLED
+        // Handshake goes on once the application has set up the client
+        if (_tls_config) {
+            c->_tls_server = _tls_config;
+            if (c->_startTLS() != 0) {
+                c->_tls_server.reset();
+                c->abort();
+                delete c;
+                ASYNCSOCK_STAT_ADD(w, refusals, 1);
+                continue;
+            }
+        }
+#endif
+
+        (*_clients)++;
+        c->_server_clients = _clients;
+        c->_setPeer((struct sockaddr *)&client);
+        c->setNoDelay(_noDelay);
+        ASYNCSOCK_STAT_ADD(w, accepts, 1);
+        _connect_cb(_connect_cb_arg, c);
+
+        // The new client is serviced by this worker until the application
+        // had a chance to set up its callbacks. Only then it is moved to
+        // the least loaded worker.
+        if (CONFIG_ASYNC_TCP_WORKER_COUNT > 1) _rebalance(c);
+
+        // Callback might have stopped or even destroyed this server
+        if (w->current != this || _socket == -1) return;
+    }
+}
+
+AsyncUDPSocketPacket::AsyncUDPSocketPacket(AsyncUDPSocket * udp, uint8_t * data, size_t len, const struct sockaddr * from)
+: _udp(udp)
+, _data(data)
+, _len(len)
+{
+    _port = _asyncsock_from_sockaddr(from, &_addr);
+}
+
+IPAddress AsyncUDPSocketPacket::remoteIP()
+{
+    return IPAddress(IP_IS_V4(&_addr) ? _addr.u_addr.ip4.addr : 0);
+}
+
+bool AsyncUDPSocketPacket::getRemoteAddr(ip_addr_t * addr)
+{
+    if (addr != NULL) *addr = _addr;
+    return true;
+}
+
+#if LWIP_IPV6
+IPv6Address AsyncUDPSocketPacket::remoteIP6()
+{
+    if (!IP_IS_V6(&_addr)) return IPv6Address();
+    return IPv6Address(_addr.u_addr.ip6.addr);
+}
+
+bool AsyncUDPSocketPacket::isIPv6()
+{
+    return IP_IS_V6(&_addr);
+}
+#endif
+
+size_t AsyncUDPSocketPacket::write(const uint8_t * data, size_t len)
+{
+    return _udp->writeTo(data, len, &_addr, _port);
+}
+
+AsyncUDPSocket::AsyncUDPSocket()
+{
+}
+
+AsyncUDPSocket::~AsyncUDPSocket()
+{
+    close();
+}
+
+bool AsyncUDPSocket::_open(const ip_addr_t & addr, uint16_t port)
+{
+    close();
+
+    if (_slot < 0) {
+        log_e("socket not monitored, too many sockets");
+        return false;
+    }
+
+    if (!_start_asyncsock_task()) {
+        log_e("failed to start task");
+        return false;
+    }
+
+    struct sockaddr_storage local;
+    socklen_t local_len = _asyncsock_to_sockaddr(addr, port, &local);
+
+    int sockfd = socket(local.ss_family, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        log_e("socket: %d", errno);
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+#if LWIP_IPV6
+    // Bound to any IPv6 address, the socket also receives IPv4 datagrams
+    if (local.ss_family == AF_INET6) {
+        int v6only = 0;
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+#endif
+    if (bind(sockfd, (struct sockaddr *)&local, local_len) < 0) {
+#ifdef ESP_IDF_VERSION_MAJOR
+        lwip_close(sockfd);
+#else
+        lwip_close_r(sockfd);
+#endif
+        log_e("bind error: %d - %s", errno, strerror(errno));
+        return false;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    // Updating state visible to asyncTcpSock task
+    AsyncSocketWorker * w = _lockWorker();
+    _socket = sockfd;
+    _v6 = (local.ss_family == AF_INET6);
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
+    return true;
+}
+
+bool AsyncUDPSocket::listen(uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+#if LWIP_IPV6
+    addr.type = IPADDR_TYPE_V6;
+#else
+    addr.type = IPADDR_TYPE_V4;
+#endif
+    return _open(addr, port);
+}
+
+bool AsyncUDPSocket::listen(const IPAddress & ip, uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V4;
+    addr.u_addr.ip4.addr = (uint32_t)ip;
+    return _open(addr, port);
+}
+
+bool AsyncUDPSocket::listenMulticast(const IPAddress & ip, uint16_t port, uint8_t ttl)
+{
+#if LWIP_IGMP
+    // Bound to any address, since datagrams are addressed to the group
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V4;
+    if (!_open(addr, port)) return false;
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = (uint32_t)ip;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        log_e("multicast join error: %d - %s", errno, strerror(errno));
+        close();
+        return false;
+    }
+    setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    return true;
+#else
+    log_e("lwIP built without IGMP support");
+    return false;
+#endif
+}
+
+bool AsyncUDPSocket::_connect(const ip_addr_t & ip, uint16_t port)
+{
+    ip_addr_t any;
+    memset(&any, 0, sizeof(any));
+    any.type = ip.type;
+    if (!_open(any, 0)) return false;
+
+    struct sockaddr_storage peer;
+    socklen_t peer_len = _asyncsock_to_sockaddr(ip, port, &peer);
+#ifdef ESP_IDF_VERSION_MAJOR
+    int r = lwip_connect(_socket, (struct sockaddr *)&peer, peer_len);
+#else
+    int r = lwip_connect_r(_socket, (struct sockaddr *)&peer, peer_len);
+#endif
+    if (r < 0) {
+        log_e("connect error: %d - %s", errno, strerror(errno));
+        close();
+        return false;
+    }
+    _connected = true;
+    return true;
+}
+
+bool AsyncUDPSocket::connect(const IPAddress & ip, uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V4;
+    addr.u_addr.ip4.addr = (uint32_t)ip;
+    return _connect(addr, port);
+}
+
+#if LWIP_IPV6
+bool AsyncUDPSocket::connect(const IPv6Address & ip, uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V6;
+    memcpy(addr.u_addr.ip6.addr, (const uint8_t *)ip, 16);
+    return _connect(addr, port);
+}
+#endif
+
+void AsyncUDPSocket::close()
+{
+    if (_socket == -1) return;
+    AsyncSocketWorker * w = _lockWorker();
+#ifdef ESP_IDF_VERSION_MAJOR
+    lwip_close(_socket);
+#else
+    lwip_close_r(_socket);
+#endif
+    _socket = -1;
+    _selected = false;
+    _connected = false;
+#if LWIP_IPV6
+    AsyncUDPSocket * bcast = _bcast;
+    _bcast = NULL;
+#endif
+    _unlockWorker(w);
+    _asyncsock_wakeup(w);
+#if LWIP_IPV6
+    delete bcast;
+#endif
+}
+
+size_t AsyncUDPSocket::write(const uint8_t * data, size_t len)
+{
+    if (!_connected) return 0;
+    ssize_t r = lwip_write(_socket, data, len);
+    return (r > 0) ? r : 0;
+}
+
+size_t AsyncUDPSocket::writeTo(const uint8_t * data, size_t len, const ip_addr_t * addr, uint16_t port)
+{
+    if (_socket == -1 || addr == NULL) return 0;
+
+    struct sockaddr_storage to;
+    socklen_t to_len;
+#if LWIP_IPV6
+    // A dual-stack socket reaches IPv4 destinations through mapped addresses
+    if (_v6 && IP_IS_V4(addr)) {
+        struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *)&to;
+        memset(sin6, 0, sizeof(*sin6));
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_addr.s6_addr[10] = 0xff;
+        sin6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sin6->sin6_addr.s6_addr[12], &addr->u_addr.ip4.addr, 4);
+        to_len = sizeof(*sin6);
+    } else
+#endif
+    to_len = _asyncsock_to_sockaddr(*addr, port, &to);
+
+    ssize_t r = lwip_sendto(_socket, data, len, 0, (struct sockaddr *)&to, to_len);
+    return (r > 0) ? r : 0;
+}
+
+size_t AsyncUDPSocket::writeTo(const uint8_t * data, size_t len, const IPAddress & ip, uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V4;
+    addr.u_addr.ip4.addr = (uint32_t)ip;
+    return writeTo(data, len, &addr, port);
+}
+
+#if LWIP_IPV6
+size_t AsyncUDPSocket::writeTo(const uint8_t * data, size_t len, const IPv6Address & ip, uint16_t port)
+{
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.type = IPADDR_TYPE_V6;
+    memcpy(addr.u_addr.ip6.addr, (const uint8_t *)ip, 16);
+    return writeTo(data, len, &addr, port);
+}
+#endif
+
+size_t AsyncUDPSocket::broadcastTo(const uint8_t * data, size_t len, uint16_t port)
+{
+#if LWIP_IPV6
+    // Sent to the IPv4-mapped broadcast address, a datagram from an IPv6
+    // socket is not reliably treated as a broadcast, so it goes out through
+    // an IPv4 socket instead. Replies to it are handed to the packet handler
+    // of this socket.
+    if (_v6) {
+        if (_socket == -1) return 0;
+        if (_bcast == NULL) {
+            AsyncUDPSocket * bcast = new (std::nothrow) AsyncUDPSocket();
+            if (bcast == NULL) return 0;
+            bcast->onPacket([this](AsyncUDPSocketPacket & packet) {
+                if (_packet_cb) _packet_cb(packet);
+            });
+
+            ip_addr_t any;
+            memset(&any, 0, sizeof(any));
+            any.type = IPADDR_TYPE_V4;
+            if (!bcast->_open(any, 0)) {
+                delete bcast;
+                return 0;
+            }
+            _bcast = bcast;
         }
+        return _bcast->broadcastTo(data, len, port);
     }
+#endif
+    return writeTo(data, len, IPAddress(0xffffffff), port);
 }
 
+void AsyncUDPSocket::_sockIsReadable(void)
+{
+    AsyncSocketWorker * w = _worker;
+
+    // Without memory for whole datagrams, make do with the read buffer
+    if (w->udpBuffer == NULL) w->udpBuffer = (uint8_t *)malloc(CONFIG_ASYNC_TCP_UDP_BUFFER_SIZE);
+    uint8_t * buf = w->udpBuffer;
+    size_t size = CONFIG_ASYNC_TCP_UDP_BUFFER_SIZE;
+    if (buf == NULL) {
+        buf = w->readBuffer;
+        size = CONFIG_ASYNC_TCP_RX_BUFFER_SIZE;
+    }
+
+    // Take a batch of datagrams at once, as many as are waiting
+    for (int i = 0; i < CONFIG_ASYNC_TCP_UDP_RX_BATCH; i++) {
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        errno = 0;
+        ssize_t r = lwip_recvfrom(_socket, buf, size, 0, (struct sockaddr *)&from, &from_len);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_e("recvfrom error: %d - %s", errno, strerror(errno));
+            }
+            return;
+        }
+        if (!_packet_cb) continue;
+
+        AsyncUDPSocketPacket packet(this, buf, r, (struct sockaddr *)&from);
+        _packet_cb(packet);
+
+        // Callback might have closed or even destroyed this socket
+        if (w->current != this || _socket == -1) return;
+    }
+}
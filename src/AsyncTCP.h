@@ -29,52 +29,647 @@
 #include <functional>
 #include <deque>
 #include <list>
+#include <memory>
+#include <atomic>
 
 extern "C" {
     #include "lwip/err.h"
+    #include "lwip/pbuf.h"
     #include "lwip/sockets.h"
 }
 
+#if LWIP_IPV6
+#include "IPv6Address.h"
+#endif
+
 //If core is not defined, then we are running in Arduino or PIO
 #ifndef CONFIG_ASYNC_TCP_RUNNING_CORE
 #define CONFIG_ASYNC_TCP_RUNNING_CORE -1 // Any available core, but sticking to one core is recommended if using SPIFFS/LittleFS.
-#define CONFIG_ASYNC_TCP_USE_WDT 1 // If enabled, adds between 33us and 200us per event
+#define CONFIG_ASYNC_TCP_USE_WDT 1
+#endif
+
+// With the WDT enabled, the service task normally subscribes to it once and
+// resets it on every pass, and any handler running for longer than the
+// deadline (in milliseconds) is logged. If per-event mode is enabled instead,
+// the task subscribes to and unsubscribes from the WDT around every handler,
+// which adds between 33us and 200us per event.
+#ifndef CONFIG_ASYNC_TCP_WDT_PER_EVENT
+#define CONFIG_ASYNC_TCP_WDT_PER_EVENT 0
+#endif
+#ifndef CONFIG_ASYNC_TCP_CALLBACK_DEADLINE
+#define CONFIG_ASYNC_TCP_CALLBACK_DEADLINE 100
+#endif
+
+// If enabled, the service tasks keep the performance counters returned by
+// AsyncSocketBase::getStats() and AsyncClient::getStats(), at the cost of a
+// few more bytes per socket and a short critical section per event.
+#ifndef CONFIG_ASYNC_TCP_STATS
+#define CONFIG_ASYNC_TCP_STATS 1
+#endif
+
+// If enabled, the service tasks record timed events into a ring buffer of
+// CONFIG_ASYNC_TCP_TRACE_SIZE entries (a power of two, 12 bytes each), see
+// AsyncSocketBase::readTrace(). Waits for a lock are only recorded if they
+// last at least CONFIG_ASYNC_TCP_TRACE_MIN_WAIT us. If disabled, tracing
+// compiles to nothing.
+#ifndef CONFIG_ASYNC_TCP_TRACE
+#define CONFIG_ASYNC_TCP_TRACE 0
+#endif
+#ifndef CONFIG_ASYNC_TCP_TRACE_SIZE
+#define CONFIG_ASYNC_TCP_TRACE_SIZE 512
+#endif
+#ifndef CONFIG_ASYNC_TCP_TRACE_MIN_WAIT
+#define CONFIG_ASYNC_TCP_TRACE_MIN_WAIT 10
+#endif
+
+// Address types looked up, and in which order, when connecting to a host name
+// (one of the LWIP_DNS_ADDRTYPE_* values). By default IPv4 is preferred, and
+// IPv6 used for hosts without an IPv4 address.
+#if LWIP_IPV6 && !defined(CONFIG_ASYNC_TCP_DNS_ADDRTYPE)
+#define CONFIG_ASYNC_TCP_DNS_ADDRTYPE LWIP_DNS_ADDRTYPE_IPV4_IPV6
+#endif
+
+// Host name lookups are cached and shared by all clients: number of names kept,
+// the longest name cached, and how long in seconds a result is reused (lwIP
+// does not report record TTLs). Clients connecting to a name still being
+// looked up wait for the same lookup.
+#ifndef CONFIG_ASYNC_TCP_DNS_CACHE_SIZE
+#define CONFIG_ASYNC_TCP_DNS_CACHE_SIZE 4
+#endif
+#ifndef CONFIG_ASYNC_TCP_DNS_NAME_MAX
+#define CONFIG_ASYNC_TCP_DNS_NAME_MAX 64
+#endif
+#ifndef CONFIG_ASYNC_TCP_DNS_CACHE_TTL
+#define CONFIG_ASYNC_TCP_DNS_CACHE_TTL 60
+#endif
+
+// For hosts with both IPv4 and IPv6 addresses, a connection attempt to the
+// other address family is started when the first one has not completed after
+// this many milliseconds, and the first to connect is kept. 0 disables.
+#ifndef CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY
+#define CONFIG_ASYNC_TCP_HAPPY_EYEBALLS_DELAY 250
+#endif
+
+// Default time in milliseconds allowed for an outgoing connection to be
+// established, before it fails with ERR_TIMEOUT. 0 leaves it to lwIP.
+#ifndef CONFIG_ASYNC_TCP_CONNECT_TIMEOUT
+#define CONFIG_ASYNC_TCP_CONNECT_TIMEOUT 10000
+#endif
+
+// Built-in TLS for clients and servers, on top of mbedTLS. Named as in the
+// original AsyncTCP, so that libraries built on it can check for it.
+#ifndef ASYNC_TCP_SSL_ENABLED
+#define ASYNC_TCP_SSL_ENABLED 0
+#endif
+
+// Number of TLS client sessions kept, to be resumed on the next connection to
+// the same host and port
+#ifndef CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE
+#define CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE 4
+#endif
+
+// Lifetime in seconds of the session tickets issued by secure servers
+#ifndef CONFIG_ASYNC_TCP_SSL_TICKET_LIFETIME
+#define CONFIG_ASYNC_TCP_SSL_TICKET_LIFETIME 86400
+#endif
+
+// If not 0, TLS handshakes run in a task of their own with this stack size,
+// 8192 being a reasonable value, so that their lengthy public key operations
+// do not hold up the other sockets of a worker.
+#ifndef CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK
+#define CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK 0
+#endif
+
+// Largest UDP datagram received in full by AsyncUDPSocket, longer ones being
+// truncated. Datagrams are received into a buffer of this size, allocated by
+// each worker on first use.
+#ifndef CONFIG_ASYNC_TCP_UDP_BUFFER_SIZE
+#define CONFIG_ASYNC_TCP_UDP_BUFFER_SIZE 1472
+#endif
+
+// Maximum number of datagrams received by one UDP socket per readable event,
+// so that a flood on one socket does not starve the others
+#ifndef CONFIG_ASYNC_TCP_UDP_RX_BATCH
+#define CONFIG_ASYNC_TCP_UDP_RX_BATCH 8
+#endif
+
+// Default size of the backlog of pending connections of a server
+#ifndef CONFIG_ASYNC_TCP_LISTEN_BACKLOG
+#define CONFIG_ASYNC_TCP_LISTEN_BACKLOG 8
+#endif
+
+// If > 0, the write queue of each client is a ring of this many buffers stored
+// inside the client, instead of a std::deque allocated from the heap. Once the
+// ring is full, space() is 0 and add() fails until a buffer is sent.
+#ifndef CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE
+#define CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE 0
+#endif
+
+// If disabled, clients do not have a mutex of their own protecting their
+// write queue, and take the lock of the task servicing them instead. This
+// saves a mutex per client, at the cost of add() and send() from other tasks
+// having to wait for that task to be idle.
+#ifndef CONFIG_ASYNC_TCP_WRITE_MUTEX
+#define CONFIG_ASYNC_TCP_WRITE_MUTEX 1
+#endif
+
+// If > 0, add() hands buffers over to the task servicing the client through a
+// lock-free ring of this many entries (a power of two), and space is accounted
+// atomically, so that writing from other tasks never waits for a lock. Copies
+// are then never appended to an already queued buffer, send() only wakes up
+// the task, and clients need no write mutex of their own.
+#ifndef CONFIG_ASYNC_TCP_WRITE_RING_SIZE
+#define CONFIG_ASYNC_TCP_WRITE_RING_SIZE 0
+#endif
+#define ASYNCSOCK_WRITE_MUTEX (CONFIG_ASYNC_TCP_WRITE_MUTEX && CONFIG_ASYNC_TCP_WRITE_RING_SIZE <= 0)
+
+// Number of preallocated client objects recycled for connections accepted by
+// servers. Clients beyond this number are allocated from the heap. Accepted
+// clients are still released with delete, as usual. Set to 0 to disable.
+#ifndef CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE
+#define CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE 0
+#endif
+
+// Resolution of socket timers (activity poll, RX and ACK timeouts), in
+// milliseconds, and default interval between activity polls of a client.
+#ifndef CONFIG_ASYNC_TCP_TIMER_RESOLUTION
+#define CONFIG_ASYNC_TCP_TIMER_RESOLUTION 10
+#endif
+
+// Data added with ASYNC_WRITE_FLAG_MORE is held back until data is added
+// without it, until at least CONFIG_ASYNC_TCP_CORK_SIZE bytes are held, or
+// for at most CONFIG_ASYNC_TCP_CORK_DELAY milliseconds.
+#ifndef CONFIG_ASYNC_TCP_CORK_SIZE
+#define CONFIG_ASYNC_TCP_CORK_SIZE TCP_MSS
+#endif
+#ifndef CONFIG_ASYNC_TCP_CORK_DELAY
+#define CONFIG_ASYNC_TCP_CORK_DELAY CONFIG_ASYNC_TCP_TIMER_RESOLUTION
+#endif
+#ifndef CONFIG_ASYNC_TCP_POLL_INTERVAL
+#define CONFIG_ASYNC_TCP_POLL_INTERVAL 125
+#endif
+
+// Number of asyncTcpSock tasks servicing sockets. Each task services its own
+// shard of sockets, and callbacks for sockets in different shards may run
+// concurrently. A callback should avoid operating on sockets from other
+// shards, since it would then have to wait for the other task.
+#ifndef CONFIG_ASYNC_TCP_WORKER_COUNT
+#define CONFIG_ASYNC_TCP_WORKER_COUNT 1
+#endif
+
+// Default priority and stack size in bytes of the asyncTcpSock tasks, and
+// whether their stacks are placed in PSRAM. All can be changed at runtime
+// with AsyncSocketBase::setTaskConfig(), before the tasks are started.
+#ifndef CONFIG_ASYNC_TCP_PRIORITY
+#define CONFIG_ASYNC_TCP_PRIORITY 3
+#endif
+#ifndef CONFIG_ASYNC_TCP_STACK_SIZE
+#define CONFIG_ASYNC_TCP_STACK_SIZE (8192 * 2)
+#endif
+#ifndef CONFIG_ASYNC_TCP_STACK_PSRAM
+#define CONFIG_ASYNC_TCP_STACK_PSRAM 0
+#endif
+
+// If enabled, the handlers of clients run on CONFIG_ASYNC_TCP_HANDLER_TASKS
+// asyncTcpHandler tasks instead of the asyncTcpSock tasks, so that a slow
+// handler does not hold up the other sockets. Each client sticks to one
+// handler task, which receives its events in order. Events are queued per
+// client, with up to CONFIG_ASYNC_TCP_DEFERRED_EVENTS waiting, acknowledgements
+// and polls merged into one already waiting. Received data is handed over in
+// pbufs, and the socket is not read while half of the queue holds data. The
+// handlers of servers, UDP sockets and stream sources are not deferred. A
+// client deleted from one of those while its own handler is running is freed
+// once that handler returns, so it must have been allocated with new.
+#ifndef CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+#define CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS 0
+#endif
+#ifndef CONFIG_ASYNC_TCP_DEFERRED_EVENTS
+#define CONFIG_ASYNC_TCP_DEFERRED_EVENTS 16
+#endif
+#ifndef CONFIG_ASYNC_TCP_HANDLER_TASKS
+#define CONFIG_ASYNC_TCP_HANDLER_TASKS 1
+#endif
+#ifndef CONFIG_ASYNC_TCP_HANDLER_PRIORITY
+#define CONFIG_ASYNC_TCP_HANDLER_PRIORITY (CONFIG_ASYNC_TCP_PRIORITY - 1)
+#endif
+#ifndef CONFIG_ASYNC_TCP_HANDLER_STACK_SIZE
+#define CONFIG_ASYNC_TCP_HANDLER_STACK_SIZE 8192
+#endif
+#ifndef CONFIG_ASYNC_TCP_HANDLER_CORE
+#define CONFIG_ASYNC_TCP_HANDLER_CORE -1
+#endif
+
+// Maximum number of socket objects (clients and servers, including closed
+// ones which still exist) that a single asyncTcpSock task can service.
+#ifndef CONFIG_ASYNC_TCP_MAX_SOCKETS
+#ifdef CONFIG_LWIP_MAX_SOCKETS
+#define CONFIG_ASYNC_TCP_MAX_SOCKETS (2 * CONFIG_LWIP_MAX_SOCKETS)
+#else
+#define CONFIG_ASYNC_TCP_MAX_SOCKETS 32
+#endif
+#endif
+
+// Size of the buffer used by each asyncTcpSock task to read from sockets
+#ifndef CONFIG_ASYNC_TCP_RX_BUFFER_SIZE
+#define CONFIG_ASYNC_TCP_RX_BUFFER_SIZE 1360
+#endif
+
+// If enabled, the read buffer is allocated in PSRAM when available
+#ifndef CONFIG_ASYNC_TCP_RX_BUFFER_PSRAM
+#define CONFIG_ASYNC_TCP_RX_BUFFER_PSRAM 0
+#endif
+
+// Maximum number of received bytes that the application may hold without
+// acknowledging (see AsyncClient::ackLater() and AsyncClient::onPacket()).
+// Once reached, the socket is no longer read until ack() is called, and the
+// TCP window eventually closes.
+#ifndef CONFIG_ASYNC_TCP_RX_UNACKED_MAX
+#define CONFIG_ASYNC_TCP_RX_UNACKED_MAX TCP_WND
+#endif
+
+// Maximum number of bytes read from a single socket on each readable event,
+// before moving on to other sockets. If 0, only one read is done per event.
+#ifndef CONFIG_ASYNC_TCP_RX_BUDGET
+#define CONFIG_ASYNC_TCP_RX_BUDGET TCP_WND
+#endif
+
+// Maximum number of queued buffers gathered into a single lwip_writev() call
+#ifndef CONFIG_ASYNC_TCP_WRITEV_MAX
+#define CONFIG_ASYNC_TCP_WRITEV_MAX 8
+#endif
+
+// If enabled, onAck is called once per completed buffer, instead of once per
+// writable event with the total length of all buffers completed.
+#ifndef CONFIG_ASYNC_TCP_ACK_PER_BUFFER
+#define CONFIG_ASYNC_TCP_ACK_PER_BUFFER 0
+#endif
+
+// If enabled, data is only considered sent (onAck is called and space() grows
+// back) once the remote side has acknowledged it, as in the original AsyncTCP.
+// Otherwise, data counts as sent as soon as the stack accepts it. Since
+// acknowledgements do not wake up select(), a client with data waiting for them
+// checks every CONFIG_ASYNC_TCP_ACK_CHECK_INTERVAL milliseconds from its timer,
+// besides whenever it is found writable or add() runs short of space. A client
+// waiting for onAck or space() to grow sends at most TCP_SND_BUF bytes per
+// interval. Without SIOCOUTQ, each check is a call into the TCP/IP thread,
+// or takes the TCPIP core lock, to read the send buffer of the TCP PCB of the
+// socket. The PCB is found through lwip/priv/sockets_priv.h and
+// lwip_socket_dbg_get_socket(), internals of lwIP 2.1 and later as built
+// into ESP-IDF: the build fails if they are missing. If the send queue cannot
+// be read, the bytes stay in flight until a later check, or the close.
+#ifndef CONFIG_ASYNC_TCP_ACK_TRACKING
+#define CONFIG_ASYNC_TCP_ACK_TRACKING 0
+#endif
+#ifndef CONFIG_ASYNC_TCP_ACK_CHECK_INTERVAL
+#define CONFIG_ASYNC_TCP_ACK_CHECK_INTERVAL CONFIG_ASYNC_TCP_TIMER_RESOLUTION
+#endif
+
+// Pool of fixed-size blocks used to hold data copied by add(), shared by all
+// clients. Set number of blocks to 0 to always allocate from the heap.
+#ifndef CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS
+#define CONFIG_ASYNC_TCP_WRITE_POOL_BLOCKS 8
+#endif
+#ifndef CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE
+#define CONFIG_ASYNC_TCP_WRITE_BLOCK_SIZE TCP_MSS
+#endif
+#ifndef CONFIG_ASYNC_TCP_WRITE_POOL_PSRAM
+#define CONFIG_ASYNC_TCP_WRITE_POOL_PSRAM 0
+#endif
+
+// Size of the staging buffer a client allocates on its first sendStream(),
+// and keeps until disconnected. With room for a whole send buffer, the next
+// chunks are read ahead while the previous ones are still being sent.
+#ifndef CONFIG_ASYNC_TCP_STREAM_BUFFER_SIZE
+#define CONFIG_ASYNC_TCP_STREAM_BUFFER_SIZE TCP_SND_BUF
 #endif
 
 class AsyncClient;
+class Print;
+class AsyncUDPSocket;
+class AsyncUDPSocketPacket;
+struct AsyncSocketWorker;
+struct AsyncDnsCache;
+struct AsyncClientCallbacks;
+struct AsyncEventHandler;
+#if ASYNC_TCP_SSL_ENABLED
+class AsyncTCP_TLS_Context;
+class AsyncTCP_TLS_ServerConfig;
+struct AsyncTLSHandshakeJob;
+#endif
 
 #define ASYNC_MAX_ACK_TIME 5000
 #define ASYNC_WRITE_FLAG_COPY 0x01 //will allocate new buffer to hold the data while sending (else will hold reference to the data given)
-#define ASYNC_WRITE_FLAG_MORE 0x02 //will not send PSH flag, meaning that there should be more data to be sent before the application should react.
+#define ASYNC_WRITE_FLAG_MORE 0x02 //will hold back the data until data without this flag is added, so that both go out in the same segments (see CONFIG_ASYNC_TCP_CORK_SIZE).
+#define ASYNC_STREAM_END (-1)     //returned by AsyncStreamSource::read() once all data was read
 
 typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
 typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
 typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
 typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
-//typedef std::function<void(void*, AsyncClient*, struct pbuf *pb)> AcPacketHandler;
+typedef std::function<void(void*, AsyncClient*, struct pbuf *pb)> AcPacketHandler;
 typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+typedef std::function<void(AsyncUDPSocketPacket & packet)> AcUdpPacketHandler;
 
-class AsyncSocketBase
+// Statistics of the write buffer pool
+typedef struct {
+    uint32_t blocks;          // Total number of blocks in pool, 0 if not allocated yet
+    uint32_t block_size;      // Size of each block, in bytes
+    uint32_t blocks_free;     // Blocks currently available
+    uint32_t blocks_min_free; // Lowest number of blocks available so far
+    uint32_t pool_allocs;     // Copies placed into a new block from the pool
+    uint32_t heap_allocs;     // Copies that had to be allocated from the heap
+    uint32_t coalesced;       // Copies appended to an already queued buffer
+} AsyncWritePoolStats;
+
+// Settings of the asyncTcpSock tasks, see AsyncSocketBase::setTaskConfig()
+typedef struct {
+    uint8_t priority;       // FreeRTOS priority of the service tasks
+    int core;               // Core the tasks run on, or -1 for any
+    uint32_t stack_size;    // Stack size of each task, in bytes
+    bool stack_psram;       // Allocate the stacks from PSRAM, if available
+} AsyncTaskConfig;
+
+// Number of buckets of the write latency histogram of AsyncTCPStats
+#define ASYNC_TCP_LATENCY_BUCKETS 12
+
+// Counters of all asyncTcpSock tasks together, since started or reset
+typedef struct {
+    uint32_t wakeups;           // Returns from select()
+    uint32_t loop_time_max;     // Longest pass through the event loop after select(), in us
+    uint64_t loop_time_total;   // Total time spent in the event loop after select(), in us
+    uint32_t dispatch_time_max; // Longest handling of the events of one socket, in us
+    uint64_t bytes_in;          // Bytes received by all clients
+    uint64_t bytes_out;         // Bytes written by all clients
+    uint32_t rx_eagain;         // Reads that found no data waiting
+    uint32_t tx_eagain;         // Writes that found the socket full
+    uint32_t accepts;           // Connections handed over to servers' client handlers
+    uint32_t refusals;          // Connections dropped by servers right after accepting
+    uint32_t queue_max;         // Most buffers queued for writing at once by one client
+    // Buffers by time from being queued to being written in full. Bucket 0
+    // counts those written within 1 ms, bucket i those taking from 2^(i-1)
+    // to 2^i ms, and the last one also all those taking longer.
+    uint32_t write_latency[ASYNC_TCP_LATENCY_BUCKETS];
+} AsyncTCPStats;
+
+// Counters of a single client since it was created. Byte counters wrap.
+typedef struct {
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t rx_eagain;
+    uint32_t tx_eagain;
+    uint16_t queue_depth;       // Buffers currently queued for writing
+    uint16_t queue_max;         // Most buffers queued at once
+    uint32_t write_latency_max; // Longest time from queueing a buffer to writing it, in ms
+    uint32_t dispatches;        // Passes of the event loop that handled events of the client
+    uint32_t dispatch_time_max; // Longest of these, in us, including callbacks
+    uint32_t dispatch_time_total;
+} AsyncClientStats;
+
+// Kinds of events recorded when CONFIG_ASYNC_TCP_TRACE is enabled
+enum AsyncTraceEventType : uint8_t {
+    ASYNC_TRACE_SELECT = 0,     // Service task waiting in select()
+    ASYNC_TRACE_WRITABLE,       // Socket handling a writable event
+    ASYNC_TRACE_READABLE,       // Socket handling a readable event
+    ASYNC_TRACE_POLL,           // Socket timer expired
+    ASYNC_TRACE_CONNECT,        // Socket handling a finished host name lookup
+    ASYNC_TRACE_WORKER_LOCK,    // Waiting for the lock of a service task
+    ASYNC_TRACE_WRITE_LOCK,     // Waiting for the write lock of a client
+    ASYNC_TRACE_DNS,            // Host name lookup result arrived, no duration
+    ASYNC_TRACE_EVENT_TYPES
+};
+
+// Task of events recorded from outside the service tasks
+#define ASYNC_TRACE_OTHER_TASK 0xff
+
+typedef struct {
+    uint32_t start;             // micros() when the event started
+    uint32_t duration;          // In us
+    int16_t fd;                 // Socket concerned, or -1
+    uint8_t type;               // One of AsyncTraceEventType
+    uint8_t task;               // Index of the service task, or ASYNC_TRACE_OTHER_TASK
+} AsyncTraceEvent;
+
+// Alternative to the on*() handlers, for applications that handle all events
+// of a client in one object. It is called directly, without the overhead of
+// std::function, and without the memory the handlers take up in each client.
+class AsyncClientListener
+{
+  public:
+    virtual ~AsyncClientListener() {}
+    virtual void onConnect(AsyncClient * client) {}
+    virtual void onDisconnect(AsyncClient * client) {}
+    virtual void onAck(AsyncClient * client, size_t len, uint32_t time) {}
+    virtual void onError(AsyncClient * client, int8_t error) {}
+    virtual void onData(AsyncClient * client, void * data, size_t len) {}
+    virtual void onTimeout(AsyncClient * client, uint32_t time) {}
+    virtual void onPoll(AsyncClient * client) {}
+};
+
+// Source of the data sent by AsyncClient::sendStream(). It is called from the
+// asyncTcpSock task, whenever the connection has room for more data.
+class AsyncStreamSource
+{
+  public:
+    virtual ~AsyncStreamSource() {}
+
+    // Copy up to len bytes into buf. Returns the number of bytes copied, 0 if
+    // none are available yet, or ASYNC_STREAM_END (or any error < 0) after the
+    // last byte. After 0, the source is asked again on the next poll, or
+    // right away after AsyncClient::send().
+    virtual int read(uint8_t * buf, size_t len) = 0;
+
+    // All data has been queued for sending, or else the connection is closing.
+    // The source is not used anymore, and may be deleted.
+    virtual void onStreamEnd(AsyncClient * client, bool complete) {}
+};
+
+// Bounded FIFO for many producers and a single consumer, which never takes a
+// lock. A producer claims a cell by advancing the enqueue position, and then
+// publishes it through the sequence number of the cell.
+template <typename T, size_t N>
+class AsyncWriteRing
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+  public:
+    AsyncWriteRing()
+    {
+        for (size_t i = 0; i < N; i++) _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Any task. Returns false if the ring is full.
+    bool push(const T & item)
+    {
+        uint32_t pos = _enqueue.load(std::memory_order_relaxed);
+        Cell * c;
+        for (;;) {
+            c = &_cells[pos % N];
+            int32_t dif = (int32_t)(c->seq.load(std::memory_order_acquire) - pos);
+            if (dif == 0) {
+                if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _enqueue.load(std::memory_order_relaxed);
+            }
+        }
+        c->item = item;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if no published item is available.
+    bool pop(T & item)
+    {
+        Cell * c = &_cells[_dequeue % N];
+        if ((int32_t)(c->seq.load(std::memory_order_acquire) - (_dequeue + 1)) < 0) return false;
+        item = c->item;
+        c->seq.store(_dequeue + N, std::memory_order_release);
+        _dequeue++;
+        return true;
+    }
+
+  private:
+    struct Cell {
+        std::atomic<uint32_t> seq;
+        T item;
+    };
+    Cell _cells[N];
+    std::atomic<uint32_t> _enqueue{0};
+    uint32_t _dequeue = 0;
+};
+
+// Fixed-capacity FIFO stored inline, providing the subset of the std::deque
+// interface used for client write queues.
+template <typename T, size_t N>
+class AsyncRingQueue
 {
-private:
-    static std::list<AsyncSocketBase *> & _getSocketBaseList(void);
+  public:
+    class iterator
+    {
+      public:
+        iterator(AsyncRingQueue * q, size_t i) : _q(q), _i(i) {}
+        T & operator*() { return _q->_items[(_q->_head + _i) % N]; }
+        T * operator->() { return &_q->_items[(_q->_head + _i) % N]; }
+        iterator operator++(int) { iterator r = *this; _i++; return r; }
+        iterator & operator++() { _i++; return *this; }
+        bool operator!=(const iterator & o) const { return _i != o._i; }
+      private:
+        AsyncRingQueue * _q;
+        size_t _i;
+    };
+
+    size_t size() const { return _count; }
+    bool full() const { return _count >= N; }
+    T & front() { return _items[_head]; }
+    T & back() { return _items[(_head + _count - 1) % N]; }
+    void push_back(const T & item) { _items[(_head + _count) % N] = item; _count++; }
+    void pop_front() { _head = (_head + 1) % N; _count--; }
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _count); }
+
+  private:
+    static_assert(N > 0 && N < 256, "ring size must be between 1 and 255");
+    T _items[N];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+};
 
+// Memory used by a client, in bytes
+typedef struct {
+    uint32_t object;        // Client object itself
+    uint32_t callbacks;     // Handlers set with on*(), if any
+    uint32_t write_queue;   // Write queue storage outside the object, see below
+    uint32_t write_data;    // Data copied by add() still queued, including pool blocks
+    uint32_t stream_buffer; // Staging buffer of sendStream(), if any
+    uint32_t total;
+} AsyncClientMemoryInfo;
+// With a write queue of unbounded size (CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE of 0),
+// write_queue counts the std::deque nodes needed for the buffers queued, of
+// the node size of libstdc++, and its smallest node map. It is an estimate,
+// since a deque may hold one node more, and keeps a map grown earlier.
+
+class AsyncSocketBase
+{
 protected:
     int _socket = -1;
+    uint32_t _sock_lastactivity = 0;
+
+    // Worker task servicing this socket
+    AsyncSocketWorker * _worker = NULL;
+
+    // Entry in the timer wheel of the worker, if the timer is running
+    AsyncSocketBase * _timer_next = NULL;
+    AsyncSocketBase * _timer_prev = NULL;
+    uint32_t _timer_expires = 0;
+    int16_t _timer_slot = -1;
+
+    // Slot in the registry of the worker
+    int16_t _slot = -1;
+
+#if CONFIG_ASYNC_TCP_STATS
+    // Time spent handling events of this socket, in us
+    uint32_t _dispatches = 0;
+    uint32_t _dispatch_time_max = 0;
+    uint32_t _dispatch_time_total = 0;
+#endif
+
+    // Not bit fields, since _isdnsfinished is written from the LWIP thread
     bool _selected = false;
     bool _isdnsfinished = false;
-    uint32_t _sock_lastactivity = 0;
 
     virtual void _sockIsReadable(void) {}     // Action to take on readable socket
     virtual bool _sockIsWriteable(void) { return false; }    // Action to take on writable socket
-    virtual void _sockPoll(void) {}           // Action to take on idle socket activity poll
+    virtual void _sockPoll(void) {}           // Action to take when deadline from _sockNextDeadline() is reached
     virtual void _sockDelayedConnect(void) {} // Action to take on DNS-resolve finished
 
+    virtual bool _sockWantsRead(void) { return true; }      // Should socket be monitored for reading?
+    virtual bool _sockWantsWrite(void) { return false; }    // Should socket be monitored for writing?
+    virtual bool _sockNextDeadline(uint32_t & deadline) { return false; }    // When is socket next due for _sockPoll(), if ever?
+
+    AsyncSocketWorker * _lockWorker(void);
+    void _unlockWorker(AsyncSocketWorker *);
+    void _rearmTimer(void);
+    static void _rebalance(AsyncSocketBase *);
+
 public:
     AsyncSocketBase(void);
     virtual ~AsyncSocketBase();
 
+    // Settings used to start the asyncTcpSock tasks, on the first connect()
+    // or listen. Returns false once the tasks are already running. A stack
+    // in PSRAM saves internal RAM, but then callbacks must not write to
+    // flash, and ESP-IDF must allow task stacks in external memory.
+    static bool setTaskConfig(const AsyncTaskConfig & config);
+    static void getTaskConfig(AsyncTaskConfig * config);
+
+    // Smallest amount of stack, in bytes, that has remained free in the
+    // given service task so far, or 0 if the task is not running
+    static uint32_t getStackHighWaterMark(uint8_t worker = 0);
+
+    // Snapshot of the counters of all service tasks, all 0 if disabled by
+    // CONFIG_ASYNC_TCP_STATS
+    static void getStats(AsyncTCPStats * stats);
+    static void resetStats(void);
+
+    // Same snapshot, along with the write pool statistics, as one JSON
+    // object, for benchmarks and monitoring to collect
+    static void printStats(Print & out);
+
+    // Tracing is on from the start if CONFIG_ASYNC_TCP_TRACE is enabled. The
+    // oldest events recorded are copied first, and are overwritten once the
+    // buffer is full. Stop tracing for a consistent read, since other tasks
+    // would otherwise keep overwriting events being read. printTrace()
+    // writes the events in the JSON format of Chrome's trace viewer
+    // (chrome://tracing or Perfetto), and readTrace() allows forwarding them
+    // to other tools, such as SystemView.
+    static void setTraceEnabled(bool enabled);
+    static size_t readTrace(AsyncTraceEvent * events, size_t max);
+    static void printTrace(Print & out);
+    static void clearTrace(void);
+
     friend void _asynctcpsock_task(void *);
+    friend struct AsyncSocketWorker;
 };
 
 class AsyncClient : public AsyncSocketBase
@@ -83,8 +678,34 @@ class AsyncClient : public AsyncSocketBase
     AsyncClient(int sockfd = -1);
     ~AsyncClient();
 
+#if CONFIG_ASYNC_TCP_CLIENT_POOL_SIZE > 0 || CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // Gives back pooled clients to the pool, and leaves clients destroyed
+    // while their handler task delivers to them for that task to free
+    static void operator delete(void * p);
+#endif
+
+#if ASYNC_TCP_SSL_ENABLED
+    // A secure connection is reported by onConnect once the TLS handshake is
+    // complete, and the connect timeout covers the handshake too.
+    bool connect(IPAddress ip, uint16_t port, bool secure = false);
+#if LWIP_IPV6
+    bool connect(IPv6Address ip, uint16_t port, bool secure = false);
+#endif
+    bool connect(const char* host, uint16_t port, bool secure = false);
+
+    // PEM strings for secure connections, which must remain valid until
+    // connected. Without a root CA, the server certificate is not verified.
+    void setRootCa(const char* rootca) { _root_ca = rootca; }
+    void setClientCert(const char* cli_cert) { _cli_cert = cli_cert; }
+    void setClientKey(const char* cli_key) { _cli_key = cli_key; }
+    bool isSecure() { return _tls != NULL; }
+#else
     bool connect(IPAddress ip, uint16_t port);
+#if LWIP_IPV6
+    bool connect(IPv6Address ip, uint16_t port);
+#endif
     bool connect(const char* host, uint16_t port);
+#endif
     void close(bool now = false);
 
     int8_t abort();
@@ -95,6 +716,12 @@ class AsyncClient : public AsyncSocketBase
     size_t add(const char* data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY);//add for sending
     bool send();
 
+    // Send all data of source, pulled into a staging buffer as the connection
+    // has room for it. Data should not be added otherwise until the source is
+    // notified of the end of the stream. Fails if not connected, or if
+    // another stream is still being sent.
+    bool sendStream(AsyncStreamSource * source);
+
     //write equals add()+send()
     size_t write(const char* data);
     size_t write(const char* data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY); //only when canSend() == true
@@ -108,106 +735,336 @@ class AsyncClient : public AsyncSocketBase
 
     uint32_t getRxTimeout();
     void setRxTimeout(uint32_t timeout);//no RX data timeout for the connection in seconds
+
+    uint32_t getPollInterval();
+    void setPollInterval(uint32_t interval);//interval between onPoll calls on an idle connection in milliseconds
+
+    uint32_t getConnectTimeout();
+    void setConnectTimeout(uint32_t timeout);//no connection established in milliseconds, reported as ERR_TIMEOUT
+
+    // Retry failed connection attempts, first after min_delay milliseconds,
+    // doubling up to max_delay after each failure, with random jitter. onError
+    // is called on every failure, and onDisconnect only once giving up after
+    // max_attempts retries (0 for no limit). A min_delay of 0 disables retries.
+    void setReconnect(uint32_t min_delay, uint32_t max_delay, uint8_t max_attempts = 0);
     void setNoDelay(bool nodelay);
     bool getNoDelay();
 
+    // IPv4 addresses are 0 if the connection is over IPv6, and vice versa.
+    // Clients accepted by a dual-stack server report IPv4 peers as IPv4.
     uint32_t getRemoteAddress();
     uint16_t getRemotePort();
     uint32_t getLocalAddress();
     uint16_t getLocalPort();
+    bool getRemoteAddr(ip_addr_t * addr);
+    bool getLocalAddr(ip_addr_t * addr);
+#if LWIP_IPV6
+    ip6_addr_t getRemoteAddress6();
+    ip6_addr_t getLocalAddress6();
+    bool isV6();
+#endif
 
     //compatibility
     IPAddress remoteIP();
     uint16_t  remotePort();
     IPAddress localIP();
     uint16_t  localPort();
+#if LWIP_IPV6
+    IPv6Address remoteIP6();
+    IPv6Address localIP6();
+#endif
 
     void onConnect(AcConnectHandler cb, void* arg = 0);     //on successful connect
     void onDisconnect(AcConnectHandler cb, void* arg = 0);  //disconnected
     void onAck(AcAckHandler cb, void* arg = 0);             //ack received
     void onError(AcErrorHandler cb, void* arg = 0);         //unsuccessful connect or error
     void onData(AcDataHandler cb, void* arg = 0);           //data received
+    void onPacket(AcPacketHandler cb, void* arg = 0);       //data received as pbuf, app must call ackPacket() on it
     void onTimeout(AcTimeoutHandler cb, void* arg = 0);     //ack timeout
-    void onPoll(AcConnectHandler cb, void* arg = 0);        //every 125ms when connected
+    void onPoll(AcConnectHandler cb, void* arg = 0);        //every poll interval when connected
+
+    // If set, the listener receives all events instead of the handlers above.
+    // It is removed on disconnection, like the handlers.
+    void setListener(AsyncClientListener * listener);
+
+    // Received data is acknowledged as soon as the onData callback returns,
+    // unless ackLater() is called from within the callback. In that case, the
+    // application should call ack() once it has consumed the data.
+    size_t ack(size_t len);
+    void ackLater() { _rx_ack_later = true; }
+    void ackPacket(struct pbuf * pb);
 
-    // The following functions are just for API compatibility and do nothing
-    size_t ack(size_t len)  { return len; }
-    void ackLater() {}
+    // Stop reading from the socket until resumeRecv(), so that the receive
+    // window closes and the sender is held back, instead of data piling up in
+    // RAM. The RX timeout does not apply meanwhile.
+    void pauseRecv();
+    void resumeRecv();
+    bool isRecvPaused() { return _rx_paused; }
 
     const char * errorToString(int8_t error);
+
+    // Bytes used by this client, optionally broken down in info
+    size_t getMemoryUsage(AsyncClientMemoryInfo * info = NULL);
+
+    static void getWritePoolStats(AsyncWritePoolStats * stats);
+
+    // Snapshot of the counters of this client, all 0 if disabled by
+    // CONFIG_ASYNC_TCP_STATS
+    void getStats(AsyncClientStats * stats);
 //    const char * stateToString();
 
   protected:
     bool _sockIsWriteable(void);
     void _sockIsReadable(void);
     void _sockPoll(void);
+    bool _sockNextDeadline(uint32_t & deadline);
     void _sockDelayedConnect(void);
+    bool _sockWantsRead(void);
+    bool _sockWantsWrite(void);
 
   private:
 
-    AcConnectHandler _connect_cb;
-    void* _connect_cb_arg;
-    AcConnectHandler _discard_cb;
-    void* _discard_cb_arg;
-    AcAckHandler _sent_cb;
-    void* _sent_cb_arg;
-    AcErrorHandler _error_cb;
-    void* _error_cb_arg;
-    AcDataHandler _recv_cb;
-    void* _recv_cb_arg;
-    AcTimeoutHandler _timeout_cb;
-    void* _timeout_cb_arg;
-    AcConnectHandler _poll_cb;
-    void* _poll_cb_arg;
+    AsyncClientListener * _listener = NULL;
+    AsyncClientCallbacks * _cbs = NULL;
+    AsyncClientCallbacks * _callbacks(void);
 
     uint32_t _rx_last_packet;
     uint32_t _rx_since_timeout;
     uint32_t _ack_timeout;
+    uint32_t _poll_interval = CONFIG_ASYNC_TCP_POLL_INTERVAL;
+
+    // Received bytes held by the application, not yet acknowledged
+    uint32_t _rx_unacked = 0;
+
+    // Bytes written into the socket, and not yet acknowledged by the remote
+    // side. Acknowledged bytes not yet matched against a completed buffer.
+    uint32_t _tx_inflight = 0;
+    uint32_t _tx_acked = 0;
+    uint32_t _ack_check_at = 0;
+    bool _ack_check_failed = false;     // Already logged
+    bool _sockAwaitingAck(void);
+#if CONFIG_ASYNC_TCP_ACK_TRACKING
+    bool _checkAcked(void);
+    bool _refreshAcked(void);
+    void _armAckCheck(void);
+#endif
+
+    // Endpoints of the connection, captured on accept and connect, or else
+    // queried once on first use
+    ip_addr_t _peer_addr;
+    ip_addr_t _local_addr;
+    uint16_t _peer_port = 0;
+    uint16_t _local_port = 0;
+    bool _peer_cached = false;
+    bool _local_cached = false;
+    void _setPeer(const struct sockaddr * addr);
+    void _cachePeer(void);
+    void _cacheLocal(void);
+
+    bool _connect(const ip_addr_t & addr, uint16_t port);
+    void _connected(void);
+    ssize_t _sockRead(uint8_t * buf, size_t len);
 
     // Used on asynchronous DNS resolving scenario - I do not want to connect()
     // from the LWIP thread itself.
     struct ip_addr _connect_addr;
     uint16_t _connect_port = 0;
+
+    // Address of the other family for the same host, if any, and connection
+    // attempt to it, racing with the one on _socket
+    struct ip_addr _connect_alt;
+    int _alt_socket = -1;
+    uint32_t _connect_started = 0;
+    uint32_t _connect_timeout = CONFIG_ASYNC_TCP_CONNECT_TIMEOUT;
+
+    // Automatic retries of failed connection attempts. Host names are kept,
+    // to be looked up again.
+    uint32_t _reconnect_min = 0;
+    uint32_t _reconnect_max = 0;
+    uint32_t _reconnect_at = 0;
+    uint8_t _reconnect_max_attempts = 0;
+    uint8_t _reconnect_attempts = 0;
+    bool _reconnect_pending = false;
+    char * _reconnect_host = NULL;
+    void _connectFailed(int8_t err);
+    bool _scheduleReconnect(void);
+    void _reconnect(void);
+    bool _raceConnect(uint32_t now);
+    bool _failOverConnect(void);
+    void _switchToAltSocket(void);
+    void _closeAltSocket(void);
+
+#if ASYNC_TCP_SSL_ENABLED
+    // TLS session over the socket, set up once connected, in state 3 until
+    // its handshake is complete. Accepted clients share the server settings.
+    AsyncTCP_TLS_Context * _tls = NULL;
+    std::shared_ptr<AsyncTCP_TLS_ServerConfig> _tls_server;
+    const char * _root_ca = NULL;
+    const char * _cli_cert = NULL;
+    const char * _cli_key = NULL;
+    char * _tls_host = NULL;
+    bool _secure = false;
+#if CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    AsyncTLSHandshakeJob * _tls_job = NULL;
+#endif
+    int _startTLS(void);
+    void _tlsHandshake(void);
+    void _tlsFinished(int r);
+    bool _releaseTLS(bool notify);
+    bool _flushWriteQueueTLS(void);
+#endif
+    // Decrypted data is read in full regardless of the read budget, since it
+    // would not make the socket readable again
+    bool _tlsPending(void);
+
+    // Next client waiting for the same host name lookup
+    AsyncClient * _dns_next = NULL;
     //const char * _connect_dnsname = NULL;
 
+    // Simulation of connection state
+    uint8_t _conn_state;
+
+    // Flags are kept together, but not as bit fields, since they are written
+    // from different tasks under different locks.
+    bool _rx_ack_later = false;
+    bool _rx_nomem = false;
+    bool _rx_paused = false;
+    bool _ack_timeout_signaled = false;
+
     // The following private struct represents a buffer enqueued with the add()
     // method. Each of these buffers are flushed whenever the socket becomes
     // writable
     typedef struct {
       uint8_t * data;     // Pointer to data queued for write
-      uint32_t  length;   // Length of data queued for write
-      uint32_t  written;  // Length of data written to socket so far
       uint32_t  queued_at;// Timestamp at which this data buffer was queued
       uint32_t  written_at; // Timestamp at which this data buffer was completely written
-      int       write_errno;  // If != 0, errno value while writing this buffer
-      bool      owned;    // If true, we malloc'ed the data and should be freed after completely written.
-                          // If false, app owns the memory and should ensure it remains valid until acked
+      uint16_t  length;   // Length of data queued for write
+      uint16_t  written;  // Length of data written to socket so far
+      uint16_t  capacity; // Allocated size of data, more copies can be appended up to this size
+      uint8_t   write_errno;  // If != 0, errno value while writing this buffer
+      uint8_t   owned : 1;    // If set, we allocated the data and should be freed after completely written.
+                              // If not, app owns the memory and should ensure it remains valid until acked
+      uint8_t   pooled : 1;   // If set, data is a block from the write buffer pool
+      uint8_t   streamed : 1; // If set, data is in the staging buffer of sendStream()
+      uint8_t   corked : 1;   // If set, added with ASYNC_WRITE_FLAG_MORE and held back for now
     } queued_writebuf;
 
     // Queue of buffers to write to socket
+#if ASYNCSOCK_WRITE_MUTEX
     SemaphoreHandle_t _write_mutex;
+    StaticSemaphore_t _write_mutex_buf;
+#endif
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+    // Buffers added, not yet moved into the write queue by the asyncTcpSock task
+    AsyncWriteRing<queued_writebuf, CONFIG_ASYNC_TCP_WRITE_RING_SIZE> _writeRing;
+    void _drainWriteRing(void);
+#endif
+#if CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE > 0
+    AsyncRingQueue<queued_writebuf, CONFIG_ASYNC_TCP_WRITE_QUEUE_SIZE> _writeQueue;
+#else
     std::deque<queued_writebuf> _writeQueue;
-    bool _ack_timeout_signaled = false;
+#endif
+    void _writeLock(void);
+    void _writeUnlock(void);
+#if CONFIG_ASYNC_TCP_STATS
+    AsyncClientStats _stats;
+    void _statQueued(void);
+#endif
+
+    // Bytes held back at the end of the write queue by ASYNC_WRITE_FLAG_MORE,
+    // and since when
+    uint32_t _cork_len = 0;
+    uint32_t _cork_since = 0;
+    bool _cork(size_t len, bool more);
+    bool _uncork(void);
+    bool _writePending(void);
 
     // Remaining space willing to queue for writing
+#if CONFIG_ASYNC_TCP_WRITE_RING_SIZE > 0
+    std::atomic<uint32_t> _writeSpaceRemaining;
+#else
     uint32_t _writeSpaceRemaining;
+#endif
 
-    // Simulation of connection state
-    uint8_t _conn_state;
+    // Source of sendStream(), and its staging buffer. Queued buffers point into
+    // the buffer, filled at the head and released in order from the tail, with
+    // a gap left at its end whenever the head wraps around.
+    AsyncStreamSource * _stream = NULL;
+    uint8_t * _stream_buf = NULL;
+    uint32_t _stream_head = 0;
+    uint32_t _stream_tail = 0;
+    uint32_t _stream_used = 0;
+    bool _stream_wait = false;
+    bool _pullStream(void);
+    uint32_t _streamSpace(uint32_t & off);
+    void _releaseStream(const queued_writebuf & qwb);
+    void _endStream(bool complete);
 
     void _error(int8_t err);
     void _close(void);
     void _removeAllCallbacks(void);
+    void _notifyConnect(void);
+    bool _notifyAck(size_t len, uint32_t time);
+    void _notifyError(int8_t err);
+    void _notifyTimeout(uint32_t time);
+    void _notifyPoll(void);
+    void _notifyDisconnect(void);
+
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    // Events waiting for the handler task of this client, protected by the
+    // spinlock of the handler. Deferral is turned off once the client is
+    // being destroyed, and events are then delivered right away.
+    typedef struct {
+      uint8_t   type;
+      int8_t    error;
+      uint32_t  len;
+      uint32_t  time;
+      struct pbuf * pb;
+    } deferred_event;
+    deferred_event _deferred[CONFIG_ASYNC_TCP_DEFERRED_EVENTS];
+    uint8_t _deferred_head = 0;
+    uint8_t _deferred_count = 0;
+    uint8_t _deferred_data = 0;     // Events holding received data
+    uint8_t _deferred_handler = 0;
+    bool _deferred_queued = false;  // Waiting in the queue of the handler task
+    bool _deferred_blocked = false; // Reading held back until data is delivered
+    bool _deferred_off = false;
+    AsyncEventHandler * _handler(void);
+    bool _defer(uint8_t type, int8_t error = 0, uint32_t len = 0, uint32_t time = 0, struct pbuf * pb = NULL);
+    bool _deferRoom(void);
+    void _runDeferred(AsyncEventHandler * h);
+    void _deliver(const deferred_event & ev);
+    void _deliverData(struct pbuf * pb);
+    bool _cancelDeferred(void);
+    bool _handOverDying(void);
+#endif
     bool _flushWriteQueue(void);
     void _clearWriteQueue(void);
+    void _freeWriteBuffer(queued_writebuf & qwb);
 
-    friend void _tcpsock_dns_found(const char * name, struct ip_addr * ipaddr, void * arg);
+    // Set on clients accepted by a server, to count against its limit
+    std::shared_ptr<std::atomic<uint16_t>> _server_clients;
+    void _releaseServerSlot(void);
+
+    friend struct AsyncDnsCache;
+    friend class AsyncServer;
+#if ASYNC_TCP_SSL_ENABLED && CONFIG_ASYNC_TCP_SSL_HANDSHAKE_TASK_STACK > 0
+    friend void _asyncsock_tls_task(void *);
+#endif
+#if CONFIG_ASYNC_TCP_DEFERRED_CALLBACKS
+    friend void _asyncsock_handler_task(void *);
+#endif
 };
 
 class AsyncServer : public AsyncSocketBase
 {
   public:
     AsyncServer(IPAddress addr, uint16_t port);
+#if LWIP_IPV6
+    AsyncServer(IPv6Address addr, uint16_t port);
+#endif
+    // Without an address, listens on all addresses, both IPv4 and IPv6 when
+    // lwIP is built with IPv6 support
     AsyncServer(uint16_t port);
     ~AsyncServer();
     void onClient(AcConnectHandler cb, void* arg);
@@ -218,17 +1075,129 @@ class AsyncServer : public AsyncSocketBase
     bool getNoDelay() { return _noDelay; }
     uint8_t status();
 
+    // Admission control. New connections are refused with a RST while there
+    // are already max clients connected, or while free heap is below minimum.
+    // A value of 0 disables each limit. Backlog only applies on next begin().
+    void setBacklog(uint8_t backlog) { _backlog = backlog; }
+    void setMaxClients(uint16_t max) { _max_clients = max; }
+    void setMinFreeHeap(size_t min) { _min_free_heap = min; }
+    uint16_t getClientCount();
+
+#if ASYNC_TCP_SSL_ENABLED
+    // Accepts TLS connections only, with a certificate and private key given
+    // as PEM strings. Resumption is offered through session tickets.
+    void beginSecure(const char * cert, const char * private_key, const char * password = NULL);
+#endif
+
   protected:
     uint16_t _port;
     IPAddress _addr;
+#if LWIP_IPV6
+    IPv6Address _addr6;
+    bool _bind6 = false;
+#endif
 
     bool _noDelay;
     AcConnectHandler _connect_cb;
     void* _connect_cb_arg;
 
+    uint8_t _backlog = CONFIG_ASYNC_TCP_LISTEN_BACKLOG;
+    uint16_t _max_clients = 0;
+    size_t _min_free_heap = 0;
+
+    // Number of accepted clients still connected. Shared with the clients,
+    // since they might outlive the server.
+    std::shared_ptr<std::atomic<uint16_t>> _clients;
+
+#if ASYNC_TCP_SSL_ENABLED
+    std::shared_ptr<AsyncTCP_TLS_ServerConfig> _tls_config;
+#endif
+
     // Listening socket is readable on incoming connection
     void _sockIsReadable(void);
 };
 
+// Datagram received by an AsyncUDPSocket. Its data is only valid within the
+// onPacket handler, and should be copied to be kept.
+class AsyncUDPSocketPacket
+{
+  public:
+    uint8_t * data() { return _data; }
+    size_t length() { return _len; }
+
+    IPAddress remoteIP();
+    uint16_t remotePort() { return _port; }
+    bool getRemoteAddr(ip_addr_t * addr);
+#if LWIP_IPV6
+    IPv6Address remoteIP6();
+    bool isIPv6();
+#endif
+
+    // Send a datagram back to the sender
+    size_t write(const uint8_t * data, size_t len);
+
+  private:
+    AsyncUDPSocketPacket(AsyncUDPSocket * udp, uint8_t * data, size_t len, const struct sockaddr * from);
+
+    AsyncUDPSocket * _udp;
+    uint8_t * _data;
+    size_t _len;
+    ip_addr_t _addr;
+    uint16_t _port;
+
+    friend class AsyncUDPSocket;
+};
+
+// Datagram socket serviced by the same tasks as the TCP sockets. Named apart
+// from the AsyncUDP library of the Arduino core, whose API it follows, so that
+// both can be used side by side. Sending never blocks, and fails if lwIP has
+// no room for the datagram.
+class AsyncUDPSocket : public AsyncSocketBase
+{
+  public:
+    AsyncUDPSocket();
+    ~AsyncUDPSocket();
+
+    void onPacket(AcUdpPacketHandler cb) { _packet_cb = cb; }
+
+    // Without an address, listens on all addresses, both IPv4 and IPv6 when
+    // lwIP is built with IPv6 support
+    bool listen(uint16_t port);
+    bool listen(const IPAddress & addr, uint16_t port);
+    bool listenMulticast(const IPAddress & addr, uint16_t port, uint8_t ttl = 1);
+
+    // Sets the default destination of write(), and only receives from it
+    bool connect(const IPAddress & addr, uint16_t port);
+#if LWIP_IPV6
+    bool connect(const IPv6Address & addr, uint16_t port);
+#endif
+    void close();
+    bool connected() { return _connected; }
+    bool listening() { return _socket != -1; }
+
+    size_t write(const uint8_t * data, size_t len);
+    size_t writeTo(const uint8_t * data, size_t len, const IPAddress & addr, uint16_t port);
+#if LWIP_IPV6
+    size_t writeTo(const uint8_t * data, size_t len, const IPv6Address & addr, uint16_t port);
+#endif
+    size_t writeTo(const uint8_t * data, size_t len, const ip_addr_t * addr, uint16_t port);
+    // From a socket on IPv6, sent from a port of its own over IPv4
+    size_t broadcastTo(const uint8_t * data, size_t len, uint16_t port);
+
+  protected:
+    AcUdpPacketHandler _packet_cb;
+    bool _connected = false;
+    bool _v6 = false;
+#if LWIP_IPV6
+    // IPv4 socket that broadcasts from an IPv6 socket go out through
+    AsyncUDPSocket * _bcast = NULL;
+#endif
+
+    bool _open(const ip_addr_t & addr, uint16_t port);
+    bool _connect(const ip_addr_t & addr, uint16_t port);
+
+    // Socket is readable with one or more datagrams
+    void _sockIsReadable(void);
+};
 
 #endif /* ASYNCTCP_H_ */
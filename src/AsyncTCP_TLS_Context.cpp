@@ -0,0 +1,365 @@
+/*
+  TLS layer of the asynchronous TCP library for Espressif MCUs, using
+  BSD sockets and mbedTLS.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "Arduino.h"
+
+#include "AsyncTCP_TLS_Context.h"
+
+#if ASYNC_TCP_SSL_ENABLED
+
+#include <lwip/sockets.h>
+#include "mbedtls/net_sockets.h"
+
+static const char * _asyncsock_tls_pers = "AsyncTCPSock";
+
+// Sessions of the last client connections, to resume them on the next
+// connection to the same host and port
+static struct {
+    struct {
+        char host[CONFIG_ASYNC_TCP_DNS_NAME_MAX];
+        uint16_t port;
+        uint32_t used;
+        bool valid;
+        mbedtls_ssl_session session;
+    } entries[CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE];
+    uint32_t clock;
+    SemaphoreHandle_t mutex;
+    StaticSemaphore_t mutex_buf;
+} _asyncsock_tls_sessions;
+static portMUX_TYPE _asyncsock_tls_sessions_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Sessions are copied with allocations, so the cache is protected by a mutex
+// rather than by a spinlock. It is created on first use.
+static void _asyncsock_tls_sessions_lock(void)
+{
+    portENTER_CRITICAL(&_asyncsock_tls_sessions_mux);
+    if (_asyncsock_tls_sessions.mutex == NULL) {
+        for (int i = 0; i < CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++) {
+            mbedtls_ssl_session_init(&_asyncsock_tls_sessions.entries[i].session);
+        }
+        _asyncsock_tls_sessions.mutex = xSemaphoreCreateMutexStatic(&_asyncsock_tls_sessions.mutex_buf);
+    }
+    portEXIT_CRITICAL(&_asyncsock_tls_sessions_mux);
+    xSemaphoreTake(_asyncsock_tls_sessions.mutex, portMAX_DELAY);
+}
+
+static void _asyncsock_tls_sessions_unlock(void)
+{
+    xSemaphoreGive(_asyncsock_tls_sessions.mutex);
+}
+
+static int _asyncsock_tls_parse_key(mbedtls_pk_context * pk, const char * key, const char * password,
+    mbedtls_ctr_drbg_context * drbg)
+{
+    size_t pwlen = (password != NULL) ? strlen(password) : 0;
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    return mbedtls_pk_parse_key(pk, (const unsigned char *)key, strlen(key) + 1,
+        (const unsigned char *)password, pwlen, mbedtls_ctr_drbg_random, drbg);
+#else
+    return mbedtls_pk_parse_key(pk, (const unsigned char *)key, strlen(key) + 1,
+        (const unsigned char *)password, pwlen);
+#endif
+}
+
+AsyncTCP_TLS_ServerConfig::AsyncTCP_TLS_ServerConfig(void)
+{
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_x509_crt_init(&_cert);
+    mbedtls_pk_init(&_key);
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_init(&_ticket);
+    _ticket_mutex = xSemaphoreCreateMutex();
+#endif
+}
+
+AsyncTCP_TLS_ServerConfig::~AsyncTCP_TLS_ServerConfig()
+{
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free(&_ticket);
+    if (_ticket_mutex) vSemaphoreDelete(_ticket_mutex);
+#endif
+    mbedtls_pk_free(&_key);
+    mbedtls_x509_crt_free(&_cert);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+int AsyncTCP_TLS_ServerConfig::init(const char * cert, const char * key, const char * password)
+{
+    int r = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+        (const unsigned char *)_asyncsock_tls_pers, strlen(_asyncsock_tls_pers));
+    if (r != 0) return r;
+
+    r = mbedtls_x509_crt_parse(&_cert, (const unsigned char *)cert, strlen(cert) + 1);
+    if (r != 0) return r;
+    r = _asyncsock_tls_parse_key(&_key, key, password, &_drbg);
+    if (r != 0) return r;
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+    // Without tickets, connections can still be made, just not resumed
+    if (_ticket_mutex != NULL) {
+        _tickets = (mbedtls_ssl_ticket_setup(&_ticket, mbedtls_ctr_drbg_random, &_drbg,
+            MBEDTLS_CIPHER_AES_256_GCM, CONFIG_ASYNC_TCP_SSL_TICKET_LIFETIME) == 0);
+    }
+    if (!_tickets) log_w("session tickets disabled");
+#endif
+    return 0;
+}
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+// The ticket context, and the random generator renewing its keys, are only
+// used under the mutex, whatever the threading support of mbedTLS
+int AsyncTCP_TLS_ServerConfig::_ticketWrite(void * p, const mbedtls_ssl_session * session,
+    unsigned char * start, const unsigned char * end, size_t * tlen, uint32_t * lifetime)
+{
+    AsyncTCP_TLS_ServerConfig * cfg = (AsyncTCP_TLS_ServerConfig *)p;
+    xSemaphoreTake(cfg->_ticket_mutex, portMAX_DELAY);
+    int r = mbedtls_ssl_ticket_write(&cfg->_ticket, session, start, end, tlen, lifetime);
+    xSemaphoreGive(cfg->_ticket_mutex);
+    return r;
+}
+
+int AsyncTCP_TLS_ServerConfig::_ticketParse(void * p, mbedtls_ssl_session * session, unsigned char * buf, size_t len)
+{
+    AsyncTCP_TLS_ServerConfig * cfg = (AsyncTCP_TLS_ServerConfig *)p;
+    xSemaphoreTake(cfg->_ticket_mutex, portMAX_DELAY);
+    int r = mbedtls_ssl_ticket_parse(&cfg->_ticket, session, buf, len);
+    xSemaphoreGive(cfg->_ticket_mutex);
+    return r;
+}
+#endif
+
+AsyncTCP_TLS_Context::AsyncTCP_TLS_Context(void)
+{
+    _host[0] = '\0';
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_x509_crt_init(&_cli_cert);
+    mbedtls_pk_init(&_cli_key);
+}
+
+AsyncTCP_TLS_Context::~AsyncTCP_TLS_Context()
+{
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_pk_free(&_cli_key);
+    mbedtls_x509_crt_free(&_cli_cert);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+// Each connection has a random generator of its own, so that handshakes need
+// no locking in whichever task they run
+int AsyncTCP_TLS_Context::_seed(void)
+{
+    return mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+        (const unsigned char *)_asyncsock_tls_pers, strlen(_asyncsock_tls_pers));
+}
+
+int AsyncTCP_TLS_Context::_setup(void)
+{
+    mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+    int r = mbedtls_ssl_setup(&_ssl, &_conf);
+    if (r != 0) return r;
+    mbedtls_ssl_set_bio(&_ssl, this, _bioSend, _bioRecv, NULL);
+    return 0;
+}
+
+int AsyncTCP_TLS_Context::startClient(int sock, const char * host, uint16_t port,
+    const char * root_ca, const char * cli_cert, const char * cli_key)
+{
+    _fd = sock;
+    _port = port;
+    if (host != NULL) {
+        strncpy(_host, host, sizeof(_host) - 1);
+        _host[sizeof(_host) - 1] = '\0';
+    }
+
+    int r = _seed();
+    if (r != 0) return r;
+    r = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT,
+        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (r != 0) return r;
+
+    if (root_ca != NULL) {
+        r = mbedtls_x509_crt_parse(&_ca, (const unsigned char *)root_ca, strlen(root_ca) + 1);
+        if (r != 0) return r;
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, NULL);
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        log_w("no root CA, server certificate not verified");
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+    if (cli_cert != NULL && cli_key != NULL) {
+        r = mbedtls_x509_crt_parse(&_cli_cert, (const unsigned char *)cli_cert, strlen(cli_cert) + 1);
+        if (r != 0) return r;
+        r = _asyncsock_tls_parse_key(&_cli_key, cli_key, NULL, &_drbg);
+        if (r != 0) return r;
+        r = mbedtls_ssl_conf_own_cert(&_conf, &_cli_cert, &_cli_key);
+        if (r != 0) return r;
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+    r = _setup();
+    if (r != 0) return r;
+
+    // Server name indication, and name checked against the certificate
+    if (_host[0] != '\0') {
+        r = mbedtls_ssl_set_hostname(&_ssl, _host);
+        if (r != 0) return r;
+    }
+
+    _resumable = (_host[0] != '\0');
+    _restoreSession();
+    return 0;
+}
+
+int AsyncTCP_TLS_Context::startServer(int sock, std::shared_ptr<AsyncTCP_TLS_ServerConfig> config)
+{
+    _fd = sock;
+    _server = config;
+
+    int r = _seed();
+    if (r != 0) return r;
+    r = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_SERVER,
+        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (r != 0) return r;
+
+    r = mbedtls_ssl_conf_own_cert(&_conf, &_server->_cert, &_server->_key);
+    if (r != 0) return r;
+#if defined(MBEDTLS_SSL_TICKET_C)
+    if (_server->_tickets) {
+        mbedtls_ssl_conf_session_tickets_cb(&_conf,
+            AsyncTCP_TLS_ServerConfig::_ticketWrite, AsyncTCP_TLS_ServerConfig::_ticketParse, _server.get());
+    }
+#endif
+    return _setup();
+}
+
+int AsyncTCP_TLS_Context::handshake(void)
+{
+    int r = mbedtls_ssl_handshake(&_ssl);
+    _want_write = (r == MBEDTLS_ERR_SSL_WANT_WRITE);
+    if (r == 0) _saveSession();
+    return r;
+}
+
+int AsyncTCP_TLS_Context::write(const uint8_t * data, size_t len)
+{
+    int r = mbedtls_ssl_write(&_ssl, data, len);
+    _want_write = (r == MBEDTLS_ERR_SSL_WANT_WRITE);
+    return r;
+}
+
+int AsyncTCP_TLS_Context::read(uint8_t * data, size_t len)
+{
+    return mbedtls_ssl_read(&_ssl, data, len);
+}
+
+size_t AsyncTCP_TLS_Context::pending(void)
+{
+    return mbedtls_ssl_get_bytes_avail(&_ssl);
+}
+
+void AsyncTCP_TLS_Context::closeNotify(void)
+{
+    mbedtls_ssl_close_notify(&_ssl);
+}
+
+// Keep the session of a completed client handshake, replacing the one for the
+// same host and port, or else the least recently used one
+void AsyncTCP_TLS_Context::_saveSession(void)
+{
+    if (!_resumable) return;
+
+    _asyncsock_tls_sessions_lock();
+    int victim = 0;
+    for (int i = 0; i < CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++) {
+        auto & e = _asyncsock_tls_sessions.entries[i];
+        if (e.valid && e.port == _port && strcmp(e.host, _host) == 0) {
+            victim = i;
+            break;
+        }
+        auto & v = _asyncsock_tls_sessions.entries[victim];
+        if (v.valid && (!e.valid || (int32_t)(e.used - v.used) < 0)) victim = i;
+    }
+
+    auto & e = _asyncsock_tls_sessions.entries[victim];
+    mbedtls_ssl_session_free(&e.session);
+    mbedtls_ssl_session_init(&e.session);
+    e.valid = (mbedtls_ssl_get_session(&_ssl, &e.session) == 0);
+    if (e.valid) {
+        strcpy(e.host, _host);
+        e.port = _port;
+        e.used = ++_asyncsock_tls_sessions.clock;
+    }
+    _asyncsock_tls_sessions_unlock();
+}
+
+void AsyncTCP_TLS_Context::_restoreSession(void)
+{
+    if (!_resumable) return;
+
+    _asyncsock_tls_sessions_lock();
+    for (int i = 0; i < CONFIG_ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++) {
+        auto & e = _asyncsock_tls_sessions.entries[i];
+        if (e.valid && e.port == _port && strcmp(e.host, _host) == 0) {
+            // A session the server no longer knows just means a full handshake
+            if (mbedtls_ssl_set_session(&_ssl, &e.session) == 0) {
+                e.used = ++_asyncsock_tls_sessions.clock;
+            }
+            break;
+        }
+    }
+    _asyncsock_tls_sessions_unlock();
+}
+
+// Records go straight between mbedTLS and the socket
+int AsyncTCP_TLS_Context::_bioSend(void * ctx, const unsigned char * buf, size_t len)
+{
+    AsyncTCP_TLS_Context * tls = (AsyncTCP_TLS_Context *)ctx;
+    errno = 0;
+    ssize_t r = lwip_write(tls->_fd, buf, len);
+    if (r >= 0) return r;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (errno == ECONNRESET || errno == EPIPE) return MBEDTLS_ERR_NET_CONN_RESET;
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int AsyncTCP_TLS_Context::_bioRecv(void * ctx, unsigned char * buf, size_t len)
+{
+    AsyncTCP_TLS_Context * tls = (AsyncTCP_TLS_Context *)ctx;
+    errno = 0;
+    ssize_t r = lwip_read(tls->_fd, buf, len);
+    if (r >= 0) return r;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_READ;
+    if (errno == ECONNRESET) return MBEDTLS_ERR_NET_CONN_RESET;
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+}
+
+#endif /* ASYNC_TCP_SSL_ENABLED */
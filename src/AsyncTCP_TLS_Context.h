@@ -0,0 +1,129 @@
+/*
+  TLS layer of the asynchronous TCP library for Espressif MCUs, using
+  BSD sockets and mbedTLS.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ASYNCTCP_TLS_CONTEXT_H_
+#define ASYNCTCP_TLS_CONTEXT_H_
+
+#include "AsyncTCP.h"
+
+#if ASYNC_TCP_SSL_ENABLED
+
+#include <memory>
+
+#include "mbedtls/version.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#if defined(MBEDTLS_SSL_TICKET_C)
+#include "mbedtls/ssl_ticket.h"
+#endif
+
+// Certificate and key of a secure server, and the keys of the session tickets
+// it issues. Shared by all the connections the server accepts, which might
+// outlive it.
+class AsyncTCP_TLS_ServerConfig
+{
+  public:
+    AsyncTCP_TLS_ServerConfig(void);
+    ~AsyncTCP_TLS_ServerConfig();
+
+    // Certificate and key are PEM strings. Returns 0, or an mbedTLS error.
+    int init(const char * cert, const char * key, const char * password);
+
+  private:
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_x509_crt _cert;
+    mbedtls_pk_context _key;
+#if defined(MBEDTLS_SSL_TICKET_C)
+    // Tickets are written and parsed by handshakes running in any task
+    mbedtls_ssl_ticket_context _ticket;
+    SemaphoreHandle_t _ticket_mutex = NULL;
+    bool _tickets = false;
+    static int _ticketWrite(void * p, const mbedtls_ssl_session * session,
+        unsigned char * start, const unsigned char * end, size_t * tlen, uint32_t * lifetime);
+    static int _ticketParse(void * p, mbedtls_ssl_session * session, unsigned char * buf, size_t len);
+#endif
+
+    friend class AsyncTCP_TLS_Context;
+};
+
+// TLS session over a connected non-blocking socket. Records are written to and
+// read from the socket directly. Only one task may use a context at a time.
+class AsyncTCP_TLS_Context
+{
+  public:
+    AsyncTCP_TLS_Context(void);
+    ~AsyncTCP_TLS_Context();
+
+    // Certificates and keys are PEM strings, or NULL. Without a root CA, the
+    // server certificate is not verified. A session saved from a previous
+    // connection to the same host and port is resumed if possible.
+    int startClient(int sock, const char * host, uint16_t port,
+        const char * root_ca, const char * cli_cert, const char * cli_key);
+    int startServer(int sock, std::shared_ptr<AsyncTCP_TLS_ServerConfig> config);
+
+    // Returns 0 once the handshake is complete, MBEDTLS_ERR_SSL_WANT_READ or
+    // MBEDTLS_ERR_SSL_WANT_WRITE to be called again when the socket is ready,
+    // or an mbedTLS error.
+    int handshake(void);
+    bool wantsWrite(void) { return _want_write; }
+
+    // Same results as mbedtls_ssl_write() and mbedtls_ssl_read(). After
+    // MBEDTLS_ERR_SSL_WANT_WRITE, a write must be retried with the same data.
+    int write(const uint8_t * data, size_t len);
+    int read(uint8_t * data, size_t len);
+
+    // Decrypted bytes ready to be read without reading the socket again
+    size_t pending(void);
+
+    // Best effort, since the socket might not have room for it
+    void closeNotify(void);
+
+    int socket(void) { return _fd; }
+
+  private:
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _conf;
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_x509_crt _ca;
+    mbedtls_x509_crt _cli_cert;
+    mbedtls_pk_context _cli_key;
+    std::shared_ptr<AsyncTCP_TLS_ServerConfig> _server;
+
+    int _fd = -1;
+    bool _want_write = false;
+    bool _resumable = false;
+    uint16_t _port = 0;
+    char _host[CONFIG_ASYNC_TCP_DNS_NAME_MAX];
+
+    int _seed(void);
+    int _setup(void);
+    void _saveSession(void);
+    void _restoreSession(void);
+    static int _bioSend(void * ctx, const unsigned char * buf, size_t len);
+    static int _bioRecv(void * ctx, unsigned char * buf, size_t len);
+};
+
+#endif /* ASYNC_TCP_SSL_ENABLED */
+
+#endif /* ASYNCTCP_TLS_CONTEXT_H_ */